@@ -0,0 +1,766 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef char bool;
+
+#define false 0
+#define true 1
+
+#ifdef BENCHMARK
+#include "benchmark.c"
+#endif
+
+/*
+refcount_cache.c for any key and value type, without copying the file and editing it:
+
+ CACHE_DEFINE( name, K, key_ops, V, value_ops )
+
+generates the cache type name, and name_new, name_add, name_get, name_release and name_free.
+The ops are prefixes of static inline functions, so the compiler specializes the generated code
+for them and hashing or comparing a key costs what it would cost written out by hand:
+
+ key_ops_hash( const K* ), key_ops_equal( const K*, const K* ) on every lookup
+ key_ops_copy( const K* ) when add takes a key, key_ops_free( K* ) when the item goes
+ value_ops_is_dirty( const V* ) dirty items are evicted after the clean ones
+ value_ops_free( V* ) an evicted value (writing it first, if it's dirty, is up to this)
+
+size_key is for integer keys and hashes them properly (ids don't have to be dense), str_key is
+for strings and keeps the short ones in the table slot itself. The table is the one from
+refcount_cache.c (open addressing, a control byte per slot, backward shift removal) with a
+fixed capacity, and so are the free lists of the refcount 0 items. Not in here: resizing,
+the byte budget, ttl, snapshots.
+*/
+
+typedef struct counter {
+	size_t key_allocs;
+	size_t key_frees;
+	size_t foo_allocs;
+	size_t foo_frees;
+} counter;
+
+static counter counters;
+
+typedef struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t revives; // hits on an item with refcount 0, taken off a free list
+	size_t clean_evictions;
+	size_t dirty_evictions;
+	size_t rejections; // add with every item pinned, so not stored
+} cache_stats;
+
+// every slot has a control byte: either SLOT_EMPTY or the top 7 bits of the hash of its key
+#define SLOT_EMPTY 0x80
+
+// MurmurHash3 64 bit finalizer, the low bits pick the slot and the top 7 bits are the control byte
+static inline size_t cache_hash( size_t i ) {
+
+	size_t h = i;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint8_t cache_hash_tag( size_t h ) {
+	return (uint8_t)(h >> 57);
+}
+
+/********************** KEYS *************************/
+
+static inline size_t size_key_hash( const size_t* k ) {
+	return cache_hash( *k );
+}
+
+static inline bool size_key_equal( const size_t* a, const size_t* b ) {
+	return *a == *b;
+}
+
+static inline size_t size_key_copy( const size_t* k ) {
+	return *k;
+}
+
+static inline void size_key_free( size_t* k ) {
+	(void)k;
+}
+
+/*
+A string key, 32 bytes. Up to STR_KEY_INLINE bytes are in the key itself, so comparing one in the
+table doesn't leave the slot. Longer ones point at the characters: the caller's in a key from
+str_key_of, a copy on the heap once the cache has it.
+*/
+#define STR_KEY_INLINE 24
+
+typedef struct str_key {
+	union {
+		char inline_chars[STR_KEY_INLINE];
+		const char* chars;
+	} u;
+	uint32_t len;
+	bool is_inline;
+	bool owned; // chars is a copy that str_key_free frees
+	char byte_alignment_padding[2];
+} str_key;
+
+// a key for s, only valid as long as s is when it's longer than STR_KEY_INLINE
+static inline str_key str_key_of( const char* s ) {
+
+	str_key k;
+	k.len = (uint32_t)strlen( s );
+	k.is_inline = k.len <= STR_KEY_INLINE;
+	k.owned = false;
+	if( k.is_inline ) {
+		memcpy( k.u.inline_chars, s, k.len );
+	} else {
+		k.u.chars = s;
+	}
+	return k;
+}
+
+static inline const char* str_key_chars( const str_key* k ) {
+	return k->is_inline ? k->u.inline_chars : k->u.chars;
+}
+
+// 8 bytes at a time, then the same finalizer as the integers
+static inline size_t str_key_hash( const str_key* k ) {
+
+	const char* p = str_key_chars( k );
+	size_t h = k->len * 0x9e3779b97f4a7c15;
+	size_t n = k->len;
+	for( ; n >= 8; n -= 8, p += 8 ) {
+		uint64_t w;
+		memcpy( &w, p, 8 );
+		h = (h ^ w) * 0xff51afd7ed558ccd;
+		h ^= h >> 32;
+	}
+	if( n > 0 ) {
+		uint64_t w = 0;
+		memcpy( &w, p, n );
+		h = (h ^ w) * 0xff51afd7ed558ccd;
+	}
+	return cache_hash( h );
+}
+
+static inline bool str_key_equal( const str_key* a, const str_key* b ) {
+	return a->len == b->len && memcmp( str_key_chars( a ), str_key_chars( b ), a->len ) == 0;
+}
+
+static inline str_key str_key_copy( const str_key* k ) {
+
+	str_key copy = *k;
+	if( !k->is_inline ) {
+		char* chars = (char*) malloc( k->len );
+		assert( chars );
+		memcpy( chars, k->u.chars, k->len );
+		copy.u.chars = chars;
+		copy.owned = true;
+		counters.key_allocs++;
+	}
+	return copy;
+}
+
+static inline void str_key_free( str_key* k ) {
+
+	if( k->owned ) {
+		free( (char*)k->u.chars );
+		counters.key_frees++;
+	}
+}
+
+/********************** CACHE *************************/
+
+#define CACHE_DEFINE( name, K, key_ops, V, value_ops ) \
+\
+/* doubly linked list of refcount==0 entries */ \
+typedef struct name##_free_entry { \
+	V* value; \
+	struct name##_entry* slot; \
+	struct name##_free_entry* next; \
+	struct name##_free_entry* prev; \
+} name##_free_entry; \
+\
+typedef struct name##_entry { \
+	K key; \
+	union { \
+		V* value; \
+		name##_free_entry* free; \
+	} ptr; \
+	size_t refcount; \
+} name##_entry; \
+\
+typedef struct name { \
+	uint8_t* control; \
+	name##_entry* slots; \
+	size_t slot_mask; /* number of slots - 1 */ \
+	size_t capacity; \
+	size_t num_stored; \
+	name##_free_entry* free_list; \
+	name##_free_entry* free_list_dirty; \
+	name##_free_entry* free_entries; /* one node per item */ \
+	size_t num_free_entries; /* used part of free_entries */ \
+	name##_free_entry* unused_free_entries; /* singly linked through next */ \
+	cache_stats stats; \
+} name; \
+\
+/* at most 7/8 full, so there is always an empty slot to end a probe */ \
+static inline name* name##_new( size_t capacity ) { \
+\
+	assert( capacity > 0 ); \
+	size_t num_slots = 1; \
+	while( num_slots * 7 / 8 < capacity ) { \
+		num_slots *= 2; \
+	} \
+	name* c = (name*) malloc( sizeof(name) ); \
+	assert( c ); \
+	c->control = (uint8_t*) malloc( num_slots ); \
+	c->slots = (name##_entry*) malloc( num_slots * sizeof(name##_entry) ); \
+	c->free_entries = (name##_free_entry*) malloc( capacity * sizeof(name##_free_entry) ); \
+	assert( c->control && c->slots && c->free_entries ); \
+	memset( c->control, SLOT_EMPTY, num_slots ); \
+	c->slot_mask = num_slots - 1; \
+	c->capacity = capacity; \
+	c->num_stored = 0; \
+	c->free_list = NULL; \
+	c->free_list_dirty = NULL; \
+	c->num_free_entries = 0; \
+	c->unused_free_entries = NULL; \
+	memset( &c->stats, 0, sizeof(cache_stats) ); \
+	return c; \
+} \
+\
+/* frees every key and value too, pinned or not */ \
+static inline void name##_free( name* c ) { \
+\
+	for( size_t s=0; s<=c->slot_mask; s++ ) { \
+		if( c->control[s] == SLOT_EMPTY ) { \
+			continue; \
+		} \
+		name##_entry* e = &c->slots[s]; \
+		key_ops##_free( &e->key ); \
+		value_ops##_free( e->refcount ? e->ptr.value : e->ptr.free->value ); \
+	} \
+	free( c->control ); \
+	free( c->slots ); \
+	free( c->free_entries ); \
+	free( c ); \
+} \
+\
+static inline name##_entry* name##_find( name* c, const K* key, size_t h ) { \
+\
+	uint8_t tag = cache_hash_tag( h ); \
+	for( size_t s = h & c->slot_mask; c->control[s] != SLOT_EMPTY; s = (s + 1) & c->slot_mask ) { \
+		if( c->control[s] == tag && key_ops##_equal( &c->slots[s].key, key ) ) { \
+			return &c->slots[s]; \
+		} \
+	} \
+	return NULL; \
+} \
+\
+/* backward shift, see remove_slot in refcount_cache.c */ \
+static inline void name##_remove_slot( name* c, size_t hole ) { \
+\
+	for( size_t next = (hole + 1) & c->slot_mask; c->control[next] != SLOT_EMPTY; next = (next + 1) & c->slot_mask ) { \
+		size_t home = key_ops##_hash( &c->slots[next].key ) & c->slot_mask; \
+		if( ((next - home) & c->slot_mask) >= ((next - hole) & c->slot_mask) ) { \
+			c->control[hole] = c->control[next]; \
+			c->slots[hole] = c->slots[next]; \
+			if( c->slots[hole].refcount == 0 ) { \
+				c->slots[hole].ptr.free->slot = &c->slots[hole]; \
+			} \
+			hole = next; \
+		} \
+	} \
+	c->control[hole] = SLOT_EMPTY; \
+	c->num_stored--; \
+} \
+\
+static inline void name##_unlink( name##_free_entry** list, name##_free_entry* fe ) { \
+\
+	if( fe->next == fe ) { \
+		*list = NULL; \
+		return; \
+	} \
+	fe->prev->next = fe->next; \
+	fe->next->prev = fe->prev; \
+	if( *list == fe ) { \
+		*list = fe->next; \
+	} \
+} \
+\
+/* evicts the head of a free list (the last one released) */ \
+static inline void name##_evict( name* c, name##_free_entry** list ) { \
+\
+	name##_free_entry* fe = *list; \
+	name##_unlink( list, fe ); \
+	name##_entry* e = fe->slot; \
+	key_ops##_free( &e->key ); \
+	value_ops##_free( fe->value ); \
+	name##_remove_slot( c, (size_t)(e - c->slots) ); \
+	fe->next = c->unused_free_entries; \
+	c->unused_free_entries = fe; \
+} \
+\
+/* clean ones first, false when everything is pinned */ \
+static inline bool name##_evict_any( name* c ) { \
+\
+	if( c->free_list != NULL ) { \
+		name##_evict( c, &c->free_list ); \
+		c->stats.clean_evictions++; \
+	} else if( c->free_list_dirty != NULL ) { \
+		name##_evict( c, &c->free_list_dirty ); \
+		c->stats.dirty_evictions++; \
+	} else { \
+		return false; \
+	} \
+	return true; \
+} \
+\
+/* the cache keeps a copy of key, value is pinned once. false if everything is pinned */ \
+static inline bool name##_add( name* c, K key, V* value ) { \
+\
+	if( c->num_stored >= c->capacity && !name##_evict_any( c ) ) { \
+		c->stats.rejections++; \
+		return false; \
+	} \
+	size_t h = key_ops##_hash( &key ); \
+	size_t s = h & c->slot_mask; \
+	while( c->control[s] != SLOT_EMPTY ) { \
+		s = (s + 1) & c->slot_mask; \
+	} \
+	c->control[s] = cache_hash_tag( h ); \
+	name##_entry* e = &c->slots[s]; \
+	e->key = key_ops##_copy( &key ); \
+	e->ptr.value = value; \
+	e->refcount = 1; \
+	c->num_stored++; \
+	return true; \
+} \
+\
+static inline V* name##_get( name* c, K key ) { \
+\
+	name##_entry* e = name##_find( c, &key, key_ops##_hash( &key ) ); \
+	if( e == NULL ) { \
+		c->stats.misses++; \
+		return NULL; \
+	} \
+	if( e->refcount == 0 ) { \
+		name##_free_entry* fe = e->ptr.free; \
+		name##_unlink( value_ops##_is_dirty( fe->value ) ? &c->free_list_dirty : &c->free_list, fe ); \
+		e->ptr.value = fe->value; \
+		fe->next = c->unused_free_entries; \
+		c->unused_free_entries = fe; \
+		c->stats.revives++; \
+	} \
+	e->refcount++; \
+	c->stats.hits++; \
+	return e->ptr.value; \
+} \
+\
+/* a value that isn't in the cache (add said no) is freed */ \
+static inline void name##_release( name* c, V* value, K key ) { \
+\
+	name##_entry* e = name##_find( c, &key, key_ops##_hash( &key ) ); \
+	if( e == NULL ) { \
+		value_ops##_free( value ); \
+		return; \
+	} \
+	assert( e->refcount > 0 ); \
+	if( --e->refcount > 0 ) { \
+		return; \
+	} \
+	name##_free_entry* fe = c->unused_free_entries; \
+	if( fe != NULL ) { \
+		c->unused_free_entries = fe->next; \
+	} else { \
+		assert( c->num_free_entries < c->capacity ); \
+		fe = &c->free_entries[c->num_free_entries++]; \
+	} \
+	fe->value = e->ptr.value; \
+	fe->slot = e; \
+	e->ptr.free = fe; \
+	name##_free_entry** list = value_ops##_is_dirty( fe->value ) ? &c->free_list_dirty : &c->free_list; \
+	if( *list == NULL ) { \
+		fe->next = fe; \
+		fe->prev = fe; \
+	} else { \
+		fe->next = *list; \
+		fe->prev = (*list)->prev; \
+		(*list)->prev = fe; \
+		fe->prev->next = fe; \
+	} \
+	*list = fe; \
+}
+
+/********************** TESTS *************************/
+
+// test item to store, the same size as refcount_cache.c's
+typedef struct foo {
+	size_t b;
+	bool is_dirty;
+	char padding[263];
+} foo;
+
+static foo* new_foo( size_t b, bool is_dirty ) {
+
+	foo* f = (foo*) malloc( sizeof(foo) );
+	assert( f );
+	f->b = b;
+	f->is_dirty = is_dirty;
+	counters.foo_allocs++;
+	return f;
+}
+
+static inline bool foo_is_dirty( const foo* f ) {
+	return f->is_dirty;
+}
+
+static inline void foo_free( foo* f ) {
+
+	counters.foo_frees++;
+	free( f );
+}
+
+CACHE_DEFINE( id_cache, size_t, size_key, foo, foo )
+
+CACHE_DEFINE( str_cache, str_key, str_key, foo, foo )
+
+static void checks() {
+
+	printf( "foo allocs/frees = %lu/%lu, key allocs/frees = %lu/%lu\n", counters.foo_allocs, counters.foo_frees, counters.key_allocs, counters.key_frees );
+	assert( counters.foo_allocs == counters.foo_frees );
+	assert( counters.key_allocs == counters.key_frees );
+
+}
+
+// every stored key has to be reachable from its home slot, and every free entry has to point back at its slot
+static void check_str_cache( str_cache* c ) {
+
+	size_t stored = 0, free_entries = 0;
+	for( size_t s=0; s<=c->slot_mask; s++ ) {
+		if( c->control[s] != SLOT_EMPTY ) {
+			stored++;
+			str_key* key = &c->slots[s].key;
+			assert( str_cache_find( c, key, str_key_hash( key ) ) == &c->slots[s] );
+			if( c->slots[s].refcount == 0 ) {
+				assert( c->slots[s].ptr.free->slot == &c->slots[s] );
+				free_entries++;
+			}
+		}
+	}
+	assert( stored == c->num_stored && stored <= c->capacity );
+	str_cache_free_entry* lists[2] = { c->free_list, c->free_list_dirty };
+	for( int l=0; l<2; l++ ) {
+		str_cache_free_entry* current = lists[l];
+		if( current != NULL ) {
+			do {
+				assert( current->value->is_dirty == (l == 1) );
+				free_entries--;
+				current = current->next;
+			} while( current != lists[l] );
+		}
+	}
+	assert( free_entries == 0 );
+
+}
+
+// the same behaviour as refcount_cache.c: hits pin, clean items go first, pinned ones never
+static void test_id_cache() {
+
+	printf("==== Integer keys ====\n");
+	id_cache* c = id_cache_new( 8 );
+	// sparse ids, nothing assumes they're dense
+	for( size_t i=1; i<=8; i++ ) {
+		assert( id_cache_add( c, i * 1000003, new_foo( i, i % 2 == 0 ) ) );
+	}
+	for( size_t i=1; i<=8; i++ ) {
+		foo* f = id_cache_get( c, i * 1000003 );
+		assert( f && f->b == i );
+		id_cache_release( c, f, i * 1000003 );
+		id_cache_release( c, f, i * 1000003 );
+	}
+	assert( id_cache_get( c, 1000003 + 1 ) == NULL );
+	assert( c->stats.hits == 8 && c->stats.misses == 1 && c->stats.revives == 0 );
+
+	// full: the clean ones go first, the last one released first
+	assert( id_cache_add( c, 9, new_foo( 9, false ) ) );
+	assert( id_cache_get( c, 7 * 1000003 ) == NULL && c->stats.clean_evictions == 1 );
+	for( size_t i=10; i<=13; i++ ) {
+		assert( id_cache_add( c, i, new_foo( i, false ) ) );
+	}
+	assert( c->stats.clean_evictions == 4 && c->stats.dirty_evictions == 1 );
+
+	// a revived item is pinned again, so it stays
+	foo* f = id_cache_get( c, 2 * 1000003 );
+	assert( f && f->b == 2 && c->stats.revives == 1 );
+	for( size_t i=14; i<=15; i++ ) {
+		assert( id_cache_add( c, i, new_foo( i, false ) ) );
+	}
+	assert( c->stats.dirty_evictions == 3 );
+
+	// everything pinned, a release of the one that didn't fit frees it
+	foo* rejected = new_foo( 16, false );
+	assert( !id_cache_add( c, 16, rejected ) && c->stats.rejections == 1 );
+	id_cache_release( c, rejected, 16 );
+	assert( id_cache_get( c, 2 * 1000003 ) == f );
+
+	id_cache_free( c );
+	checks();
+
+}
+
+// short keys stay in the slot, long ones are copied, and a lookup key doesn't have to be the same memory
+static void test_str_cache() {
+
+	printf("==== String keys ====\n");
+	str_cache* c = str_cache_new( 4 );
+	char short_key[] = "user:42";
+	char long_key[] = "session:0123456789abcdef0123456789abcdef";
+	size_t allocs = counters.key_allocs;
+	assert( str_cache_add( c, str_key_of( short_key ), new_foo( 1, false ) ) );
+	assert( counters.key_allocs == allocs );
+	assert( str_cache_add( c, str_key_of( long_key ), new_foo( 2, true ) ) );
+	assert( counters.key_allocs == allocs + 1 );
+	str_cache_release( c, NULL, str_key_of( short_key ) );
+	str_cache_release( c, NULL, str_key_of( long_key ) );
+
+	// the cache has its own copies
+	char lookup[64];
+	strcpy( lookup, long_key );
+	long_key[0] = 'X';
+	short_key[0] = 'X';
+	foo* f = str_cache_get( c, str_key_of( lookup ) );
+	assert( f && f->b == 2 );
+	str_cache_release( c, f, str_key_of( lookup ) );
+	assert( str_cache_get( c, str_key_of( "user:42" ) )->b == 1 );
+	str_cache_release( c, NULL, str_key_of( "user:42" ) );
+	assert( str_cache_get( c, str_key_of( long_key ) ) == NULL );
+
+	// the same bytes at the inline limit and past it are different keys
+	char at_limit[STR_KEY_INLINE + 2];
+	memset( at_limit, 'k', STR_KEY_INLINE + 1 );
+	at_limit[STR_KEY_INLINE + 1] = '\0';
+	assert( str_cache_add( c, str_key_of( at_limit ), new_foo( 3, false ) ) );
+	at_limit[STR_KEY_INLINE] = '\0';
+	assert( str_cache_get( c, str_key_of( at_limit ) ) == NULL );
+	assert( str_cache_add( c, str_key_of( at_limit ), new_foo( 4, false ) ) );
+	assert( str_cache_get( c, str_key_of( at_limit ) )->b == 4 );
+	str_cache_release( c, NULL, str_key_of( at_limit ) );
+	str_cache_release( c, NULL, str_key_of( at_limit ) );
+	check_str_cache( c );
+
+	str_cache_free( c );
+	checks();
+
+}
+
+// lots of random add/get/release with evictions, so runs in the table get shifted around
+static void test_str_churn() {
+
+	printf("==== String key churn ====\n");
+	str_cache* c = str_cache_new( 100 );
+	srand( 1234 );
+	foo* pinned[20] = { NULL };
+	size_t pinned_keys[20];
+	char buf[64];
+	for( size_t n=0; n<100000; n++ ) {
+		size_t k = (size_t)rand() % 400;
+		// every third key too long to be inline
+		snprintf( buf, sizeof(buf), k % 3 == 0 ? "a key that is too long to fit inline %lu" : "key %lu", k );
+		foo* f = str_cache_get( c, str_key_of( buf ) );
+		if( f == NULL ) {
+			f = new_foo( k, rand() % 2 );
+			if( !str_cache_add( c, str_key_of( buf ), f ) ) {
+				str_cache_release( c, f, str_key_of( buf ) );
+				continue;
+			}
+		}
+		assert( f->b == k );
+		// hold on to some for a while
+		size_t p = (size_t)rand() % 20;
+		if( pinned[p] ) {
+			snprintf( buf, sizeof(buf), pinned_keys[p] % 3 == 0 ? "a key that is too long to fit inline %lu" : "key %lu", pinned_keys[p] );
+			str_cache_release( c, pinned[p], str_key_of( buf ) );
+		}
+		pinned[p] = f;
+		pinned_keys[p] = k;
+		if( n % 1000 == 0 ) {
+			check_str_cache( c );
+		}
+	}
+	check_str_cache( c );
+	printf("hits %lu, misses %lu, revives %lu, evictions %lu clean %lu dirty\n", c->stats.hits, c->stats.misses, c->stats.revives, c->stats.clean_evictions, c->stats.dirty_evictions );
+	assert( c->stats.clean_evictions > 0 && c->stats.dirty_evictions > 0 && c->stats.revives > 0 );
+
+	str_cache_free( c );
+	checks();
+
+}
+
+/********************** BENCHMARK *************************/
+
+#ifdef BENCHMARK
+
+// what refcount_cache.c's 64MB benchmark cache holds, so the tables are the same size
+#define BENCHMARK_CAPACITY 189235
+
+typedef struct lookup_params {
+	id_cache* ids;
+	size_t* id_keys;
+	str_cache* strs;
+	str_key* str_keys;
+	size_t num_keys;
+	size_t found;
+} lookup_params;
+
+// get and release every key, the same loop as refcount_cache.c's lookup_benchmark
+static void id_lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	for( size_t i=0; i<p->num_keys; i++ ) {
+		foo* f = id_cache_get( p->ids, p->id_keys[i] );
+		if( f ) {
+			p->found++;
+			id_cache_release( p->ids, f, p->id_keys[i] );
+		}
+	}
+
+}
+
+static void str_lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	for( size_t i=0; i<p->num_keys; i++ ) {
+		foo* f = str_cache_get( p->strs, p->str_keys[i] );
+		if( f ) {
+			p->found++;
+			str_cache_release( p->strs, f, p->str_keys[i] );
+		}
+	}
+
+}
+
+// fills in hits/s, misses/s and revives/s
+static void run_id_benchmark( double* results ) {
+
+	id_cache* c = id_cache_new( BENCHMARK_CAPACITY );
+	// sparse keys, so they don't just land in consecutive slots
+	for( size_t i=0; i<c->capacity; i++ ) {
+		id_cache_add( c, i * 2, new_foo( i, false ) );
+	}
+	size_t num_keys = 1000 * 1000;
+	size_t* hit_keys = (size_t*) malloc( num_keys * sizeof(size_t) );
+	size_t* miss_keys = (size_t*) malloc( num_keys * sizeof(size_t) );
+	srand( 1234 );
+	for( size_t i=0; i<num_keys; i++ ) {
+		size_t r = ((size_t)rand() << 16 ^ (size_t)rand()) % c->capacity;
+		hit_keys[i] = r * 2;
+		miss_keys[i] = r * 2 + 1;
+	}
+
+	lookup_params hits = { .ids = c, .id_keys = hit_keys, .num_keys = num_keys };
+	lookup_params misses = { .ids = c, .id_keys = miss_keys, .num_keys = num_keys };
+	benchmark bh = run_benchmark( "hit", id_lookup_benchmark, &hits );
+	benchmark bm = run_benchmark( "miss", id_lookup_benchmark, &misses );
+	assert( hits.found == num_keys * bh.runs && misses.found == 0 );
+	for( size_t i=0; i<c->capacity; i++ ) {
+		id_cache_release( c, NULL, i * 2 );
+	}
+	lookup_params revives = { .ids = c, .id_keys = hit_keys, .num_keys = num_keys };
+	benchmark br = run_benchmark( "revive", id_lookup_benchmark, &revives );
+	assert( revives.found == num_keys * br.runs );
+	results[0] = num_keys / bh.average_seconds;
+	results[1] = num_keys / bm.average_seconds;
+	results[2] = num_keys / br.average_seconds;
+
+	free( hit_keys );
+	free( miss_keys );
+	id_cache_free( c );
+
+}
+
+// the same with string keys, all of them inline or all of them on the heap
+static void run_str_benchmark( const char* format, double* results ) {
+
+	str_cache* c = str_cache_new( BENCHMARK_CAPACITY );
+	char** names = (char**) malloc( 2 * c->capacity * sizeof(char*) );
+	for( size_t i=0; i<2 * c->capacity; i++ ) {
+		names[i] = (char*) malloc( 64 );
+		snprintf( names[i], 64, format, i );
+	}
+	for( size_t i=0; i<c->capacity; i++ ) {
+		str_cache_add( c, str_key_of( names[i * 2] ), new_foo( i, false ) );
+	}
+	size_t num_keys = 1000 * 1000;
+	str_key* hit_keys = (str_key*) malloc( num_keys * sizeof(str_key) );
+	str_key* miss_keys = (str_key*) malloc( num_keys * sizeof(str_key) );
+	srand( 1234 );
+	for( size_t i=0; i<num_keys; i++ ) {
+		size_t r = ((size_t)rand() << 16 ^ (size_t)rand()) % c->capacity;
+		hit_keys[i] = str_key_of( names[r * 2] );
+		miss_keys[i] = str_key_of( names[r * 2 + 1] );
+	}
+
+	lookup_params hits = { .strs = c, .str_keys = hit_keys, .num_keys = num_keys };
+	lookup_params misses = { .strs = c, .str_keys = miss_keys, .num_keys = num_keys };
+	benchmark bh = run_benchmark( "hit", str_lookup_benchmark, &hits );
+	benchmark bm = run_benchmark( "miss", str_lookup_benchmark, &misses );
+	assert( hits.found == num_keys * bh.runs && misses.found == 0 );
+	for( size_t i=0; i<c->capacity; i++ ) {
+		str_cache_release( c, NULL, str_key_of( names[i * 2] ) );
+	}
+	lookup_params revives = { .strs = c, .str_keys = hit_keys, .num_keys = num_keys };
+	benchmark br = run_benchmark( "revive", str_lookup_benchmark, &revives );
+	assert( revives.found == num_keys * br.runs );
+	results[0] = num_keys / bh.average_seconds;
+	results[1] = num_keys / bm.average_seconds;
+	results[2] = num_keys / br.average_seconds;
+
+	free( hit_keys );
+	free( miss_keys );
+	size_t num_names = 2 * c->capacity;
+	str_cache_free( c );
+	for( size_t i=0; i<num_names; i++ ) {
+		free( names[i] );
+	}
+	free( names );
+
+}
+
+static void run_lookup_benchmark() {
+
+	double results[3][3];
+	run_id_benchmark( results[0] );
+	run_str_benchmark( "key %lu", results[1] );
+	run_str_benchmark( "a key that is too long to fit inline %lu", results[2] );
+
+	const char* names[3] = { "size_t", "string, inline", "string, heap" };
+	printf("%d items\n", BENCHMARK_CAPACITY );
+	printf("keys\t\thit lookups/s\tmiss lookups/s\trevives/s\n");
+	for( int n=0; n<3; n++ ) {
+		printf("%-16s%.0f\t%.0f\t%.0f\n", names[n], results[n][0], results[n][1], results[n][2] );
+	}
+
+}
+
+#endif
+
+int main() {
+
+#ifdef BENCHMARK
+	run_lookup_benchmark();
+	return 0;
+#endif
+
+	test_id_cache();
+
+	test_str_cache();
+
+	test_str_churn();
+
+	return 0;
+}
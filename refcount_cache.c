@@ -1,14 +1,34 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 typedef char bool;
 
 #define false 0
 #define true 1
 
+#ifdef BENCHMARK
+#include "benchmark.c"
+// big enough that the table doesn't fit in cache
+#define CACHE_MEMORY_BYTES (64*1024*1024)
+#endif
+
+// budget the tests use
+#ifndef CACHE_MEMORY_BYTES
 #define CACHE_MEMORY_BYTES 4096
+#endif
+
+// tracing of the hot paths, see trace.c for the levels and the event ring
+#include "trace.c"
+
+// file format of cache_snapshot/cache_restore
+#include "snapshot.c"
 
 typedef struct counter {
 	size_t foo_allocs;
@@ -17,6 +37,10 @@ typedef struct counter {
 	size_t entry_frees;
 	size_t free_entry_allocs;
 	size_t free_entry_frees;
+	size_t eviction_writes; // dirty items written because they were evicted
+	size_t cleaner_writes; // and ones written before that (see clean_items)
+	size_t foo_chunk_allocs; // payload slab chunks (see use_foo_slab)
+	size_t foo_chunk_frees;
 } counter;
 
 static counter counters;
@@ -29,6 +53,10 @@ static void print_counters() {
 	printf("Entry frees: %lu\n", counters.entry_frees);
 	printf("Free entry allocs: %lu\n", counters.free_entry_allocs);
 	printf("Free entry frees: %lu\n", counters.free_entry_frees);
+	printf("Eviction writes: %lu\n", counters.eviction_writes);
+	printf("Cleaner writes: %lu\n", counters.cleaner_writes);
+	printf("Foo chunk allocs: %lu\n", counters.foo_chunk_allocs);
+	printf("Foo chunk frees: %lu\n", counters.foo_chunk_frees);
 	
 }
 
@@ -37,18 +65,32 @@ static void print_counters() {
 typedef struct foo {
 	size_t b;
 	bool is_dirty;
-	char padding[256];
+	uint32_t size; // bytes it stands for, only read with a byte budget (see set_byte_budget)
+	uint64_t expires; // tick it expires at, only with a ttl (see set_ttl)
+	char padding[248];
 } foo;
 
 // doubly linked list of refcount==0 entries in cache
 typedef struct free_entry {
 	foo* evictable_foo;
-	size_t key;
+	struct entry* slot; // where the entry is in the table, so evicting doesn't need a lookup
 	struct free_entry* next;
 	struct free_entry* prev;
 } free_entry;
 
-// bucket entries
+// the free_entry nodes of a cache with a ttl (see set_ttl), with the timing wheel slot they're in,
+// so a cache without one doesn't pay for the links. wheel_pprev is NULL when it isn't on the wheel
+typedef struct timed_free_entry {
+	free_entry fe;
+	free_entry* wheel_next;
+	free_entry** wheel_pprev;
+} timed_free_entry;
+
+static inline timed_free_entry* timed( free_entry* fe ) {
+	return (timed_free_entry*)fe;
+}
+
+// table slots, stored inline in one array (open addressing, linear probing)
 typedef struct entry {
 
 	union {
@@ -56,62 +98,416 @@ typedef struct entry {
 		free_entry* to_free_entry;
 	} ptr;
 	size_t key;
-	size_t refcount;
-	struct entry* next;
+	uint32_t refcount;
+	uint32_t generation; // a number no other item got, for telling handles apart (see cache_handle)
 } entry;
 
-#define BYTES_PER_CACHE_ITEM (sizeof(entry*) + sizeof(entry) + sizeof(free_entry) + sizeof(foo))
-#define CACHE_SIZE (CACHE_MEMORY_BYTES / BYTES_PER_CACHE_ITEM)
+// every slot has a control byte: either SLOT_EMPTY or the top 7 bits of the hash of the key
+// in that slot, so probing mostly skips non-matching slots without loading the entry
+#define SLOT_EMPTY 0x80
+
+/*
+Lookups can probe a group of control bytes at once: compare 16 (SSE2) or 32 (AVX2) of them
+with the tag in one instruction, and find the first empty one from the same load (SLOT_EMPTY
+is the only control byte with the top bit set). A miss is then mostly one group, and no key
+is loaded unless its tag matches. The first CONTROL_CLONES control bytes are repeated after
+the last one, so a group that starts near the end of the table doesn't have to wrap (in a table
+smaller than a group the clones repeat it). Which probe runs is picked at runtime by new_cache
+(best_probe), the scalar one works everywhere.
+*/
+#define CONTROL_CLONES 31
+
+typedef enum probe_kind {
+	PROBE_SCALAR,
+	PROBE_SSE2,
+	PROBE_AVX2
+} probe_kind;
+
+static int probe = -1; // set by new_cache the first time, unless it was set before
+
+// the widest probe this CPU can run
+static probe_kind best_probe( void ) {
+
+#ifdef __SSE2__
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx2" ) ) {
+		return PROBE_AVX2;
+	}
+	return PROBE_SSE2;
+#else
+	return PROBE_SCALAR;
+#endif
+}
+
+// memory per stored item, and per slot in the table (there are more slots than items, the clones aren't counted)
+#define BYTES_PER_CACHE_ITEM (sizeof(free_entry) + sizeof(foo))
+#define BYTES_PER_SLOT (sizeof(uint8_t) + sizeof(entry))
+
+// items moved to the new table by every operation while resizing
+#define REHASH_STEP 4
+
+// the timing wheel for set_ttl: WHEEL_LEVELS levels of WHEEL_SLOTS slots, so it reaches 2^24 ticks ahead
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct table {
+	uint8_t* control;
+	entry* slots;
+	size_t slot_mask; // number of slots - 1 (number of slots is a power of 2)
+	size_t num_stored;
+} table;
+
+// counted as things happen (plain counters, the cache isn't thread safe), so a snapshot doesn't walk anything
+typedef struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t revives; // hits on an item with refcount 0, taken off a free list
+	size_t clean_evictions;
+	size_t dirty_evictions;
+	size_t rejections; // add_item with every item pinned, so not stored
+	size_t expirations; // past their ttl, taken by expire_items or by a get_item that found one
+	size_t lookups;
+	size_t probes; // slots looked at by all lookups
+	size_t max_probes; // most slots one lookup looked at
+	// filled in by cache_stats_snapshot
+	double avg_probes;
+	size_t stored;
+	size_t pinned;
+	size_t bytes; // sizes of the stored items, with a byte budget
+	size_t pinned_bytes;
+} cache_stats;
 
 typedef struct cache {
-	entry* buckets[ CACHE_SIZE ];
+	// while resizing, items move from tables[0] to tables[1] a few at a time (see rehash_step)
+	table tables[2];
+	bool rehashing;
+	size_t rehash_index; // next slot of tables[0] to move
+	size_t capacity; // max number of items
 	size_t num_stored;
+	size_t byte_budget; // 0: only the number of items limits the cache
+	size_t bytes_stored;
+	size_t bytes_free; // of the items on the free lists
 	free_entry* free_list;
 	free_entry* free_list_dirty;
+	size_t num_free_clean;
+	size_t num_free_dirty;
+	free_entry* free_entry_slabs; // one node per item, the byte budget already counts them
+	size_t num_free_entries;
+	size_t free_entry_size; // sizeof(free_entry), or of timed_free_entry with a ttl
+	char* slab_next; // never used part of the last slab
+	char* slab_end;
+	free_entry* unused_free_entries; // singly linked through next
+	uint32_t next_generation; // for the next item added
+	// payload slab (see use_foo_slab), otherwise foos come from malloc
+	bool foo_slab;
+	bool hugepages;
+	struct foo_chunk* foo_chunks;
+	foo* unused_foos; // singly linked through the first bytes of the foo
+	size_t num_foos;
+	// ttl (see set_ttl), every free item is on the wheel then
+	uint64_t ttl; // 0: items don't expire
+	uint64_t now; // the clock, moved by expire_items
+	uint64_t wheel_time; // next tick the wheel hasn't expired yet
+	free_entry* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+	cache_stats stats;
 } cache;
 
 
-// MurmurHash3 integer finalizer MOD cache buckets
+// MurmurHash3 64 bit finalizer, the low bits pick the slot and the top 7 bits are the control byte
 static size_t hash(size_t i) {
 
 	size_t h = i;
-	h ^= h >> 16;
-	h *= 0x85ebca6b;
-	h ^= h >> 13;
-	h *= 0xc2b2ae35;
-	h ^= h >> 16;
-	return h % CACHE_SIZE;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+	return h;
 }
 
+static inline uint8_t hash_tag( size_t h ) {
+	return (uint8_t)(h >> 57);
+}
 
-static cache* new_cache() {
+// pick the number of slots (a power of 2) that leaves room for the most items, with
+// the table at most 7/8 full so there is always an empty slot to end a probe
+static size_t slots_for_budget( size_t memory_budget, size_t* capacity ) {
 	
-	printf("Bytes per item: %lu, cache mem: %d, cache_size= %lu\n", BYTES_PER_CACHE_ITEM, CACHE_MEMORY_BYTES, CACHE_SIZE);
+	size_t num_slots = 1;
+	*capacity = 0;
+	for( size_t slots = 1; slots * BYTES_PER_SLOT <= memory_budget; slots *= 2 ) {
+		size_t fits = (memory_budget - slots * BYTES_PER_SLOT) / BYTES_PER_CACHE_ITEM;
+		if( fits > slots * 7 / 8 ) {
+			fits = slots * 7 / 8;
+		}
+		if( fits > *capacity ) {
+			*capacity = fits;
+			num_slots = slots;
+		}
+	}
 	
+	return num_slots;
+}
+
+static void init_table( table* t, size_t num_slots ) {
+
+	t->control = (uint8_t*) malloc( (num_slots + CONTROL_CLONES) * sizeof(uint8_t) );
+	t->slots = (entry*) malloc( num_slots * sizeof(entry) );
+	memset( t->control, SLOT_EMPTY, (num_slots + CONTROL_CLONES) * sizeof(uint8_t) );
+	t->slot_mask = num_slots - 1;
+	t->num_stored = 0;
+}
+
+// and its clones, if it has any
+static inline void set_control( table* t, size_t s, uint8_t value ) {
+
+	t->control[s] = value;
+	for( size_t k = s + t->slot_mask + 1; k < t->slot_mask + 1 + CONTROL_CLONES; k += t->slot_mask + 1 ) {
+		t->control[k] = value;
+	}
+}
+
+static void free_table( table* t ) {
+
+	free( t->control );
+	free( t->slots );
+	t->control = NULL;
+	t->slots = NULL;
+}
+
+// make sure there is a free_entry node for every item. They come in slabs that are handed
+// out front to back, so a big slab isn't touched all at once. The first node of every slab
+// links the slabs together so free_cache can find them
+static void grow_free_entries( cache* c, size_t capacity ) {
+
+	if( capacity <= c->num_free_entries ) {
+		return;
+	}
+
+	// whatever is left of the last slab goes on the unused list first
+	while( c->slab_next < c->slab_end ) {
+		free_entry* fe = (free_entry*)c->slab_next;
+		c->slab_next += c->free_entry_size;
+		fe->next = c->unused_free_entries;
+		c->unused_free_entries = fe;
+	}
+
+	size_t n = capacity - c->num_free_entries;
+	char* slab = (char*) malloc( (n + 1) * c->free_entry_size );
+	((free_entry*)slab)->next = c->free_entry_slabs;
+	c->free_entry_slabs = (free_entry*)slab;
+	c->slab_next = slab + c->free_entry_size;
+	c->slab_end = slab + (n + 1) * c->free_entry_size;
+	c->num_free_entries = capacity;
+}
+
+static void free_free_entries( cache* c ) {
+
+	while( c->free_entry_slabs ) {
+		free_entry* next = c->free_entry_slabs[0].next;
+		free( c->free_entry_slabs );
+		c->free_entry_slabs = next;
+	}
+	c->num_free_entries = 0;
+	c->slab_next = NULL;
+	c->slab_end = NULL;
+	c->unused_free_entries = NULL;
+}
+
+static cache* new_cache( size_t memory_budget ) {
+
+	size_t capacity;
+	size_t num_slots = slots_for_budget( memory_budget, &capacity );
+	assert( capacity > 0 );
+
+	printf("Bytes per item: %lu, per slot: %lu, cache mem: %lu, cache_size= %lu, slots= %lu\n", BYTES_PER_CACHE_ITEM, BYTES_PER_SLOT, memory_budget, capacity, num_slots);
+
+	if( probe < 0 ) {
+		probe = best_probe();
+	}
 	cache* store = (cache*) malloc( sizeof(cache) );
-	memset( store->buckets, 0, sizeof(store->buckets) );
+	init_table( &store->tables[0], num_slots );
+	store->rehashing = false;
+	store->rehash_index = 0;
+	store->capacity = capacity;
 	store->num_stored = 0;
+	store->byte_budget = 0;
+	store->bytes_stored = 0;
+	store->bytes_free = 0;
 	store->free_list = NULL;
 	store->free_list_dirty = NULL;
+	store->num_free_clean = 0;
+	store->num_free_dirty = 0;
+
+	store->free_entry_slabs = NULL;
+	store->num_free_entries = 0;
+	store->free_entry_size = sizeof(free_entry);
+	store->slab_next = NULL;
+	store->slab_end = NULL;
+	store->unused_free_entries = NULL;
+	store->next_generation = 0;
+	store->foo_slab = false;
+	store->hugepages = false;
+	store->foo_chunks = NULL;
+	store->unused_foos = NULL;
+	store->num_foos = 0;
+	store->ttl = 0;
+	store->now = 0;
+	store->wheel_time = 0;
+	memset( store->wheel, 0, sizeof(store->wheel) );
+	memset( &store->stats, 0, sizeof(cache_stats) );
+	grow_free_entries( store, capacity );
 	return store;
 }
 
+/*
+Payload slab: with use_foo_slab the cache hands out the foos itself (cache_alloc_item) from big
+chunks, and takes them back on a free list instead of free(), so in steady state adding and
+evicting items never goes to the allocator. A full cache evicts in cache_alloc_item already, so
+the new item gets the slot of the one it replaces. Chunks are only given back by free_cache.
+With hugepages the chunks are 2MB pages (MAP_HUGETLB, or transparent huge pages if none are
+reserved). Once it's on, every foo given to the cache has to come from cache_alloc_item.
+*/
+#define HUGE_PAGE (2*1024*1024)
+
+typedef struct foo_chunk {
+	struct foo_chunk* next;
+	size_t bytes;
+	bool mapped;
+} foo_chunk;
+
+// foos for n more items
+static void grow_foo_slab( cache* c, size_t n ) {
+
+	size_t header = (sizeof(foo_chunk) + 63) & ~(size_t)63;
+	size_t bytes = header + n * sizeof(foo);
+	foo_chunk* chunk;
+	bool mapped = false;
+	if( c->hugepages ) {
+		bytes = (bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+		chunk = (foo_chunk*) mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+		if( chunk == MAP_FAILED ) {
+			chunk = (foo_chunk*) mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+			assert( chunk != MAP_FAILED );
+			madvise( chunk, bytes, MADV_HUGEPAGE );
+		}
+		mapped = true;
+		// the rest of the page is free anyway
+		n = (bytes - header) / sizeof(foo);
+	} else {
+		chunk = (foo_chunk*) malloc( bytes );
+		assert( chunk );
+	}
+	counters.foo_chunk_allocs++;
+	TRACE_EVENT("New foo chunk for %lu items (%lu bytes)\n", n, bytes );
+
+	chunk->next = c->foo_chunks;
+	chunk->bytes = bytes;
+	chunk->mapped = mapped;
+	c->foo_chunks = chunk;
+	foo* foos = (foo*)((char*)chunk + header);
+	for( size_t i=n; i>0; i-- ) {
+		memcpy( &foos[i - 1], &c->unused_foos, sizeof(foo*) );
+		c->unused_foos = &foos[i - 1];
+	}
+	c->num_foos += n;
+}
+
+// only before anything is added
+static void use_foo_slab( cache* c, bool hugepages ) {
+
+	assert( c->num_stored == 0 && c->foo_chunks == NULL );
+	c->foo_slab = true;
+	c->hugepages = hugepages;
+	// room for the full cache, and a few items callers hold that aren't in it
+	grow_foo_slab( c, c->capacity + c->capacity / 8 + 1 );
+}
+
+// every foo the cache frees goes through here
+static inline void free_foo( cache* c, foo* f ) {
+
+	counters.foo_frees++;
+	if( c->foo_slab ) {
+		memcpy( f, &c->unused_foos, sizeof(foo*) );
+		c->unused_foos = f;
+	} else {
+		free( f );
+	}
+}
+
+static void free_cache( cache* c ) {
+
+	free_table( &c->tables[0] );
+	if( c->rehashing ) {
+		free_table( &c->tables[1] );
+	}
+	free_free_entries( c );
+	while( c->foo_chunks ) {
+		foo_chunk* next = c->foo_chunks->next;
+		if( c->foo_chunks->mapped ) {
+			munmap( c->foo_chunks, c->foo_chunks->bytes );
+		} else {
+			free( c->foo_chunks );
+		}
+		counters.foo_chunk_frees++;
+		c->foo_chunks = next;
+	}
+	free( c );
+}
+
+// free_entry nodes come from the slab, so putting an item on or taking it off
+// a free list never goes to the allocator
+static inline free_entry* take_free_entry( cache* c ) {
+
+	free_entry* fe = c->unused_free_entries;
+	if( fe == NULL ) {
+		assert( c->slab_next < c->slab_end ); // one per item, so never runs out
+		fe = (free_entry*)c->slab_next;
+		c->slab_next += c->free_entry_size;
+		return fe;
+	}
+	c->unused_free_entries = fe->next;
+	return fe;
+}
+
+static inline void return_free_entry( cache* c, free_entry* fe ) {
+
+	fe->next = c->unused_free_entries;
+	c->unused_free_entries = fe;
+}
+
+static inline table* table_of( cache* c, entry* e ) {
+
+	table* t = &c->tables[0];
+	if( (uintptr_t)e >= (uintptr_t)t->slots && (uintptr_t)e <= (uintptr_t)(t->slots + t->slot_mask) ) {
+		return t;
+	}
+	assert( c->rehashing );
+	return &c->tables[1];
+}
+
 
 static void dump( cache* c ) {
 	
-	printf("Cache (%lu items): (%p)\n", c->num_stored, c->buckets);
-	for(size_t i=0; i<CACHE_SIZE; i++ ) {
-		printf("bucket[%lu] = (%p) -> (%p)\n", i, &c->buckets[i], c->buckets[i]);
-		entry* current = c->buckets[i];
-		while( current != NULL ) {
+	printf("Cache (%lu items)%s:\n", c->num_stored, c->rehashing ? " (resizing)" : "");
+	for( int n=0; n <= c->rehashing; n++ ) {
+		table* t = &c->tables[n];
+		printf("Table %d (%lu items): (%p)\n", n, t->num_stored, t->slots);
+		for(size_t s=0; s<=t->slot_mask; s++ ) {
+			if( t->control[s] == SLOT_EMPTY ) {
+				printf("slot[%lu] = empty\n", s);
+				continue;
+			}
+			entry* current = &t->slots[s];
 			foo* current_foo = NULL;
 			if( current->refcount == 0 ) {
 				current_foo = current->ptr.to_free_entry->evictable_foo;
 			} else {
 				current_foo = current->ptr.to_foo;
 			}
-			printf("\tentry key=%lu (foo.b = %lu, dirty: %s) refcount: %lu\n", current->key, current_foo->b, current_foo->is_dirty ? "true" : "false", current->refcount );
-			current = current->next;
+			printf("slot[%lu] = (%p) home %lu\n", s, current, hash(current->key) & t->slot_mask );
+			printf("\tentry key=%lu (foo.b = %lu, dirty: %s) refcount: %u\n", current->key, current_foo->b, current_foo->is_dirty ? "true" : "false", current->refcount );
 		}
 	}
 
@@ -120,7 +516,7 @@ static void dump( cache* c ) {
 	if( current != NULL ){
 		do {
 			printf("\tfree entry: key=%lu (foo.b=%lu dirty=%s) [next=%lu, prev=%lu]\n", 
-			current->key, current->evictable_foo->b, current->evictable_foo->is_dirty ? "true" : "false", current->next->key, current->prev->key );
+			current->slot->key, current->evictable_foo->b, current->evictable_foo->is_dirty ? "true" : "false", current->next->slot->key, current->prev->slot->key );
 			current = current->next;	
 		} while( current != c->free_list );
 	}
@@ -130,38 +526,33 @@ static void dump( cache* c ) {
 	if( current != NULL ){
 		do {
 			printf("\tfree entry: key=%lu (foo.b=%lu dirty=%s) [next=%lu, prev=%lu]\n", 
-			current->key, current->evictable_foo->b, current->evictable_foo->is_dirty ? "true" : "false", current->next->key, current->prev->key );
+			current->slot->key, current->evictable_foo->b, current->evictable_foo->is_dirty ? "true" : "false", current->next->slot->key, current->prev->slot->key );
 			current = current->next;	
 		} while( current != c->free_list_dirty );
 	}
 	
 }
 
+static void finish_rehash( cache* c );
+
 static void clear_cache( cache* c ) {
 	
 	printf("Clearing the cache\n");
-	// free all items in the buckets
-	for( size_t b=0; b<CACHE_SIZE; b++ ) {
-		entry* current = c->buckets[b];
-		while( current != NULL ) {
-			// only free actual foos
-			if( current->refcount != 0 ) {
-				printf("\tfoo %lu\n", current->ptr.to_foo->b );
-				free( current->ptr.to_foo );
-				counters.foo_frees++;
-			}
-			// free the entry
-			printf("\tentry %lu\n", current->key );
-			entry* next = current->next;
-			free( current );
-			counters.entry_frees++;
-			current = next;
+	finish_rehash( c );
+
+	// free all items in the table
+	table* t = &c->tables[0];
+	for( size_t s=0; s<=t->slot_mask; s++ ) {
+		// only free actual foos
+		if( t->control[s] != SLOT_EMPTY && t->slots[s].refcount != 0 ) {
+			TRACE_STEP("\tfoo %lu\n", t->slots[s].ptr.to_foo->b );
+			free_foo( c, t->slots[s].ptr.to_foo );
 		}
-		c->buckets[b] = NULL;
 	}
+	memset( t->control, SLOT_EMPTY, (t->slot_mask + 1 + CONTROL_CLONES) * sizeof(uint8_t) );
 	
 	// now all foos in entries are freed, as well as all entries
-	// free the free_entry and foos they contain
+	// free the foos in the free_entry and give those back to the slab
 	free_entry* free_lists[2] = { c->free_list, c->free_list_dirty };
 	for(int i=0; i<2; i++){
 
@@ -171,475 +562,2721 @@ static void clear_cache( cache* c ) {
 			current->prev->next = NULL;
 		}
 		while( current != NULL ) {
-			printf("\tfree entry %lu\n", current->key );
-			free( current->evictable_foo );
-			counters.foo_frees++;
+			TRACE_STEP("\tfree entry %lu\n", current->slot->key );
+			free_foo( c, current->evictable_foo );
 			free_entry* next = current->next;
-			free( current );
-			counters.free_entry_frees++;
+			return_free_entry( c, current );
 			current = next;
 		}
 		
 	}
 	
+	t->num_stored = 0;
 	c->num_stored = 0;
+	c->bytes_stored = 0;
+	c->bytes_free = 0;
 	c->free_list = NULL;
+	c->free_list_dirty = NULL;
+	c->num_free_clean = 0;
+	c->num_free_dirty = 0;
+	memset( c->wheel, 0, sizeof(c->wheel) );
 }
 
-static void evict_item( cache* c, free_entry** free_list ) {
+// adds the number of full slots it looked at to probes
+static entry* find_in_table_scalar( table* t, size_t key, size_t h, size_t* probes ) {
 	
-	// take the first thing in the free list
-	free_entry* fe = *free_list;
-	// remove it from the free list
-	if( (*free_list)->next == *free_list ) { // just single item
-		*free_list = NULL;
-	} else {
-		// [prev]<->[fe]<->[next]
-		//           ^
-		//           c->free_list
-		fe->prev->next = fe->next;
-		fe->next->prev = fe->prev;
-		*free_list = fe->next;
-	}
-	// now our free list is ok again
-	size_t b = hash(fe->key);
-	printf("Can evict key %lu from free list (it's in bucket %lu)\n", fe->key, b );
-	
-	// find and remove the entry from the bucket
-	entry* entry_to_free = NULL;
-	if( c->buckets[b]->key == fe->key ) { // it's the head item
-		printf("Removing the entry from the bucket (it was the head)\n");
-		entry_to_free = c->buckets[b];
-		c->buckets[b] = c->buckets[b]->next; // just move to the next one
-	} else {
-		entry* current;
-		for(current = c->buckets[b]; current->next->key != fe->key; current = current->next ) {
-			printf("Checking key %lu (next %lu)\n", current->key, current->next->key );
-			if( current->key == fe->key ) {
-				break;
-			}
-			assert( current->next != NULL ); // it has to be in this list
+	uint8_t tag = hash_tag( h );
+	size_t n = 0;
+	for( size_t s = h & t->slot_mask; t->control[s] != SLOT_EMPTY; s = (s + 1) & t->slot_mask ) {
+		TRACE_STEP("Find key %lu check slot %lu (tag %x)\n", key, s, t->control[s]);
+		n++;
+		if( t->control[s] == tag && t->slots[s].key == key ) {
+			*probes += n;
+			return &t->slots[s];
 		}
-		printf("Found the bucket entry: key %lu (next %lu)\n", current->key, current->next->key );
-		entry_to_free = current->next;
-		current->next = current->next->next; // skip over it
 	}
-	assert( entry_to_free != NULL );
-	
-	// free the free_entry, the foo it points to and the entry in the bucket
-	free( fe->evictable_foo );
-	counters.foo_frees++;
-	free( fe );
-	counters.entry_frees++;
-	free( entry_to_free );
-	counters.free_entry_frees++;
-	c->num_stored--;
-	
+	*probes += n;
+	return NULL;
 }
 
-static void add_item( cache* c, foo* f, size_t key ) {
-
-	printf("Adding item %lu\n", key);
-	if( c->num_stored == CACHE_SIZE ) {
-		printf("Cache full\n");
-		// check the free list
-		
-		if( c->free_list != NULL ) {
-			printf("Evicting a clean item\n");
-			evict_item( c, &c->free_list );
-		} else if( c->free_list_dirty != NULL ) {
-			printf("Evicting a dirty item\n");
-			evict_item( c, &c->free_list_dirty );
-		} else {
-			printf("Nothing in the free lists.\n");
-			return;
-		}
+/*
+One group of a group probe: bit i of matches and empties is about slot s + i. Only the matches
+before the first empty slot are in the run. NULL with *done set when the run ends in this group.
+*/
+static inline entry* check_group( table* t, size_t key, size_t s, uint32_t matches, uint32_t empties, size_t width, size_t* n, bool* done ) {
 
+	if( empties ) {
+		matches &= (empties & -empties) - 1;
 	}
-	size_t h = hash( key );
-	entry* bucket = c->buckets[h];
-	
-	entry* i = (entry*) malloc( sizeof(entry) );
-	counters.entry_allocs++;
-	i->ptr.to_foo = f;
-	i->refcount = 1;
-	i->key = key;
-	i->next = NULL;
-	
-	if( bucket != NULL ) {
-		i->next = bucket;
+	while( matches ) {
+		size_t i = (size_t)__builtin_ctz( matches );
+		entry* e = &t->slots[(s + i) & t->slot_mask];
+		if( e->key == key ) {
+			*n += i + 1;
+			return e;
+		}
+		matches &= matches - 1;
 	}
-	c->buckets[h] = i;
+	*done = empties != 0;
+	*n += empties ? (size_t)__builtin_ctz( empties ) : width;
+	return NULL;
+}
 
-	c->num_stored++;
+#ifdef __SSE2__
+
+static entry* find_in_table_sse2( table* t, size_t key, size_t h, size_t* probes ) {
+
+	__m128i tag = _mm_set1_epi8( (char)hash_tag( h ) );
+	size_t n = 0;
+	bool done = false;
+	for( size_t s = h & t->slot_mask; ; s = (s + 16) & t->slot_mask ) {
+		__m128i group = _mm_loadu_si128( (const __m128i*)&t->control[s] );
+		uint32_t matches = (uint32_t)_mm_movemask_epi8( _mm_cmpeq_epi8( group, tag ) );
+		uint32_t empties = (uint32_t)_mm_movemask_epi8( group );
+		entry* e = check_group( t, key, s, matches, empties, 16, &n, &done );
+		if( e || done ) {
+			*probes += n;
+			return e;
+		}
+	}
 }
 
-static foo* get_item( cache* c, size_t key ) {
-	
-	size_t h = hash( key );
-	for( entry* i = c->buckets[h]; i != NULL; i = i->next ) {
-		printf("Get item %lu check %lu:%lu\n", key, h, i->key);
-		if( i->key == key ) {
-			
-			// either a foo, or a pointer to a free_entry
-			if( i->refcount == 0 ) {
-				printf("Reviving item %lu\n", key);
-				// it's one on the free list, means we need to remove it from there
-				free_entry* discard = i->ptr.to_free_entry;
-				assert( discard != NULL );
-				i->ptr.to_foo = discard->evictable_foo; // put it back in the regular entry
-
-				// remove it from the free list
-				discard->prev->next = discard->next;
-				discard->next->prev = discard->prev;
-				
-				// if we happen to free the initial entry in the free list, set a new head
-				// unless this was the last item, then set the list to NULL
-				if( c->free_list == discard ) {	
-					c->free_list = discard->next == discard ? NULL : discard->next;
-				}
-				if( c->free_list_dirty == discard ) {	
-					c->free_list_dirty = discard->next == discard ? NULL : discard->next;
-				}
-				
-				free( discard );
-				discard = NULL;
-				counters.free_entry_frees++;
-			}
-			// regular item, or free_entry inbetween was discarded
-			i->refcount++;
-			return i->ptr.to_foo;
+__attribute__((target("avx2")))
+static entry* find_in_table_avx2( table* t, size_t key, size_t h, size_t* probes ) {
+
+	__m256i tag = _mm256_set1_epi8( (char)hash_tag( h ) );
+	size_t n = 0;
+	bool done = false;
+	for( size_t s = h & t->slot_mask; ; s = (s + 32) & t->slot_mask ) {
+		__m256i group = _mm256_loadu_si256( (const __m256i*)&t->control[s] );
+		uint32_t matches = (uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( group, tag ) );
+		uint32_t empties = (uint32_t)_mm256_movemask_epi8( group );
+		entry* e = check_group( t, key, s, matches, empties, 32, &n, &done );
+		if( e || done ) {
+			*probes += n;
+			return e;
 		}
 	}
-	
-	printf("Item %lu was not in the cache\n", key );
-	return NULL;
-	
 }
 
-static void release_item( cache* c, foo* f, size_t key ) {
+#endif
 
-	size_t h = hash( key );
-	for( entry* i = c->buckets[h]; i != NULL; i = i->next ) {
-		printf("release %lu, looking in bucket %lu\n", key, h );
-		if( i->key == key ) {
-			i->refcount--;
-			assert( i->refcount >= 0 );
-			// add it to the free list if refcount hits 0
-			if( i->refcount == 0 ) {
-				free_entry* new_head = (free_entry*) malloc( sizeof(free_entry) );
-				counters.free_entry_allocs++;
-				new_head->evictable_foo = i->ptr.to_foo; // keep the actual thing we store
-				i->ptr.to_free_entry = new_head; // replace it with ref to the free_entry
-				new_head->key = key;
-				
-				free_entry** free_list = new_head->evictable_foo->is_dirty ? &c->free_list_dirty : &c->free_list;
-				if( *free_list == NULL ) {
-					printf("empty free_list, setting first item\n");
-					new_head->next = new_head;
-					new_head->prev = new_head;
-				} else {
-					new_head->next = *free_list;
-					new_head->prev = (*free_list)->prev;
-					(*free_list)->prev = new_head;
-					new_head->prev->next = new_head;
-				}
+static inline entry* find_in_table( table* t, size_t key, size_t h, size_t* probes ) {
 
-				*free_list = new_head;
-			}
-			return;
+	switch( probe ) {
+#ifdef __SSE2__
+	case PROBE_AVX2:
+	case PROBE_SSE2: {
+		// at the loads the cache runs at most hits are in their home slot, one tag and key compare
+		// finds those without the group load (misses still take the group, it finds the end of the run)
+		size_t s = h & t->slot_mask;
+		if( t->control[s] == hash_tag( h ) && t->slots[s].key == key ) {
+			*probes += 1;
+			return &t->slots[s];
+		}
+		if( probe == PROBE_AVX2 ) {
+			return find_in_table_avx2( t, key, h, probes );
 		}
+		return find_in_table_sse2( t, key, h, probes );
+	}
+#endif
+	default:
+		return find_in_table_scalar( t, key, h, probes );
 	}
-	
-	// was not in the cache, just free it
-	printf("Item %lu was not in the cache, doing a normal free()\n", key);
-	counters.foo_frees++;
-	free( f );
 }
 
-/********************** TESTS *************************/
+// returns the entry holding key (in either table while resizing), or NULL
+static entry* find_entry_hashed( cache* c, size_t key, size_t h ) {
 
-static void checks() {
-	
-	printf( "foo allocs/frees = %lu/%lu\n", counters.foo_allocs, counters.foo_frees);
+	size_t probes = 0;
+	entry* e = find_in_table( &c->tables[0], key, h, &probes );
+	if( e == NULL && c->rehashing ) {
+		e = find_in_table( &c->tables[1], key, h, &probes );
+	}
+	c->stats.lookups++;
+	c->stats.probes += probes;
+	if( probes > c->stats.max_probes ) {
+		c->stats.max_probes = probes;
+	}
+	return e;
+}
 
-	assert( counters.foo_allocs == counters.foo_frees );
-	assert( counters.entry_allocs == counters.entry_frees );
-	assert( counters.free_entry_allocs == counters.free_entry_frees );
-	
+static entry* find_entry( cache* c, size_t key ) {
+	return find_entry_hashed( c, key, hash( key ) );
 }
 
-static void test_add() {
-	
+// start loading the home slot of a key in both tables, so a lookup a little later doesn't wait for memory
+static inline void prefetch_slot( cache* c, size_t h ) {
 
-	cache* store = new_cache();
-	dump( store );
-	
-	printf("==== Adding keys 1-10 ====\n");
-	
-	for(size_t i=1; i<11; i++) {
-		foo* temp = (foo*)malloc( sizeof(foo) );
-		counters.foo_allocs++;
-		temp->b = i;
-		temp->is_dirty = false;
-		add_item( store, temp, i );
+	for( int n=0; n <= c->rehashing; n++ ) {
+		table* t = &c->tables[n];
+		__builtin_prefetch( &t->control[h & t->slot_mask] );
+		__builtin_prefetch( &t->slots[h & t->slot_mask] );
 	}
-	dump( store );
-	print_counters();
+}
 
-	clear_cache( store );
+// claims the first empty slot from the home slot on
+static entry* insert_into_table( table* t, size_t key ) {
 
-	checks();
+	size_t h = hash( key );
+	size_t s = h & t->slot_mask;
+	while( t->control[s] != SLOT_EMPTY ) {
+		s = (s + 1) & t->slot_mask;
+	}
+
+	set_control( t, s, hash_tag( h ) );
+	t->num_stored++;
+	return &t->slots[s];
 }
 
-static void test_add_release() {
-	
-	cache* store = new_cache();
-	
-	printf("==== Adding and releasing keys 1-10 ====\n");
-	
-	for(size_t i=1; i<11; i++) {
-		foo* temp = (foo*)malloc( sizeof(foo) );
-		counters.foo_allocs++;
-		temp->b = i;
-		temp->is_dirty = false;
-		add_item( store, temp, i );
-		release_item( store, temp, i );
+/*
+Empty a slot without leaving a tombstone: entries after it in the same run move back
+into the hole, unless that would move them before their home slot.
+
+ home:   3   3   4   6
+ slot:  [3] [4] [5] [6] [7]
+         ^ remove
+        [3] [4] [5] [6] [7]
+         3   4       6         (the second 3 moves to slot 3, the 4 to slot 4, 6 stays)
+*/
+static void remove_slot( table* t, size_t hole ) {
+
+	for( size_t next = (hole + 1) & t->slot_mask; t->control[next] != SLOT_EMPTY; next = (next + 1) & t->slot_mask ) {
+
+		size_t home = hash( t->slots[next].key ) & t->slot_mask;
+		// can move unless home lies in (hole, next]
+		if( ((next - home) & t->slot_mask) >= ((next - hole) & t->slot_mask) ) {
+			TRACE_STEP("Shifting key %lu from slot %lu to %lu\n", t->slots[next].key, next, hole );
+			set_control( t, hole, t->control[next] );
+			t->slots[hole] = t->slots[next];
+			// free list nodes point at the slot, so they have to follow
+			if( t->slots[hole].refcount == 0 ) {
+				t->slots[hole].ptr.to_free_entry->slot = &t->slots[hole];
+			}
+			hole = next;
+		}
 	}
-	dump( store );
-	print_counters();
-
-	clear_cache( store );
+	set_control( t, hole, SLOT_EMPTY );
+	t->num_stored--;
 
-	checks();
-	
 }
 
-static void test_free_entry_reuse() {
+/*
+Move up to n items from tables[0] to tables[1] (redis style incremental rehashing). The
+move shifts the rest of the run in tables[0] back into the slot, so the slot at rehash_index
+is checked again until it is empty. A run that wraps around the end of the table can
+shift items behind rehash_index, so this goes round until tables[0] is empty.
+Lookups check both tables in the meantime.
+*/
+static void rehash_step( cache* c, size_t n ) {
+
+	table* from = &c->tables[0];
+	table* to = &c->tables[1];
+	size_t empty_visits = n * 10;
+	while( n > 0 && from->num_stored > 0 ) {
+
+		size_t s = c->rehash_index;
+		if( from->control[s] == SLOT_EMPTY ) {
+			c->rehash_index = (s + 1) & from->slot_mask;
+			if( --empty_visits == 0 ) {
+				break;
+			}
+			continue;
+		}
 
-	cache* store = new_cache();
-		
-	printf("==== Adding keys 1-12 (filling the cache), releasing 1-4 ====\n");
-	for(size_t i=1; i<CACHE_SIZE; i++) {
-		foo* temp = (foo*)malloc( sizeof(foo) );
-		counters.foo_allocs++;
-		temp->b = i;
-		temp->is_dirty = false;
-		add_item( store, temp, i );
-		if( i < 5 ) {
-			release_item( store, temp, i );
+		TRACE_STEP("Rehashing key %lu from slot %lu\n", from->slots[s].key, s );
+		entry* moved = insert_into_table( to, from->slots[s].key );
+		*moved = from->slots[s];
+		if( moved->refcount == 0 ) {
+			moved->ptr.to_free_entry->slot = moved;
 		}
+		remove_slot( from, s );
+		n--;
 	}
 
-	dump( store );
-
-	printf("==== Retrieving keys 3,4,5,6 (should take them off the free list/and increase refcount) ====\n");
-	for(size_t i=3; i<5; i++) {
-		foo* temp = get_item( store, i );
-		assert( temp != NULL );
+	if( from->num_stored == 0 ) {
+		TRACE_EVENT("Rehash done, %lu slots\n", to->slot_mask + 1 );
+		free_table( from );
+		c->tables[0] = c->tables[1];
+		c->rehashing = false;
 	}
-	dump( store );
 
-	clear_cache( store );
-	print_counters();
-	checks();
-	
 }
 
-static void test_single_add_release_get() {
-	
-	cache* store = new_cache();
-	
-	printf("==== Add/Release/Retrieve keys 1 ====\n");
-	
-	foo* temp = (foo*)malloc( sizeof(foo) );
-	counters.foo_allocs++;
-	
-	size_t payload = 31415, key = 24;
-	temp->b = payload;
-	temp->is_dirty = false;
-	add_item( store, temp, key );
-	release_item( store, temp, key );
-	temp = NULL;
-	temp = get_item( store, key );
-	printf("temp->b = %lu\n", temp->b );
-	assert( temp != NULL );
-	assert( temp->b == payload );
-	assert( temp->is_dirty == false );
+static void finish_rehash( cache* c ) {
 
-	clear_cache( store );
-	print_counters();
-	checks();
+	while( c->rehashing ) {
+		rehash_step( c, c->tables[0].slot_mask + 1 );
+	}
 
 }
 
-// evicting an item should also remove it from the bucket,
-// which is most tricky when it is the first/only item
-static void test_evict_first_item_in_bucket() {
+// what an item counts for against the byte budget, nothing without one
+static inline size_t weight( cache* c, foo* f ) {
+	return c->byte_budget ? f->size : 0;
+}
 
-	cache* store = new_cache();
-	
-	printf("==== Evicting first item in a bucket ====\n");
-	
-	// fill the cache first
-	foo* first_in_bucket = NULL;
-	for(size_t i=1; i<CACHE_SIZE; i++) {
-		foo* temp = (foo*)malloc( sizeof(foo) );
-		counters.foo_allocs++;
-		temp->b = i;
-		temp->is_dirty = false;
-		add_item( store, temp, i );
-		if( i == 8 ) {
-			first_in_bucket = temp;
+static inline void wheel_remove( cache* c, free_entry* fe ) {
+
+	if( c->ttl == 0 ) {
+		return;
+	}
+	timed_free_entry* t = timed( fe );
+	if( t->wheel_pprev != NULL ) {
+		*t->wheel_pprev = t->wheel_next;
+		if( t->wheel_next != NULL ) {
+			timed( t->wheel_next )->wheel_pprev = t->wheel_pprev;
 		}
+		t->wheel_pprev = NULL;
 	}
+}
+
+// takes a refcount 0 item off its free list (and the wheel), and out of the cache
+static void evict_item( cache* c, free_entry* fe ) {
+
+	bool dirty = fe->evictable_foo->is_dirty;
+	free_entry** free_list = dirty ? &c->free_list_dirty : &c->free_list;
+	// remove it from the free list
+	if( fe->next == fe ) { // just single item
+		*free_list = NULL;
+	} else {
+		// [prev]<->[fe]<->[next]
+		fe->prev->next = fe->next;
+		fe->next->prev = fe->prev;
+		if( *free_list == fe ) {
+			*free_list = fe->next;
+		}
+	}
+	// now our free list is ok again
+	if( dirty ) {
+		TRACE_OP("Pretending to write dirty item %lu before evicting it\n", fe->slot->key );
+		counters.eviction_writes++;
+		c->num_free_dirty--;
+	} else {
+		c->num_free_clean--;
+	}
+	wheel_remove( c, fe );
+	table* t = table_of( c, fe->slot );
+	TRACE_OP("Can evict key %lu from free list (it's in slot %lu)\n", fe->slot->key, (size_t)(fe->slot - t->slots) );
+	remove_slot( t, (size_t)(fe->slot - t->slots) );
+	c->bytes_stored -= weight( c, fe->evictable_foo );
+	c->bytes_free -= weight( c, fe->evictable_foo );
+	
+	// free the foo and give the free_entry back
+	free_foo( c, fe->evictable_foo );
+	return_free_entry( c, fe );
+	c->num_stored--;
+	
+}
+
+// evict a refcount 0 item, clean ones first. false when everything is pinned
+static bool evict_any( cache* c ) {
+		
+	if( c->free_list != NULL ) {
+		TRACE_OP("Evicting a clean item\n");
+		TRACE_RECORD( TRACE_EVICT, c->free_list->slot->key, 0 );
+		c->stats.clean_evictions++;
+		evict_item( c, c->free_list );
+	} else if( c->free_list_dirty != NULL ) {
+		TRACE_OP("Evicting a dirty item\n");
+		TRACE_RECORD( TRACE_EVICT, c->free_list_dirty->slot->key, 1 );
+		c->stats.dirty_evictions++;
+		evict_item( c, c->free_list_dirty );
+	} else {
+		TRACE_EVENT("Nothing in the free lists.\n");
+		return false;
+	}
+	return true;
+
+}
+
+/*
+TTL (see set_ttl): a hierarchical timing wheel of the refcount 0 items, next to the free lists.
+Level n has WHEEL_SLOTS slots of WHEEL_SLOTS^n ticks each, and an item goes in the lowest level
+that reaches its deadline. Every tick expires the level 0 slot it lands on, and where a level
+wraps the next slot of the level above is spread over the ones below. An item moves down at
+most WHEEL_LEVELS - 1 times, so it's O(1) per expired item. Ticks without anything to expire or
+spread are skipped (see wheel_next_tick), so a long pause isn't a tick at a time either.
+Pinned items aren't on the wheel, a release past the deadline expires them right away.
+*/
+static void wheel_insert( cache* c, free_entry* fe ) {
+
+	uint64_t expires = fe->evictable_foo->expires;
+	assert( expires >= c->wheel_time );
+	uint64_t delta = expires - c->wheel_time;
+	int level = 0;
+	while( level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)) ) {
+		level++;
+	}
+	// further than the wheel reaches: the last slot of the top level, it goes round again from there
+	if( delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS) ) {
+		expires = c->wheel_time + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+	free_entry** slot = &c->wheel[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+	timed_free_entry* t = timed( fe );
+	t->wheel_next = *slot;
+	if( *slot != NULL ) {
+		timed( *slot )->wheel_pprev = &t->wheel_next;
+	}
+	t->wheel_pprev = slot;
+	*slot = fe;
+}
+	
+// the wheel got to a new tick, spread the slots of the levels that wrapped (top down, so they cascade)
+static void wheel_cascade( cache* c ) {
+
+	for( int level=WHEEL_LEVELS - 1; level>0; level-- ) {
+		if( (c->wheel_time & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0 ) {
+			continue;
+		}
+		free_entry** slot = &c->wheel[level][(c->wheel_time >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+		free_entry* fe = *slot;
+		*slot = NULL;
+		while( fe != NULL ) {
+			free_entry* next = timed( fe )->wheel_next;
+			wheel_insert( c, fe );
+			fe = next;
+		}
+	}
+}
+
+// the first tick after wheel_time with items to expire, or a slot to spread over the levels below.
+// Looks at every slot of every level at most once, UINT64_MAX with an empty wheel
+static uint64_t wheel_next_tick( cache* c ) {
+
+	uint64_t next = UINT64_MAX;
+	for( int level=0; level<WHEEL_LEVELS; level++ ) {
+		uint64_t width = (uint64_t)1 << (WHEEL_BITS * level);
+		uint64_t tick = (c->wheel_time | (width - 1)) + 1; // the next one the level does anything at
+		for( int n=0; n<WHEEL_SLOTS && tick < next; n++, tick += width ) {
+			if( c->wheel[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)] != NULL ) {
+				next = tick;
+			}
+		}
+	}
+	return next;
+}
+
+static void expire_item( cache* c, free_entry* fe ) {
+
+	TRACE_OP("Item %lu expired\n", fe->slot->key );
+	TRACE_RECORD( TRACE_EXPIRE, fe->slot->key, fe->evictable_foo->is_dirty );
+	c->stats.expirations++;
+	evict_item( c, fe );
+}
+
+/*
+Moves the clock to now (ticks, in whatever unit the ttl is) and expires the free items that are
+past their deadline, at most max of them so a long pause doesn't stall the caller. The rest go on
+the next call, or when get_item finds one. Returns how many it expired.
+*/
+static size_t expire_items( cache* c, uint64_t now, size_t max ) {
+
+	if( now > c->now ) {
+		c->now = now;
+	}
+	// an empty wheel has no slots to go through
+	if( c->num_free_clean + c->num_free_dirty == 0 ) {
+		c->wheel_time = c->now + 1;
+	}
+	size_t expired = 0;
+	while( c->ttl && c->wheel_time <= c->now ) {
+		free_entry** slot = &c->wheel[0][c->wheel_time & (WHEEL_SLOTS - 1)];
+		while( *slot != NULL ) {
+			assert( (*slot)->evictable_foo->expires <= c->wheel_time );
+			if( expired == max ) {
+				return expired;
+			}
+			expire_item( c, *slot );
+			expired++;
+		}
+		// the ticks inbetween have nothing to do
+		uint64_t next = wheel_next_tick( c );
+		if( next > c->now + 1 ) {
+			c->wheel_time = c->now + 1;
+		} else {
+			c->wheel_time = next;
+			wheel_cascade( c );
+		}
+	}
+	return expired;
+}
+
+// a free item past its deadline that expire_items hasn't got to, it goes now and the get is a miss
+static inline bool expire_on_get( cache* c, entry* i ) {
+
+	if( c->ttl == 0 || i->refcount > 0 || i->ptr.to_free_entry->evictable_foo->expires > c->now ) {
+		return false;
+	}
+	expire_item( c, i->ptr.to_free_entry );
+	return true;
+}
+
+// a foo for an item that's about to be added, from the payload slab or malloc
+static foo* cache_alloc_item( cache* c ) {
+
+	counters.foo_allocs++;
+	if( !c->foo_slab ) {
+		foo* f = (foo*) malloc( sizeof(foo) );
+		assert( f );
+		f->size = sizeof(foo);
+		return f;
+	}
+
+	// make room now, so the evicted item's slot is the one handed out
+	if( c->unused_foos == NULL && c->num_stored >= c->capacity ) {
+		evict_any( c );
+	}
+	// too many held outside the cache (or it grew)
+	if( c->unused_foos == NULL ) {
+		grow_foo_slab( c, c->capacity / 8 + 1 );
+	}
+	foo* f = c->unused_foos;
+	memcpy( &c->unused_foos, f, sizeof(foo*) );
+	f->size = sizeof(foo);
+	return f;
+}
+
+/*
+Write back dirty items on the free list, in the order they would be evicted, until there are
+low_water items on the clean free list (at most max in one go). Evictions then take the clean
+ones, so add_item doesn't have to write anything. There are no threads here, call this when
+there is time to spare. Returns how many it cleaned.
+*/
+static size_t clean_items( cache* c, size_t low_water, size_t max ) {
+
+	size_t cleaned = 0;
+	while( cleaned < max && c->num_free_clean < low_water && c->free_list_dirty != NULL ) {
+
+		free_entry* fe = c->free_list_dirty;
+		if( fe->next == fe ) {
+			c->free_list_dirty = NULL;
+		} else {
+			fe->prev->next = fe->next;
+			fe->next->prev = fe->prev;
+			c->free_list_dirty = fe->next;
+		}
+		c->num_free_dirty--;
+
+		TRACE_OP("Writing dirty item %lu ahead of eviction\n", fe->slot->key );
+		TRACE_RECORD( TRACE_WRITE, fe->slot->key, 0 );
+		fe->evictable_foo->is_dirty = false;
+		counters.cleaner_writes++;
+
+		// and it's the next clean one to go
+		if( c->free_list == NULL ) {
+			fe->next = fe;
+			fe->prev = fe;
+		} else {
+			fe->next = c->free_list;
+			fe->prev = c->free_list->prev;
+			c->free_list->prev = fe;
+			fe->prev->next = fe;
+		}
+		c->free_list = fe;
+		c->num_free_clean++;
+
+		cleaned++;
+	}
+
+	return cleaned;
+}
+
+/*
+Change the memory budget of a live cache. The items move to the new table a few at a time
+during the next operations, so there is no pause, foo pointers handed out stay valid and the
+free lists keep their order. Shrinking below the number of stored items evicts the excess
+(clean first) right away, and fails if the pinned items alone don't fit.
+*/
+static bool resize_cache( cache* c, size_t memory_budget ) {
+
+	// one resize at a time
+	finish_rehash( c );
+
+	size_t capacity;
+	size_t num_slots = slots_for_budget( memory_budget, &capacity );
+	TRACE_EVENT("Resizing to %lu items, %lu slots\n", capacity, num_slots );
+	TRACE_RECORD( TRACE_RESIZE, capacity, num_slots );
+	while( c->num_stored > capacity ) {
+		if( !evict_any( c ) ) {
+			return false;
+		}
+	}
+
+	grow_free_entries( c, capacity );
+	init_table( &c->tables[1], num_slots );
+	c->rehashing = true;
+	c->rehash_index = 0;
+	c->capacity = capacity;
+	return true;
+
+}
+
+/*
+With a byte budget: evicts free items, clean ones first, until size more bytes fit. Every
+eviction is O(1). false, without evicting anything, when the pinned items alone leave no room.
+*/
+static bool make_room( cache* c, size_t size ) {
+
+	if( c->byte_budget == 0 ) {
+		return true;
+	}
+	size_t pinned_bytes = c->bytes_stored - c->bytes_free;
+	if( pinned_bytes + size > c->byte_budget ) {
+		TRACE_EVENT("Pinned items take %lu of %lu bytes, no room for %lu more\n", pinned_bytes, c->byte_budget, size );
+		return false;
+	}
+	while( c->bytes_stored + size > c->byte_budget ) {
+		// the free lists hold enough bytes
+		evict_any( c );
+	}
+	return true;
+}
+
+// false if it's not stored: everything is pinned, or the pinned items leave no room in the byte budget
+static bool add_item( cache* c, foo* f, size_t key ) {
+
+	TRACE_OP("Adding item %lu\n", key);
+	if( c->rehashing ) {
+		rehash_step( c, REHASH_STEP );
+	}
+
+	if( !make_room( c, weight( c, f ) ) ) {
+		TRACE_RECORD( TRACE_FULL, key, weight( c, f ) );
+		c->stats.rejections++;
+		return false;
+	}
+	if( c->num_stored >= c->capacity ) {
+		TRACE_EVENT("Cache full\n");
+		// check the free list
+		if( !evict_any( c ) ) {
+			TRACE_RECORD( TRACE_FULL, key, 0 );
+			c->stats.rejections++;
+			return false;
+		}
+	}
+
+	// new items always go in the new table
+	table* t = c->rehashing ? &c->tables[1] : &c->tables[0];
+	entry* i = insert_into_table( t, key );
+	i->ptr.to_foo = f;
+	i->refcount = 1;
+	i->key = key;
+	i->generation = c->next_generation++;
+	if( c->ttl ) {
+		f->expires = c->now + c->ttl;
+	}
+	TRACE_RECORD( TRACE_ADD, key, i - t->slots );
+
+	c->num_stored++;
+	c->bytes_stored += weight( c, f );
+	return true;
+}
+
+/*
+Limits the stored items by their sizes as well (foo.size), so with payloads of very different
+sizes the table only needs to be big enough for the most items that fit. add_item evicts as many
+items as it needs for the new one. Only on an empty cache, and every foo needs its size from
+then on (cache_alloc_item sets it to sizeof(foo)).
+*/
+static void set_byte_budget( cache* c, size_t bytes ) {
+	
+	assert( c->num_stored == 0 );
+	c->byte_budget = bytes;
+}
+
+/*
+Items expire ttl ticks after add_item (a get doesn't extend it), on the clock that expire_items
+moves. Expired items that are still pinned stay until they're released. Only on an empty cache,
+0 turns it off. With a ttl the free_entry nodes carry the wheel links, 16 bytes per item that
+the memory budget doesn't count.
+*/
+static void set_ttl( cache* c, uint64_t ttl ) {
+
+	assert( c->num_stored == 0 );
+	size_t size = ttl ? sizeof(timed_free_entry) : sizeof(free_entry);
+	if( size != c->free_entry_size ) {
+		// nothing is stored, so none of the nodes are in use
+		size_t num_free_entries = c->num_free_entries;
+		free_free_entries( c );
+		c->free_entry_size = size;
+		grow_free_entries( c, num_free_entries );
+	}
+	c->ttl = ttl;
+	c->wheel_time = c->now + 1;
+}
+
+static foo* pin_entry( cache* c, entry* i ) {
+			
+	// either a foo, or a pointer to a free_entry
+	if( i->refcount == 0 ) {
+		TRACE_OP("Reviving item %lu\n", i->key);
+		c->stats.revives++;
+		// it's one on the free list, means we need to remove it from there
+		free_entry* discard = i->ptr.to_free_entry;
+		assert( discard != NULL );
+		i->ptr.to_foo = discard->evictable_foo; // put it back in the regular entry
+
+		// remove it from the free list
+		discard->prev->next = discard->next;
+		discard->next->prev = discard->prev;
+				
+		// if we happen to free the initial entry in the free list, set a new head
+		// unless this was the last item, then set the list to NULL
+		if( c->free_list == discard ) {
+			c->free_list = discard->next == discard ? NULL : discard->next;
+		}
+		if( c->free_list_dirty == discard ) {
+			c->free_list_dirty = discard->next == discard ? NULL : discard->next;
+		}
+		if( discard->evictable_foo->is_dirty ) {
+			c->num_free_dirty--;
+		} else {
+			c->num_free_clean--;
+		}
+		c->bytes_free -= weight( c, discard->evictable_foo );
+		wheel_remove( c, discard );
+				
+		return_free_entry( c, discard );
+		discard = NULL;
+	}
+	// regular item, or free_entry inbetween was discarded
+	i->refcount++;
+	c->stats.hits++;
+	TRACE_RECORD( TRACE_HIT, i->key, i->refcount );
+	return i->ptr.to_foo;
+	
+}
+
+static void unpin_entry( cache* c, entry* i ) {
+
+	assert( i->refcount > 0 );
+	i->refcount--;
+	TRACE_RECORD( TRACE_RELEASE, i->key, i->refcount );
+	// add it to the free list if refcount hits 0
+	if( i->refcount == 0 ) {
+		free_entry* new_head = take_free_entry( c );
+		new_head->evictable_foo = i->ptr.to_foo; // keep the actual thing we store
+		i->ptr.to_free_entry = new_head; // replace it with ref to the free_entry
+		new_head->slot = i;
+				
+		free_entry** free_list = new_head->evictable_foo->is_dirty ? &c->free_list_dirty : &c->free_list;
+		if( *free_list == NULL ) {
+			TRACE_STEP("empty free_list, setting first item\n");
+			new_head->next = new_head;
+			new_head->prev = new_head;
+		} else {
+			new_head->next = *free_list;
+			new_head->prev = (*free_list)->prev;
+			(*free_list)->prev = new_head;
+			new_head->prev->next = new_head;
+		}
+
+		*free_list = new_head;
+		if( new_head->evictable_foo->is_dirty ) {
+			c->num_free_dirty++;
+		} else {
+			c->num_free_clean++;
+		}
+		c->bytes_free += weight( c, new_head->evictable_foo );
+
+		if( c->ttl ) {
+			timed( new_head )->wheel_pprev = NULL;
+			// it went past its deadline while it was pinned
+			if( new_head->evictable_foo->expires <= c->now ) {
+				expire_item( c, new_head );
+			} else {
+				wheel_insert( c, new_head );
+			}
+		}
+	}
+	
+}
+
+/*
+What get_handle pinned: the item, and the slot it was in, so release_handle mostly goes straight
+to the entry instead of hashing and probing for it again. Entries do move, when a removal shifts
+the rest of their run back or a resize takes them to the new table, then it's a lookup by key
+after all. Either way the generation has to match, so a stale handle (released already, and the
+key added again since) is refused. A handle released twice while the item is still pinned by
+someone else can't be told apart.
+*/
+typedef struct cache_handle {
+	foo* item; // NULL when the get missed
+	size_t key;
+	uint32_t slot;
+	uint32_t generation;
+} cache_handle;
+
+static cache_handle get_handle( cache* c, size_t key ) {
+
+	if( c->rehashing ) {
+		rehash_step( c, REHASH_STEP );
+	}
+
+	cache_handle h = { .item = NULL, .key = key };
+	entry* i = find_entry( c, key );
+	if( i != NULL && expire_on_get( c, i ) ) {
+		i = NULL;
+	}
+	if( i == NULL ) {
+		TRACE_OP("Item %lu was not in the cache\n", key );
+		TRACE_RECORD( TRACE_MISS, key, 0 );
+		c->stats.misses++;
+		return h;
+	}
+
+	h.item = pin_entry( c, i );
+	h.slot = (uint32_t)(i - table_of( c, i )->slots);
+	h.generation = i->generation;
+	return h;
+
+}
+
+static foo* get_item( cache* c, size_t key ) {
+	return get_handle( c, key ).item;
+}
+
+static void release_item( cache* c, foo* f, size_t key ) {
+
+	if( c->rehashing ) {
+		rehash_step( c, REHASH_STEP );
+	}
+
+	entry* i = find_entry( c, key );
+	if( i == NULL ) {
+		// was not in the cache, just free it
+		TRACE_OP("Item %lu was not in the cache, doing a normal free()\n", key);
+		free_foo( c, f );
+		return;
+	}
+
+	unpin_entry( c, i );
+
+}
+
+// the entry a handle is for, NULL if it's stale
+static entry* handle_entry( cache* c, cache_handle h ) {
+
+	for( int n=0; n <= c->rehashing; n++ ) {
+		table* t = &c->tables[n];
+		if( h.slot <= t->slot_mask && t->control[h.slot] != SLOT_EMPTY && t->slots[h.slot].key == h.key ) {
+			entry* i = &t->slots[h.slot];
+			return i->generation == h.generation && i->refcount > 0 ? i : NULL;
+		}
+	}
+	// it moved
+	entry* i = find_entry( c, h.key );
+	return i && i->generation == h.generation && i->refcount > 0 ? i : NULL;
+}
+
+// release_item for a handle. false if it's stale, and then it's left alone
+static bool release_handle( cache* c, cache_handle h ) {
+
+	assert( h.item );
+	if( c->rehashing ) {
+		rehash_step( c, REHASH_STEP );
+	}
+
+	entry* i = handle_entry( c, h );
+	if( i == NULL ) {
+		TRACE_EVENT("Stale handle for key %lu\n", h.key );
+		return false;
+	}
+	unpin_entry( c, i );
+	return true;
+
+}
+
+/*
+Batched get_item/release_item: for a group of keys, hash all of them and prefetch their home
+slots first, then do the lookups. The cache misses of the group overlap instead of being taken
+one key at a time. Groups of BATCH_GROUP keys, so the hashes fit on the stack and the first
+slots are still in the cache by the time the last ones are prefetched.
+*/
+#define BATCH_GROUP 32
+
+// out[k] is NULL when keys[k] is not in the cache
+static void get_items( cache* c, const size_t* keys, size_t n, foo** out ) {
+
+	TRACE_OP("Getting %lu items\n", n);
+	if( c->rehashing ) {
+		rehash_step( c, REHASH_STEP * n );
+	}
+
+	size_t h[BATCH_GROUP];
+	for( size_t start=0; start<n; start+=BATCH_GROUP ) {
+		size_t end = start + BATCH_GROUP < n ? start + BATCH_GROUP : n;
+		for( size_t k=start; k<end; k++ ) {
+			h[k - start] = hash( keys[k] );
+			prefetch_slot( c, h[k - start] );
+		}
+		for( size_t k=start; k<end; k++ ) {
+			entry* i = find_entry_hashed( c, keys[k], h[k - start] );
+			if( i != NULL && expire_on_get( c, i ) ) {
+				i = NULL;
+			}
+			out[k] = i ? pin_entry( c, i ) : NULL;
+			if( i == NULL ) {
+				TRACE_RECORD( TRACE_MISS, keys[k], 0 );
+				c->stats.misses++;
+			}
+		}
+	}
+
+}
+
+// items[k] is the item that was pinned for keys[k], NULL entries are skipped
+static void release_items( cache* c, foo** items, const size_t* keys, size_t n ) {
+
+	TRACE_OP("Releasing %lu items\n", n);
+	if( c->rehashing ) {
+		rehash_step( c, REHASH_STEP * n );
+	}
+
+	size_t h[BATCH_GROUP];
+	for( size_t start=0; start<n; start+=BATCH_GROUP ) {
+		size_t end = start + BATCH_GROUP < n ? start + BATCH_GROUP : n;
+		for( size_t k=start; k<end; k++ ) {
+			h[k - start] = hash( keys[k] );
+			prefetch_slot( c, h[k - start] );
+		}
+		for( size_t k=start; k<end; k++ ) {
+			if( items[k] == NULL ) {
+				continue;
+			}
+			entry* i = find_entry_hashed( c, keys[k], h[k - start] );
+			if( i ) {
+				unpin_entry( c, i );
+			} else {
+				free_foo( c, items[k] );
+			}
+		}
+	}
+
+}
+
+// the counters so far, plus what follows from the item counts
+static cache_stats cache_stats_snapshot( cache* c ) {
+
+	cache_stats s = c->stats;
+	s.avg_probes = s.lookups ? (double)s.probes / (double)s.lookups : 0;
+	s.stored = c->num_stored;
+	s.pinned = c->num_stored - c->num_free_clean - c->num_free_dirty;
+	s.bytes = c->bytes_stored;
+	s.pinned_bytes = c->bytes_stored - c->bytes_free;
+	return s;
+}
+
+static void print_stats( cache_stats* s ) {
+
+	printf("hits %lu, misses %lu, revives %lu\n", s->hits, s->misses, s->revives );
+	printf("evictions %lu clean, %lu dirty, %lu not stored (full), %lu expired\n", s->clean_evictions, s->dirty_evictions, s->rejections, s->expirations );
+	printf("probes per lookup %.2f (max %lu), %lu stored, %lu pinned\n", s->avg_probes, s->max_probes, s->stored, s->pinned );
+	printf("%lu bytes stored, %lu pinned\n", s->bytes, s->pinned_bytes );
+
+}
+
+/*
+Snapshot and restore (see snapshot.c for the file). A record is the key, foo.b, the size (as
+sizeof(foo) without a byte budget) and the dirty flag, oldest use first: each free list from
+the end that was released the longest ago, the clean one first, then the pinned items (they're
+in use, so the newest). cache_restore replays them as add and release in that order, which
+puts every item on the free list it was on, in the same order.
+*/
+#define SNAPSHOT_RECORD (sizeof(size_t) + sizeof(size_t) + sizeof(uint32_t) + 1)
+
+static inline void put_record( snapshot_file* s, cache* c, size_t key, foo* f ) {
+
+	uint8_t record[SNAPSHOT_RECORD];
+	uint32_t size = c->byte_budget ? f->size : sizeof(foo);
+	memcpy( record, &key, sizeof(size_t) );
+	memcpy( record + sizeof(size_t), &f->b, sizeof(size_t) );
+	memcpy( record + 2 * sizeof(size_t), &size, sizeof(uint32_t) );
+	record[2 * sizeof(size_t) + sizeof(uint32_t)] = (uint8_t)(f->is_dirty != 0);
+	snapshot_put( s, record );
+}
+
+// false if the file couldn't be written
+static bool cache_snapshot( cache* c, int fd ) {
+
+	snapshot_file* s = snapshot_write_begin( fd, SNAPSHOT_RECORD, c->num_stored );
+	free_entry* lists[2] = { c->free_list, c->free_list_dirty };
+	for( int l=0; l<2; l++ ) {
+		if( lists[l] == NULL ) {
+			continue;
+		}
+		free_entry* current = lists[l]->prev;
+		do {
+			put_record( s, c, current->slot->key, current->evictable_foo );
+			current = current->prev;
+		} while( current != lists[l]->prev );
+	}
+	for( int n=0; n <= c->rehashing; n++ ) {
+		table* t = &c->tables[n];
+		for( size_t slot=0; slot<=t->slot_mask; slot++ ) {
+			if( t->control[slot] != SLOT_EMPTY && t->slots[slot].refcount > 0 ) {
+				put_record( s, c, t->slots[slot].key, t->slots[slot].ptr.to_foo );
+			}
+		}
+	}
+	TRACE_EVENT("Snapshot of %lu items\n", c->num_stored );
+	return snapshot_write_end( s );
+}
+
+/*
+Fills an empty cache from a snapshot, everything with refcount 0. When the file has more
+items than fit, the clean ones at its start (the oldest) are skipped. The rest go in like with
+add_item, a full cache evicts the oldest clean one, or else the oldest dirty one, which is
+written then (and counted in dirty_evictions). No dirty record is just dropped. false if the
+file isn't a snapshot, or is damaged (the items before the damage are in the cache then).
+*/
+static bool cache_restore( cache* c, int fd ) {
+
+	assert( c->num_stored == 0 );
+	snapshot_file* s = snapshot_read_begin( fd, SNAPSHOT_RECORD );
+	if( s == NULL ) {
+		return false;
+	}
+	finish_rehash( c );
+
+	size_t skip = s->count > c->capacity ? (size_t)s->count - c->capacity : 0;
+#if TRACE_LEVEL >= 1
+	uint64_t dirty_evictions = c->stats.dirty_evictions;
+#endif
+	const uint8_t* record;
+	while( (record = snapshot_next( s )) ) {
+		bool is_dirty = record[2 * sizeof(size_t) + sizeof(uint32_t)] != 0;
+		if( skip > 0 && !is_dirty ) {
+			skip--;
+			continue;
+		}
+		skip = 0;
+		size_t key, probes = 0;
+		uint32_t size;
+		memcpy( &key, record, sizeof(size_t) );
+		memcpy( &size, record + 2 * sizeof(size_t), sizeof(uint32_t) );
+		// a key that is in there twice keeps the first (not counted as a lookup)
+		if( find_in_table( &c->tables[0], key, hash( key ), &probes ) || !make_room( c, c->byte_budget ? size : 0 ) ) {
+			continue;
+		}
+		// once the clean ones at the start are skipped
+		if( c->num_stored >= c->capacity ) {
+			evict_any( c );
+		}
+		foo* f = cache_alloc_item( c );
+		memcpy( &f->b, record + sizeof(size_t), sizeof(size_t) );
+		f->size = size;
+		f->is_dirty = is_dirty;
+		// deadlines aren't in the file, the clock is this process's
+		f->expires = c->now + c->ttl;
+
+		entry* i = insert_into_table( &c->tables[0], key );
+		i->ptr.to_foo = f;
+		i->refcount = 1;
+		i->key = key;
+		i->generation = c->next_generation++;
+		c->num_stored++;
+		c->bytes_stored += weight( c, f );
+		unpin_entry( c, i );
+	}
+	TRACE_EVENT("Restored %lu items, %lu dirty ones didn't fit and were written\n", c->num_stored, c->stats.dirty_evictions - dirty_evictions );
+	return snapshot_read_end( s );
+}
+
+/********************** TESTS *************************/
+
+static void checks() {
+	
+	printf( "foo allocs/frees = %lu/%lu\n", counters.foo_allocs, counters.foo_frees);
+
+	assert( counters.foo_allocs == counters.foo_frees );
+	assert( counters.entry_allocs == counters.entry_frees );
+	assert( counters.free_entry_allocs == counters.free_entry_frees );
+	assert( counters.foo_chunk_allocs == counters.foo_chunk_frees );
+
+}
+
+// walk a free list, from the head on
+static size_t free_list_keys( free_entry* list, size_t* keys ) {
+
+	size_t n = 0;
+	free_entry* current = list;
+	if( current != NULL ) {
+		do {
+			keys[n++] = current->slot->key;
+			current = current->next;
+		} while( current != list );
+	}
+	return n;
+
+}
+
+// every stored key has to be reachable from its home slot, and every free entry has to point back at its slot
+static void check_table( cache* c ) {
+
+	size_t stored = 0;
+	for( int n=0; n <= c->rehashing; n++ ) {
+		table* t = &c->tables[n];
+		size_t in_table = 0;
+		for( size_t s=0; s<=t->slot_mask; s++ ) {
+			if( t->control[s] != SLOT_EMPTY ) {
+				in_table++;
+				assert( find_entry( c, t->slots[s].key ) == &t->slots[s] );
+				if( t->slots[s].refcount == 0 ) {
+					assert( t->slots[s].ptr.to_free_entry->slot == &t->slots[s] );
+				}
+			}
+		}
+		assert( in_table == t->num_stored );
+		stored += in_table;
+	}
+	assert( stored == c->num_stored );
+
+	size_t keys[c->num_stored + 1];
+	assert( free_list_keys( c->free_list, keys ) == c->num_free_clean );
+	assert( free_list_keys( c->free_list_dirty, keys ) == c->num_free_dirty );
+	
+}
+
+static void test_add() {
+	
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	dump( store );
+	
+	printf("==== Adding keys 1-10 ====\n");
+	
+	for(size_t i=1; i<11; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = false;
+		add_item( store, temp, i );
+	}
+	dump( store );
+	print_counters();
+
+	clear_cache( store );
+	free_cache( store );
+
+	checks();
+}
+
+static void test_add_release() {
+	
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	
+	printf("==== Adding and releasing keys 1-10 ====\n");
+	
+	for(size_t i=1; i<11; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = false;
+		add_item( store, temp, i );
+		release_item( store, temp, i );
+	}
+	dump( store );
+	print_counters();
+
+	clear_cache( store );
+	free_cache( store );
+
+	checks();
+	
+}
+
+static void test_free_entry_reuse() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+		
+	printf("==== Adding keys 1-12 (filling the cache), releasing 1-4 ====\n");
+	for(size_t i=1; i<store->capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = false;
+		add_item( store, temp, i );
+		if( i < 5 ) {
+			release_item( store, temp, i );
+		}
+	}
+
+	dump( store );
+
+	printf("==== Retrieving keys 3,4,5,6 (should take them off the free list/and increase refcount) ====\n");
+	for(size_t i=3; i<5; i++) {
+		foo* temp = get_item( store, i );
+		assert( temp != NULL );
+	}
+	dump( store );
+
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+	
+}
+
+static void test_single_add_release_get() {
+	
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	
+	printf("==== Add/Release/Retrieve keys 1 ====\n");
+	
+	foo* temp = (foo*)malloc( sizeof(foo) );
+	counters.foo_allocs++;
+	
+	size_t payload = 31415, key = 24;
+	temp->b = payload;
+	temp->is_dirty = false;
+	add_item( store, temp, key );
+	release_item( store, temp, key );
+	temp = NULL;
+	temp = get_item( store, key );
+	printf("temp->b = %lu\n", temp->b );
+	assert( temp != NULL );
+	assert( temp->b == payload );
+	assert( temp->is_dirty == false );
+
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+
+}
+
+// evicting an item should also remove it from the table, without
+// losing the keys that were probed past it
+static void test_evict_first_item_in_bucket() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	
+	printf("==== Evicting first item in a bucket ====\n");
+	
+	// fill the cache first
+	foo* first_in_bucket = NULL;
+	for(size_t i=1; i<=store->capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = false;
+		add_item( store, temp, i );
+		if( i == 8 ) {
+			first_in_bucket = temp;
+		}
+	}
+	
+	// puts it on the free list
+	release_item( store, first_in_bucket, 8 );
+	
+	// add some random new item, should evict 8
+	foo* temp = (foo*)malloc( sizeof(foo) );
+	counters.foo_allocs++;
+	temp->b = 1234;
+	temp->is_dirty = false;
+	add_item( store, temp , 55 );
+	dump( store );
+	check_table( store );
+	
+	// retrieve should fail now
+	foo* not_here = get_item( store, 8 );
+	assert( not_here == NULL );
+
+	// but everything else is still there
+	for(size_t i=1; i<=store->capacity; i++) {
+		if( i != 8 ) {
+			foo* here = get_item( store, i );
+			assert( here != NULL && here->b == i );
+		}
+	}
+	
+	dump( store );
+
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+	
+	
+}
+
+static void test_evict_middle_item_in_bucket() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	
+	printf("==== Evicting middle item in a bucket ====\n");
+	
+	// fill the cache first
+	foo* middle_in_bucket = NULL;
+	for(size_t i=1; i<=store->capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = false;
+		add_item( store, temp, i );
+		if( i == 7 ) {
+			middle_in_bucket = temp;
+		}
+	}
+	dump( store );
+
+	// puts it on the free list
+	release_item( store, middle_in_bucket, 7 );
+	
+	// add some random new item, should evict 7
+	foo* temp = (foo*)malloc( sizeof(foo) );
+	counters.foo_allocs++;
+	temp->b = 1234;
+	temp->is_dirty = false;
+	add_item( store, temp , 55 );
+
+	dump( store );
+	check_table( store );
+	
+	// retrieve should fail now
+	foo* not_here = get_item( store, 7 );
+	assert( not_here == NULL );
+	
+	dump( store );
+
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
 	
-	// puts it on the free list
-	release_item( store, first_in_bucket, 8 );
-	
-	// add some random new item, should evict 8
-	foo* temp = (foo*)malloc( sizeof(foo) );
+	
+}
+
+static void count_free_entries_by_dirty_clean( cache* store, size_t* clean, size_t* dirty ) {
+
+	for( int n=0; n <= store->rehashing; n++ ) {
+		table* t = &store->tables[n];
+		for(size_t s=0; s<=t->slot_mask; s++) {
+			entry* e = &t->slots[s];
+			if( t->control[s] != SLOT_EMPTY && e->refcount == 0 ) {
+				foo* current = e->ptr.to_free_entry->evictable_foo;
+				*dirty += current->is_dirty == true;
+				*clean += current->is_dirty == false;
+			}
+		}
+	}
+	
+}
+
+static void test_dirty_items() {
+	
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	
+	printf("==== Testing recycling dirty items first ====\n");
+	// fill the cache first
+	foo* saved[store->capacity+1];
+	for(size_t i=1; i<=store->capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		saved[i] = temp;
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = i % 2 == 0; // even items are dirty
+		add_item( store, temp, i );
+	}
+	dump( store );
+	
+	// release half the items
+	for(size_t i=1; i<=store->capacity/2; i++) {
+		release_item( store, saved[i], i );
+	}
+	dump( store );
+	
+	// now the free list is 1,2,3,4,5 (2,4 clean and 1,3,5 dirty) (depending on the cache size)
+	size_t num_clean_items_in_cache = 0;
+	size_t num_dirty_items_in_cache = 0;
+	count_free_entries_by_dirty_clean( store, &num_clean_items_in_cache, &num_dirty_items_in_cache);
+	printf("Clean items: %lu\n", num_clean_items_in_cache);
+	printf("Dirty items: %lu\n", num_dirty_items_in_cache);
+	
+	// add 2 items (forcing 2 to be evicted) and check if the clean ones were
+	foo* replacer1 = (foo*)malloc( sizeof(foo) );
+	counters.foo_allocs++;
+	replacer1->b = 31415;
+	replacer1->is_dirty = false;
+	add_item( store, replacer1, 31415 );
+	foo* replacer2 = (foo*)malloc( sizeof(foo) );
+	counters.foo_allocs++;
+	replacer2->b = 21718;
+	replacer2->is_dirty = false;
+	add_item( store, replacer2, 21718 );
+	dump( store );
+	
+	size_t num_clean_items_in_cache_after = 0;
+	size_t num_dirty_items_in_cache_after = 0;
+	count_free_entries_by_dirty_clean( store, &num_clean_items_in_cache_after, &num_dirty_items_in_cache_after);
+	printf("Clean items: %lu\n", num_clean_items_in_cache_after);
+	printf("Dirty items: %lu\n", num_dirty_items_in_cache_after);
+	
+	assert( num_dirty_items_in_cache_after == num_dirty_items_in_cache );
+	assert( num_clean_items_in_cache_after == num_clean_items_in_cache - 2);
+	
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+	
+}
+
+// whatever the budget, the items and the table have to fit in it
+static void test_sizing() {
+
+	printf("==== Sizing caches from a memory budget ====\n");
+
+	for( size_t budget = 1024; budget < 1024 * 1024; budget = budget * 3 / 2 ) {
+		cache* store = new_cache( budget );
+		size_t num_slots = store->tables[0].slot_mask + 1;
+		assert( (num_slots & store->tables[0].slot_mask) == 0 );
+		assert( store->capacity <= num_slots * 7 / 8 );
+		assert( store->capacity * BYTES_PER_CACHE_ITEM + num_slots * BYTES_PER_SLOT <= budget );
+		// and one more item wouldn't have fit, not even with twice the slots
+		assert( (store->capacity + 1) * BYTES_PER_CACHE_ITEM + num_slots * BYTES_PER_SLOT > budget || store->capacity + 1 > num_slots * 7 / 8 );
+		assert( (store->capacity + 1) * BYTES_PER_CACHE_ITEM + 2 * num_slots * BYTES_PER_SLOT > budget );
+		free_cache( store );
+	}
+
+}
+
+// lots of random add/get/release with evictions, so runs in the table get shifted around
+static void test_churn() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	printf("==== Random add/get/release churn ====\n");
+
+	foo* pinned[store->capacity * 4];
+	memset( pinned, 0, sizeof(pinned) );
+
+	srand( 1234 );
+	for( int n=0; n<10000; n++ ) {
+		size_t key = (size_t)rand() % (store->capacity * 4);
+		if( pinned[key] ) {
+			release_item( store, pinned[key], key );
+			pinned[key] = NULL;
+		} else {
+			foo* f = get_item( store, key );
+			if( f == NULL && store->num_stored < store->capacity ) {
+				f = (foo*)malloc( sizeof(foo) );
+				counters.foo_allocs++;
+				f->b = key;
+				f->is_dirty = rand() % 2;
+				add_item( store, f, key );
+			} else if( f == NULL ) {
+				// full, make room by letting go of something
+				if( store->free_list || store->free_list_dirty ) {
+					f = (foo*)malloc( sizeof(foo) );
+					counters.foo_allocs++;
+					f->b = key;
+					f->is_dirty = rand() % 2;
+					add_item( store, f, key );
+				}
+			}
+			assert( f == NULL || f->b == key );
+			pinned[key] = f;
+		}
+		check_table( store );
+	}
+
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+
+}
+
+// once items are in the cache, pinning and unpinning them (including the refcount 0
+// transitions that move them on and off the free lists) must not allocate anything
+static void test_steady_state_no_allocs() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	printf("==== Get/release without allocations ====\n");
+
+	for(size_t i=1; i<=store->capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = i % 3 == 0;
+		add_item( store, temp, i );
+		release_item( store, temp, i );
+	}
+
+	counter before = counters;
+	for(size_t n=0; n<1000; n++) {
+		size_t key = 1 + n % store->capacity;
+		foo* f = get_item( store, key );
+		assert( f != NULL && f->b == key );
+		if( n % 2 ) {
+			// pinned twice, so only the second release frees it up
+			assert( get_item( store, key ) == f );
+			release_item( store, f, key );
+		}
+		release_item( store, f, key );
+	}
+	print_counters();
+	assert( memcmp( &before, &counters, sizeof(counter) ) == 0 );
+	check_table( store );
+
+	clear_cache( store );
+	free_cache( store );
+	checks();
+
+}
+
+// with the payload slab, adding and evicting new items doesn't allocate once it's warmed up
+static void test_foo_slab( bool hugepages ) {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	use_foo_slab( store, hugepages );
+
+	printf("==== Payload slab (hugepages %d) ====\n", hugepages);
+
+	size_t capacity = store->capacity;
+	size_t chunks = counters.foo_chunk_allocs;
+	srand( 1234 );
+	for(size_t n=0; n<100 * capacity; n++) {
+		size_t key = 1 + n;
+		foo* f = cache_alloc_item( store );
+		f->b = key;
+		f->is_dirty = rand() % 2;
+		add_item( store, f, key );
+		if( rand() % 4 ) {
+			release_item( store, f, key );
+		} else {
+			// pinned twice, so only the second release frees it up
+			assert( get_item( store, key ) == f );
+			release_item( store, f, key );
+			release_item( store, f, key );
+		}
+	}
+	check_table( store );
+	assert( counters.foo_chunk_allocs == chunks );
+
+	// pin everything, the items that don't fit are held outside and then some more slots are needed
+	foo* held[capacity * 2];
+	for(size_t i=0; i<capacity * 2; i++) {
+		size_t key = 1000000 + i;
+		held[i] = cache_alloc_item( store );
+		held[i]->b = key;
+		held[i]->is_dirty = false;
+		add_item( store, held[i], key );
+	}
+	// (a huge page has room for all of them already)
+	assert( counters.foo_chunk_allocs > chunks || hugepages );
+	assert( store->num_foos >= capacity * 2 );
+	for(size_t i=0; i<capacity * 2; i++) {
+		release_item( store, held[i], held[i]->b );
+	}
+	check_table( store );
+
+	print_counters();
+	clear_cache( store );
+	free_cache( store );
+	checks();
+
+}
+
+// the cleaner writes dirty items ahead of time, so the evictions after that are all clean
+static void test_cleaner() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	printf("==== Cleaning dirty items before they're evicted ====\n");
+
+	size_t capacity = store->capacity;
+	for(size_t i=1; i<=capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = true;
+		add_item( store, temp, i );
+		release_item( store, temp, i );
+	}
+	assert( store->num_free_dirty == capacity && store->num_free_clean == 0 );
+
+	counter before = counters;
+	size_t half = capacity / 2;
+	assert( clean_items( store, half, 1 ) == 1 );
+	assert( clean_items( store, half, capacity ) == half - 1 );
+	assert( clean_items( store, half, capacity ) == 0 );
+	assert( counters.cleaner_writes - before.cleaner_writes == half );
+	check_table( store );
+
+	size_t cleaned[capacity];
+	assert( free_list_keys( store->free_list, cleaned ) == half );
+
+	// the cleaned ones go first, without writing anything
+	for(size_t i=1; i<=half; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = capacity + i;
+		temp->is_dirty = false;
+		add_item( store, temp, capacity + i );
+		// keep it, so it doesn't go on the clean free list
+	}
+	assert( counters.eviction_writes == before.eviction_writes );
+	for(size_t i=0; i<half; i++) {
+		assert( find_entry( store, cleaned[i] ) == NULL );
+	}
+	assert( store->num_free_dirty == capacity - half );
+	check_table( store );
+
+	for(size_t i=1; i<=half; i++) {
+		release_item( store, find_entry( store, capacity + i )->ptr.to_foo, capacity + i );
+	}
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+
+}
+
+// batched gets and releases do the same as one at a time, also in the middle of a resize
+static void test_batch() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	printf("==== Batched get/release ====\n");
+
+	size_t capacity = store->capacity;
+	foo* saved[capacity+1];
+	for(size_t i=1; i<=capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = i % 3 == 0;
+		add_item( store, temp, i );
+		saved[i] = temp;
+		// odd keys stay pinned
+		if( i % 2 == 0 ) {
+			release_item( store, temp, i );
+		}
+	}
+
+	for( int resize=0; resize<2; resize++ ) {
+		if( resize ) {
+			assert( resize_cache( store, CACHE_MEMORY_BYTES * 4 ) );
+		}
+
+		// every key twice, and as many that aren't in the cache
+		size_t n = 4 * capacity;
+		size_t keys[n];
+		foo* items[n];
+		for( size_t k=0; k<n; k++ ) {
+			keys[k] = k % 2 ? 1 + k / 2 % capacity : capacity + 1 + k;
+		}
+		get_items( store, keys, n, items );
+		check_table( store );
+		for( size_t k=0; k<n; k++ ) {
+			if( keys[k] <= capacity ) {
+				assert( items[k] == saved[keys[k]] );
+				entry* e = find_entry( store, keys[k] );
+				assert( e->refcount == (keys[k] % 2 ? 1u : 0u) + 2 );
+			} else {
+				assert( items[k] == NULL );
+			}
+		}
+
+		release_items( store, items, keys, n );
+		check_table( store );
+		for(size_t i=1; i<=capacity; i++) {
+			assert( find_entry( store, i )->refcount == i % 2 );
+		}
+		assert( store->num_free_clean + store->num_free_dirty == capacity / 2 );
+	}
+
+	for(size_t i=1; i<=capacity; i+=2) {
+		release_item( store, saved[i], i );
+	}
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+
+}
+
+// the stats count what the operations did
+static void test_stats() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	printf("==== Stats ====\n");
+	size_t capacity = store->capacity;
+	foo* saved[capacity+1];
+	for(size_t i=1; i<=capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = i % 2 == 0;
+		add_item( store, temp, i );
+		saved[i] = temp;
+	}
+	cache_stats s = cache_stats_snapshot( store );
+	assert( s.stored == capacity && s.pinned == capacity );
+	assert( s.hits == 0 && s.misses == 0 && s.revives == 0 );
+
+	// the first half are pinned twice, so only the second half are revived later
+	for(size_t i=1; i<=capacity; i++) {
+		if( i <= capacity / 2 ) {
+			assert( get_item( store, i ) == saved[i] );
+		}
+		release_item( store, saved[i], i );
+	}
+	assert( get_item( store, capacity + 1 ) == NULL );
+	for(size_t i=1; i<=capacity; i++) {
+		assert( get_item( store, i ) == saved[i] );
+	}
+	s = cache_stats_snapshot( store );
+	print_stats( &s );
+	assert( s.hits == capacity / 2 + capacity );
+	assert( s.misses == 1 );
+	assert( s.revives == capacity - capacity / 2 );
+	assert( s.pinned == capacity );
+	assert( s.lookups >= s.hits + s.misses && s.max_probes >= 1 && s.avg_probes > 0 );
+
+	// everything is pinned, so this doesn't fit
+	foo* rejected = (foo*)malloc( sizeof(foo) );
+	counters.foo_allocs++;
+	rejected->b = 0;
+	rejected->is_dirty = false;
+	add_item( store, rejected, capacity + 1 );
+	release_item( store, rejected, capacity + 1 );
+	assert( cache_stats_snapshot( store ).rejections == 1 );
+
+	// unpin all, the new items push out every clean one (the odd keys) and then two dirty ones
+	size_t num_clean = capacity - capacity / 2;
+	for(size_t i=1; i<=capacity; i++) {
+		release_item( store, saved[i], i );
+		if( i <= capacity / 2 ) {
+			release_item( store, saved[i], i );
+		}
+	}
+	for(size_t i=1; i<=num_clean + 2; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = false;
+		add_item( store, temp, capacity + 1 + i );
+	}
+	s = cache_stats_snapshot( store );
+	print_stats( &s );
+	assert( s.clean_evictions == num_clean && s.dirty_evictions == 2 );
+	assert( s.stored == capacity && s.pinned == num_clean + 2 );
+
+	for(size_t i=1; i<=num_clean + 2; i++) {
+		release_item( store, find_entry( store, capacity + 1 + i )->ptr.to_foo, capacity + 1 + i );
+	}
+	clear_cache( store );
+	free_cache( store );
+	print_counters();
+	checks();
+
+}
+
+// a snapshot restores every item, on the same free list in the same order
+static void test_snapshot() {
+
+	printf("==== Snapshot ====\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	size_t capacity = store->capacity;
+	for(size_t i=1; i<=capacity; i++) {
+		foo* f = cache_alloc_item( store );
+		f->b = i * 3;
+		f->is_dirty = i % 3 == 0;
+		add_item( store, f, i );
+	}
+	// not in key order, and the last one is still pinned
+	for(size_t i=capacity - 1; i>=1; i--) {
+		if( i % 2 == 0 ) {
+			release_item( store, find_entry( store, i )->ptr.to_foo, i );
+		}
+	}
+	for(size_t i=1; i<capacity; i+=2) {
+		release_item( store, find_entry( store, i )->ptr.to_foo, i );
+	}
+	FILE* file = tmpfile();
+	int fd = fileno( file );
+	assert( cache_snapshot( store, fd ) );
+	// same place in the lists as the restored one
+	release_item( store, find_entry( store, capacity )->ptr.to_foo, capacity );
+
+	cache* restored = new_cache( CACHE_MEMORY_BYTES );
+	lseek( fd, 0, SEEK_SET );
+	assert( cache_restore( restored, fd ) );
+	check_table( restored );
+	assert( restored->num_stored == capacity && cache_stats_snapshot( restored ).pinned == 0 );
+	size_t keys[capacity], restored_keys[capacity];
+	size_t n = free_list_keys( store->free_list, keys );
+	assert( free_list_keys( restored->free_list, restored_keys ) == n && memcmp( keys, restored_keys, n * sizeof(size_t) ) == 0 );
+	n = free_list_keys( store->free_list_dirty, keys );
+	assert( free_list_keys( restored->free_list_dirty, restored_keys ) == n && memcmp( keys, restored_keys, n * sizeof(size_t) ) == 0 );
+	for(size_t i=1; i<=capacity; i++) {
+		foo* f = get_item( restored, i );
+		assert( f && f->b == i * 3 && f->is_dirty == (i % 3 == 0) );
+		release_item( restored, f, i );
+	}
+	clear_cache( restored );
+	free_cache( restored );
+
+	// a smaller cache gets the newest ones, and every dirty one
+	restored = new_cache( CACHE_MEMORY_BYTES / 2 );
+	lseek( fd, 0, SEEK_SET );
+	assert( cache_restore( restored, fd ) );
+	check_table( restored );
+	assert( restored->num_stored == restored->capacity && restored->capacity < capacity );
+	assert( find_entry( restored, capacity ) && find_entry( restored, store->free_list->slot->key ) );
+	for(size_t i=3; i<=capacity; i+=3) {
+		assert( find_entry( restored, i ) );
+	}
+	// the first record in the file
+	assert( find_entry( restored, store->free_list->prev->slot->key ) == NULL );
+	assert( restored->stats.dirty_evictions == 0 );
+	clear_cache( restored );
+	free_cache( restored );
+
+	// more dirty ones than fit: none are skipped, the oldest are evicted like in add_item (so written)
+	cache* dirty_store = new_cache( CACHE_MEMORY_BYTES );
+	for(size_t i=1; i<=capacity; i++) {
+		foo* f = cache_alloc_item( dirty_store );
+		f->b = i;
+		f->is_dirty = i % 4 != 0;
+		add_item( dirty_store, f, i );
+		release_item( dirty_store, f, i );
+	}
+	FILE* dirty_file = tmpfile();
+	assert( dirty_file && cache_snapshot( dirty_store, fileno( dirty_file ) ) );
+	size_t writes = counters.eviction_writes;
+	restored = new_cache( CACHE_MEMORY_BYTES / 2 );
+	lseek( fileno( dirty_file ), 0, SEEK_SET );
+	assert( cache_restore( restored, fileno( dirty_file ) ) );
+	check_table( restored );
+	size_t num_dirty = capacity - capacity / 4;
+	assert( restored->num_stored == restored->capacity && restored->num_free_dirty == restored->capacity );
+	assert( restored->stats.dirty_evictions == num_dirty - restored->capacity && counters.eviction_writes - writes == num_dirty - restored->capacity );
+	assert( find_entry( restored, capacity % 4 != 0 ? capacity : capacity - 1 ) );
+	fclose( dirty_file );
+	clear_cache( restored );
+	free_cache( restored );
+	clear_cache( dirty_store );
+	free_cache( dirty_store );
+
+	// damaged or cut short, the block with the damage isn't used
+	restored = new_cache( CACHE_MEMORY_BYTES );
+	uint8_t byte;
+	off_t damage = (off_t)(sizeof(snapshot_header) + sizeof(snapshot_block) + 5);
+	assert( pread( fd, &byte, 1, damage ) == 1 );
+	byte ^= 1;
+	assert( pwrite( fd, &byte, 1, damage ) == 1 );
+	lseek( fd, 0, SEEK_SET );
+	assert( !cache_restore( restored, fd ) && restored->num_stored == 0 );
+	byte ^= 1;
+	assert( pwrite( fd, &byte, 1, damage ) == 1 );
+	assert( ftruncate( fd, lseek( fd, 0, SEEK_END ) - 1 ) == 0 );
+	lseek( fd, 0, SEEK_SET );
+	assert( !cache_restore( restored, fd ) && restored->num_stored == 0 );
+	assert( ftruncate( fd, 0 ) == 0 );
+	lseek( fd, 0, SEEK_SET );
+	assert( !cache_restore( restored, fd ) );
+	fclose( file );
+
+	free_cache( restored );
+	clear_cache( store );
+	free_cache( store );
+	checks();
+
+}
+
+static foo* add_sized( cache* c, size_t key, uint32_t size, bool is_dirty ) {
+
+	foo* f = cache_alloc_item( c );
+	f->b = key;
+	f->size = size;
+	f->is_dirty = is_dirty;
+	add_item( c, f, key );
+	return f;
+}
+
+// with a byte budget add_item evicts by size, clean first, and can't evict pinned bytes
+static void test_byte_budget() {
+
+	printf("==== Byte budget ====\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES * 4 );
+	set_byte_budget( store, 1000 );
+	assert( store->capacity > 20 );
+
+	// the odd ones dirty
+	for(size_t i=0; i<10; i++) {
+		release_item( store, add_sized( store, i, 100, i % 2 == 1 ), i );
+	}
+	cache_stats s = cache_stats_snapshot( store );
+	assert( s.stored == 10 && s.bytes == 1000 && s.pinned_bytes == 0 );
+
+	// needs three clean ones to go
+	release_item( store, add_sized( store, 10, 250, false ), 10 );
+	check_table( store );
+	s = cache_stats_snapshot( store );
+	assert( s.stored == 8 && s.bytes == 950 && s.clean_evictions == 3 && s.dirty_evictions == 0 );
+	for(size_t i=1; i<10; i+=2) {
+		assert( find_entry( store, i ) );
+	}
+
+	// everything pinned: no room, and nothing is evicted for it
+	foo* pinned[11];
+	size_t keys[11];
+	size_t num_pinned = 0;
+	for(size_t i=0; i<=10; i++) {
+		if( (pinned[num_pinned] = get_item( store, i )) ) {
+			keys[num_pinned++] = i;
+		}
+	}
+	foo* big = cache_alloc_item( store );
+	big->size = 200;
+	assert( !add_item( store, big, 11 ) );
+	release_item( store, big, 11 );
+	s = cache_stats_snapshot( store );
+	assert( s.stored == 8 && s.pinned_bytes == 950 && s.rejections == 1 );
+
+	// released, one item of the whole budget pushes out all of them, the dirty ones last
+	for(size_t i=0; i<num_pinned; i++) {
+		release_item( store, pinned[i], keys[i] );
+	}
+	release_item( store, add_sized( store, 12, 1000, true ), 12 );
+	check_table( store );
+	s = cache_stats_snapshot( store );
+	assert( s.stored == 1 && s.bytes == 1000 && s.clean_evictions == 6 && s.dirty_evictions == 5 );
+
+	// and one that's bigger than the budget never fits
+	big = cache_alloc_item( store );
+	big->size = 1001;
+	assert( !add_item( store, big, 13 ) );
+	release_item( store, big, 13 );
+	print_stats( &s );
+
+	clear_cache( store );
+	free_cache( store );
+	checks();
+
+}
+
+static void add_at( cache* c, size_t key, uint64_t now, bool is_dirty ) {
+
+	expire_items( c, now, SIZE_MAX );
+	foo* f = cache_alloc_item( c );
+	f->b = key;
+	f->is_dirty = is_dirty;
+	add_item( c, f, key );
+}
+
+// free items go when their ttl is up, pinned ones when they're released, and a late one is a miss
+static void test_ttl() {
+
+	printf("==== TTL ====\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	set_ttl( store, 10 );
+	for(size_t i=1; i<=4; i++) {
+		add_at( store, i, 0, i == 2 );
+		if( i < 4 ) {
+			release_item( store, find_entry( store, i )->ptr.to_foo, i );
+		}
+	}
+	add_at( store, 5, 5, false );
+	release_item( store, find_entry( store, 5 )->ptr.to_foo, 5 );
+	size_t writes = counters.eviction_writes;
+	assert( expire_items( store, 9, SIZE_MAX ) == 0 && store->num_stored == 5 );
+	assert( expire_items( store, 10, SIZE_MAX ) == 3 );
+	check_table( store );
+	assert( store->num_stored == 2 && find_entry( store, 4 ) && find_entry( store, 5 ) );
+	assert( counters.eviction_writes == writes + 1 );
+
+	// 4 was pinned past its deadline
+	release_item( store, find_entry( store, 4 )->ptr.to_foo, 4 );
+	assert( find_entry( store, 4 ) == NULL && store->stats.expirations == 4 );
+
+	// a get doesn't make 5 last longer
+	expire_items( store, 12, SIZE_MAX );
+	foo* f = get_item( store, 5 );
+	assert( f && f->b == 5 );
+	release_item( store, f, 5 );
+	assert( expire_items( store, 14, SIZE_MAX ) == 0 );
+	assert( expire_items( store, 15, SIZE_MAX ) == 1 && store->num_stored == 0 );
+
+	// with a limit per call the rest stay, and a get that finds one misses
+	for(size_t i=1; i<=10; i++) {
+		add_at( store, i, 20, false );
+		release_item( store, find_entry( store, i )->ptr.to_foo, i );
+	}
+	assert( expire_items( store, 30, 3 ) == 3 && store->num_stored == 7 );
+	size_t misses = store->stats.misses;
+	size_t key = store->free_list->slot->key;
+	assert( get_item( store, key ) == NULL && find_entry( store, key ) == NULL );
+	assert( store->stats.misses == misses + 1 && store->num_stored == 6 );
+	foo* out[2];
+	size_t keys[2] = { store->free_list->slot->key, 1000 };
+	get_items( store, keys, 2, out );
+	assert( out[0] == NULL && out[1] == NULL && store->stats.misses == misses + 3 );
+	assert( expire_items( store, 30, SIZE_MAX ) == 5 && store->num_stored == 0 );
+	check_table( store );
+	print_stats( &store->stats );
+	clear_cache( store );
+	free_cache( store );
+
+	// deadlines on the upper levels, and past the end of the wheel
+	store = new_cache( CACHE_MEMORY_BYTES );
+	uint64_t ttls[3] = { 100, 5000, ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) + 100 };
+	for( int n=0; n<3; n++ ) {
+		uint64_t start = store->now;
+		set_ttl( store, ttls[n] );
+		for(size_t i=0; i<store->capacity; i++) {
+			add_at( store, i, start + i * 7, i % 2 == 0 );
+			release_item( store, find_entry( store, i )->ptr.to_foo, i );
+		}
+		// the whole way, one item at a time
+		for(size_t i=0; i<store->capacity; i++) {
+			assert( expire_items( store, start + i * 7 + ttls[n] - 1, SIZE_MAX ) == 0 );
+			assert( find_entry( store, i ) != NULL );
+			assert( expire_items( store, start + i * 7 + ttls[n], SIZE_MAX ) == 1 );
+			assert( find_entry( store, i ) == NULL );
+			check_table( store );
+		}
+		assert( store->num_stored == 0 );
+	}
+
+	// a long pause goes from one slot with items to the next, a tick at a time this would never end
+	uint64_t start = store->now;
+	uint64_t ttl = (uint64_t)1 << 36;
+	set_ttl( store, ttl );
+	for(size_t i=0; i<store->capacity; i++) {
+		add_at( store, i, start + i * ((uint64_t)1 << 30), false );
+		release_item( store, find_entry( store, i )->ptr.to_foo, i );
+	}
+	assert( expire_items( store, start + ttl + ((uint64_t)1 << 30) - 1, SIZE_MAX ) == 1 );
+	assert( find_entry( store, 0 ) == NULL && find_entry( store, 1 ) != NULL );
+	assert( expire_items( store, start + ttl + ((uint64_t)1 << 40), SIZE_MAX ) == store->capacity - 1 );
+	assert( store->num_stored == 0 );
+	check_table( store );
+	free_cache( store );
+	checks();
+
+}
+
+// every probe finds the same entries after as many slots as the scalar one, also in tables smaller
+// than a group and with runs that wrap around the end
+static void test_probes() {
+
+	printf("==== Probes ====\n");
+	int saved = probe;
+	size_t sizes[] = { 8, 16, 64, 1024 };
+	srand( 1234 );
+	for( size_t n=0; n<sizeof(sizes) / sizeof(sizes[0]); n++ ) {
+		size_t num_slots = sizes[n];
+		table t;
+		init_table( &t, num_slots );
+		for( size_t round=0; round<4 * num_slots; round++ ) {
+			size_t key = (size_t)rand() % (2 * num_slots);
+			size_t probes = 0;
+			entry* e = find_in_table_scalar( &t, key, hash( key ), &probes );
+			if( e ) {
+				remove_slot( &t, (size_t)(e - t.slots) );
+			} else if( t.num_stored < num_slots * 7 / 8 ) {
+				e = insert_into_table( &t, key );
+				e->key = key;
+				e->refcount = 1;
+			}
+			for( size_t k=0; k<CONTROL_CLONES; k++ ) {
+				assert( t.control[num_slots + k] == t.control[k & t.slot_mask] );
+			}
+			if( round % (num_slots / 8) != 0 ) {
+				continue;
+			}
+			for( key=0; key<2 * num_slots; key++ ) {
+				size_t scalar_probes = 0;
+				entry* expected = find_in_table_scalar( &t, key, hash( key ), &scalar_probes );
+				for( int kind=PROBE_SSE2; kind<=(int)best_probe(); kind++ ) {
+					probe = kind;
+					probes = 0;
+					assert( find_in_table( &t, key, hash( key ), &probes ) == expected && probes == scalar_probes );
+				}
+			}
+		}
+		free_table( &t );
+	}
+	probe = saved;
+
+}
+
+// release_handle goes to the slot get_handle left the entry in, follows it when it moved, and refuses a stale one
+static void test_handles() {
+
+	printf("==== Handles ====\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	size_t capacity = store->capacity;
+	assert( get_handle( store, 1 ).item == NULL );
+	for(size_t i=1; i<=capacity; i++) {
+		foo* f = cache_alloc_item( store );
+		f->b = i;
+		f->is_dirty = false;
+		add_item( store, f, i );
+		release_item( store, f, i );
+	}
+	cache_handle h = get_handle( store, 1 );
+	assert( h.item && h.item->b == 1 );
+	size_t lookups = store->stats.lookups;
+	assert( release_handle( store, h ) && store->stats.lookups == lookups );
+	assert( find_entry( store, 1 )->refcount == 0 );
+	// released already
+	assert( !release_handle( store, h ) );
+
+	// each one released and evicted in turn, the rest of its run shifts back
+	cache_handle handles[capacity + 1];
+	for(size_t i=1; i<=capacity; i++) {
+		handles[i] = get_handle( store, i );
+	}
+	size_t moved = 0;
+	for(size_t i=1; i<=capacity; i++) {
+		table* t = &store->tables[0];
+		moved += t->control[handles[i].slot] == SLOT_EMPTY || t->slots[handles[i].slot].key != i;
+		assert( release_handle( store, handles[i] ) );
+		foo* f = cache_alloc_item( store );
+		f->b = capacity + i;
+		f->is_dirty = false;
+		assert( add_item( store, f, capacity + i ) );
+		assert( find_entry( store, i ) == NULL );
+		check_table( store );
+	}
+	assert( moved > 0 );
+	assert( store->stats.clean_evictions == capacity && cache_stats_snapshot( store ).pinned == capacity );
+
+	// and to the new table, while resizing and after
+	for(size_t i=1; i<=capacity; i++) {
+		handles[i] = get_handle( store, capacity + i );
+		release_item( store, handles[i].item, capacity + i );
+	}
+	assert( resize_cache( store, CACHE_MEMORY_BYTES * 4 ) );
+	for(size_t i=1; i<=capacity; i++) {
+		assert( release_handle( store, handles[i] ) );
+		if( i == capacity / 2 ) {
+			finish_rehash( store );
+		}
+	}
+	assert( cache_stats_snapshot( store ).pinned == 0 );
+	check_table( store );
+
+	// a key added again gets a new generation
+	h = get_handle( store, capacity + 1 );
+	assert( release_handle( store, h ) );
+	foo* f = cache_alloc_item( store );
+	f->b = 0;
+	f->is_dirty = false;
+	resize_cache( store, CACHE_MEMORY_BYTES );
+	finish_rehash( store );
+	while( find_entry( store, capacity + 1 ) ) {
+		f->b++;
+		foo* g = cache_alloc_item( store );
+		g->b = 0;
+		g->is_dirty = false;
+		add_item( store, g, 10 * capacity + f->b );
+		release_item( store, g, 10 * capacity + f->b );
+	}
+	add_item( store, f, capacity + 1 );
+	assert( !release_handle( store, h ) && find_entry( store, capacity + 1 )->refcount == 1 );
+	release_item( store, f, capacity + 1 );
+
+	clear_cache( store );
+	free_cache( store );
+	checks();
+
+}
+
+#ifdef TRACE_RING
+// the ring has every operation, in order
+static void test_trace_ring() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	printf("==== Trace ring ====\n");
+	trace_reset();
+	foo* f = (foo*)malloc( sizeof(foo) );
 	counters.foo_allocs++;
-	temp->b = 1234;
-	temp->is_dirty = false;
-	add_item( store, temp , 55 );
-	dump( store );
-	
-	// retrieve should fail now
-	foo* not_here = get_item( store, 11 );
-	assert( not_here == NULL );
-	
-	dump( store );
+	f->b = 1;
+	f->is_dirty = true;
+	add_item( store, f, 1 );
+	assert( get_item( store, 1 ) == f );
+	assert( get_item( store, 2 ) == NULL );
+	release_item( store, f, 1 );
+	release_item( store, f, 1 );
+	clean_items( store, 1, 1 );
+	trace_dump( stdout );
+
+	trace_event events[8];
+	size_t count = trace_read( events, 8 );
+	trace_type expected[] = { TRACE_ADD, TRACE_HIT, TRACE_MISS, TRACE_RELEASE, TRACE_RELEASE, TRACE_WRITE };
+	assert( count == sizeof(expected) / sizeof(expected[0]) );
+	for( size_t n=0; n<count; n++ ) {
+		assert( events[n].seq == n + 1 );
+		assert( events[n].type == expected[n] );
+		assert( events[n].a == (expected[n] == TRACE_MISS ? 2u : 1u) );
+	}
+	assert( events[1].b == 2 && events[4].b == 0 );
 
 	clear_cache( store );
-	print_counters();
+	free_cache( store );
 	checks();
-	
-	
+
 }
+#endif
 
-static void test_evict_middle_item_in_bucket() {
+// grow and shrink a live cache, the items move over while it's being used
+static void test_resize() {
 
-	cache* store = new_cache();
-	
-	printf("==== Evicting middle item in a bucket ====\n");
-	
-	// fill the cache first
-	foo* middle_in_bucket = NULL;
-	for(size_t i=1; i<=CACHE_SIZE; i++) {
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	printf("==== Resizing a live cache ====\n");
+
+	size_t capacity = store->capacity;
+	foo* saved[capacity+1];
+	for(size_t i=1; i<=capacity; i++) {
 		foo* temp = (foo*)malloc( sizeof(foo) );
 		counters.foo_allocs++;
 		temp->b = i;
-		temp->is_dirty = false;
+		temp->is_dirty = i % 3 == 0;
 		add_item( store, temp, i );
-		if( i == 7 ) {
-			middle_in_bucket = temp;
+		saved[i] = temp;
+		// even keys stay pinned
+		if( i % 2 ) {
+			release_item( store, temp, i );
 		}
 	}
-	dump( store );
 
-	// puts it on the free list
-	release_item( store, middle_in_bucket, 7 );
-	
-	// add some random new item, should evict 7
-	foo* temp = (foo*)malloc( sizeof(foo) );
-	counters.foo_allocs++;
-	temp->b = 1234;
-	temp->is_dirty = false;
-	add_item( store, temp , 55 );
+	size_t clean[capacity], dirty[capacity];
+	size_t num_clean = free_list_keys( store->free_list, clean );
+	size_t num_dirty = free_list_keys( store->free_list_dirty, dirty );
+
+	assert( resize_cache( store, CACHE_MEMORY_BYTES * 4 ) );
+	assert( store->rehashing );
+	assert( store->capacity > capacity );
+
+	// only the pinned items are touched, so the free lists stay as they are
+	size_t ops = 0;
+	while( store->rehashing ) {
+		size_t key = 2 + 2 * (ops % (capacity / 2));
+		assert( get_item( store, key ) == saved[key] );
+		release_item( store, saved[key], key );
+		check_table( store );
+		for(size_t i=1; i<=capacity; i++) {
+			entry* e = find_entry( store, i );
+			assert( e != NULL );
+			assert( (e->refcount ? e->ptr.to_foo : e->ptr.to_free_entry->evictable_foo) == saved[i] );
+		}
+		ops++;
+	}
+	printf("Moved %lu items in %lu operations\n", capacity, ops);
+	assert( ops <= capacity );
 
-	dump( store );
-	
-	// retrieve should fail now
-	foo* not_here = get_item( store, 7 );
-	assert( not_here == NULL );
-	
-	dump( store );
+	size_t keys[capacity];
+	assert( free_list_keys( store->free_list, keys ) == num_clean );
+	assert( memcmp( keys, clean, num_clean * sizeof(size_t) ) == 0 );
+	assert( free_list_keys( store->free_list_dirty, keys ) == num_dirty );
+	assert( memcmp( keys, dirty, num_dirty * sizeof(size_t) ) == 0 );
+
+	// room for more without evicting
+	for(size_t i=capacity+1; i<=store->capacity; i++) {
+		foo* temp = (foo*)malloc( sizeof(foo) );
+		counters.foo_allocs++;
+		temp->b = i;
+		temp->is_dirty = false;
+		add_item( store, temp, i );
+		release_item( store, temp, i );
+	}
+	assert( store->num_stored == store->capacity );
+	check_table( store );
+
+	// shrinking evicts the unpinned items that don't fit any more, clean ones first
+	assert( resize_cache( store, CACHE_MEMORY_BYTES ) );
+	assert( store->capacity == capacity );
+	assert( store->num_stored == capacity );
+	finish_rehash( store );
+	check_table( store );
+	for(size_t i=2; i<=capacity; i+=2) {
+		assert( find_entry( store, i )->ptr.to_foo == saved[i] );
+	}
+	size_t clean_after = 0, dirty_after = 0;
+	count_free_entries_by_dirty_clean( store, &clean_after, &dirty_after );
+	assert( dirty_after == num_dirty );
+
+	// the pinned items alone don't fit in half the budget
+	assert( !resize_cache( store, CACHE_MEMORY_BYTES / 4 ) );
+	assert( store->free_list == NULL && store->free_list_dirty == NULL );
+	check_table( store );
 
+	for(size_t i=2; i<=capacity; i+=2) {
+		release_item( store, saved[i], i );
+	}
 	clear_cache( store );
+	free_cache( store );
 	print_counters();
 	checks();
-	
-	
+
 }
 
-static void count_free_entries_by_dirty_clean( cache* store, size_t* clean, size_t* dirty ) {
+/********************** BENCHMARK *************************/
 
-	for(size_t i=0; i<CACHE_SIZE; i++) {
-		entry* e = store->buckets[i];
-		while( e != NULL ) {
-			foo* current;
-			if( e->refcount == 0 ) {
-				current = e->ptr.to_free_entry->evictable_foo;
-				*dirty += current->is_dirty == true;
-				*clean += current->is_dirty == false;
-			}
-			e = e->next;
+#ifdef BENCHMARK
+
+typedef struct lookup_params {
+	cache* store;
+	size_t* keys;
+	size_t num_keys;
+	size_t found;
+	size_t batch;
+} lookup_params;
+
+// get and release every key, the items are pinned so this is just the table lookups
+static void lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	for( size_t i=0; i<p->num_keys; i++ ) {
+		foo* f = get_item( p->store, p->keys[i] );
+		if( f ) {
+			p->found++;
+			release_item( p->store, f, p->keys[i] );
 		}
 	}
-	
+
 }
 
-static void test_dirty_items() {
-	
-	cache* store = new_cache();
-	
-	printf("==== Testing recycling dirty items first ====\n");
-	// fill the cache first
-	foo* saved[CACHE_SIZE+1];
-	for(size_t i=1; i<=CACHE_SIZE; i++) {
-		foo* temp = (foo*)malloc( sizeof(foo) );
-		saved[i] = temp;
-		counters.foo_allocs++;
-		temp->b = i;
-		temp->is_dirty = i % 2 == 0; // even items are dirty
-		add_item( store, temp, i );
+// the same through get_handle/release_handle, the release goes straight to the slot
+static void handle_lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	for( size_t i=0; i<p->num_keys; i++ ) {
+		cache_handle h = get_handle( p->store, p->keys[i] );
+		if( h.item ) {
+			p->found++;
+			release_handle( p->store, h );
+		}
 	}
-	dump( store );
-	
-	// release half the items
-	for(size_t i=1; i<=CACHE_SIZE/2; i++) {
-		release_item( store, saved[i], i );
+
+}
+
+// the same through get_items/release_items, batch keys at a time
+static void batch_lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	foo* items[p->batch];
+	for( size_t i=0; i<p->num_keys; i+=p->batch ) {
+		size_t n = p->num_keys - i < p->batch ? p->num_keys - i : p->batch;
+		get_items( p->store, p->keys + i, n, items );
+		for( size_t k=0; k<n; k++ ) {
+			p->found += items[k] != NULL;
+		}
+		release_items( p->store, items, p->keys + i, n );
 	}
-	dump( store );
-	
-	// now the free list is 1,2,3,4,5 (2,4 clean and 1,3,5 dirty) (depending on the cache size)
-	size_t num_clean_items_in_cache = 0;
-	size_t num_dirty_items_in_cache = 0;
-	count_free_entries_by_dirty_clean( store, &num_clean_items_in_cache, &num_dirty_items_in_cache);
-	printf("Clean items: %lu\n", num_clean_items_in_cache);
-	printf("Dirty items: %lu\n", num_dirty_items_in_cache);
-	
-	// add 2 items (forcing 2 to be evicted) and check if the clean ones were
-	foo* replacer1 = (foo*)malloc( sizeof(foo) );
-	counters.foo_allocs++;
-	replacer1->b = 31415;
-	replacer1->is_dirty = false;
-	add_item( store, replacer1, 31415 );
-	foo* replacer2 = (foo*)malloc( sizeof(foo) );
-	counters.foo_allocs++;
-	replacer2->b = 21718;
-	replacer2->is_dirty = false;
-	add_item( store, replacer2, 21718 );
-	dump( store );
-	
-	size_t num_clean_items_in_cache_after = 0;
-	size_t num_dirty_items_in_cache_after = 0;
-	count_free_entries_by_dirty_clean( store, &num_clean_items_in_cache_after, &num_dirty_items_in_cache_after);
-	printf("Clean items: %lu\n", num_clean_items_in_cache_after);
-	printf("Dirty items: %lu\n", num_dirty_items_in_cache_after);
-	
-	assert( num_dirty_items_in_cache_after == num_dirty_items_in_cache );
-	assert( num_clean_items_in_cache_after == num_clean_items_in_cache - 2);
-	
+
+}
+
+/*
+Just a table, hit and miss lookups with every probe this CPU can run, up to load factors past
+the 7/8 the cache stops at. The runs get long there, which is where a group probe pays.
+*/
+#define PROBE_BENCHMARK_SLOTS (1 << 20)
+
+typedef struct probe_params {
+	table* t;
+	size_t* keys;
+	size_t num_keys;
+	size_t found;
+	size_t probes;
+} probe_params;
+
+static void probe_benchmark( void* params ) {
+
+	probe_params* p = (probe_params*) params;
+	for( size_t i=0; i<p->num_keys; i++ ) {
+		p->found += find_in_table( p->t, p->keys[i], hash( p->keys[i] ), &p->probes ) != NULL;
+	}
+
+}
+
+static void run_probe_benchmark() {
+
+	double loads[] = { 0.5, 0.75, 0.875, 0.95 };
+	const char* names[] = { "scalar", "sse2", "avx2" };
+	int saved = probe;
+	size_t num_keys = 100 * 1000;
+	size_t* hit_keys = (size_t*) malloc( num_keys * sizeof(size_t) );
+	size_t* miss_keys = (size_t*) malloc( num_keys * sizeof(size_t) );
+
+	printf("load	probe	hit lookups/s	miss lookups/s	slots per miss\n");
+	for( size_t l=0; l<sizeof(loads) / sizeof(loads[0]); l++ ) {
+		table t;
+		init_table( &t, PROBE_BENCHMARK_SLOTS );
+		size_t n = (size_t)(loads[l] * PROBE_BENCHMARK_SLOTS);
+		for( size_t i=0; i<n; i++ ) {
+			entry* e = insert_into_table( &t, i * 2 );
+			e->key = i * 2;
+			e->refcount = 1;
+		}
+		srand( 1234 );
+		for( size_t i=0; i<num_keys; i++ ) {
+			size_t r = ((size_t)rand() << 16 ^ (size_t)rand()) % n;
+			hit_keys[i] = r * 2;
+			miss_keys[i] = r * 2 + 1;
+		}
+		for( int kind=PROBE_SCALAR; kind<=(int)best_probe(); kind++ ) {
+			probe = kind;
+			probe_params hits = { .t = &t, .keys = hit_keys, .num_keys = num_keys };
+			probe_params misses = { .t = &t, .keys = miss_keys, .num_keys = num_keys };
+			benchmark bh = run_benchmark( "probe hit", probe_benchmark, &hits );
+			benchmark bm = run_benchmark( "probe miss", probe_benchmark, &misses );
+			assert( hits.found == num_keys * bh.runs && misses.found == 0 );
+			printf("%.3f\t%s\t%.0f\t%.0f\t%.1f\n", loads[l], names[kind], num_keys / bh.average_seconds, num_keys / bm.average_seconds,
+				(double)misses.probes / (double)(num_keys * bm.runs) );
+		}
+		free_table( &t );
+	}
+	probe = saved;
+	free( hit_keys );
+	free( miss_keys );
+
+}
+
+static void run_lookup_benchmark() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	// sparse keys, so they don't just land in consecutive slots
+	for( size_t i=0; i<store->capacity; i++ ) {
+		foo* f = (foo*)malloc( sizeof(foo) );
+		f->b = i;
+		f->is_dirty = false;
+		add_item( store, f, i * 2 );
+	}
+
+	size_t num_keys = 1000 * 1000;
+	size_t* hit_keys = (size_t*) malloc( num_keys * sizeof(size_t) );
+	size_t* miss_keys = (size_t*) malloc( num_keys * sizeof(size_t) );
+	srand( 1234 );
+	for( size_t i=0; i<num_keys; i++ ) {
+		size_t r = ((size_t)rand() << 16 ^ (size_t)rand()) % store->capacity;
+		hit_keys[i] = r * 2;
+		miss_keys[i] = r * 2 + 1;
+	}
+
+	lookup_params hits = { .store = store, .keys = hit_keys, .num_keys = num_keys };
+	lookup_params misses = { .store = store, .keys = miss_keys, .num_keys = num_keys };
+	benchmark bh = run_benchmark( "hit", lookup_benchmark, &hits );
+	benchmark bm = run_benchmark( "miss", lookup_benchmark, &misses );
+	assert( hits.found == num_keys * bh.runs );
+	assert( misses.found == 0 );
+
+	lookup_params handles = { .store = store, .keys = hit_keys, .num_keys = num_keys };
+	benchmark bhh = run_benchmark( "handle hit", handle_lookup_benchmark, &handles );
+	assert( handles.found == num_keys * bhh.runs );
+
+	size_t batch_sizes[] = { 1, 8, 64, 256 };
+	size_t num_batches = sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+	double batch_ns[num_batches];
+	for( size_t b=0; b<num_batches; b++ ) {
+		lookup_params batched = { .store = store, .keys = hit_keys, .num_keys = num_keys, .batch = batch_sizes[b] };
+		benchmark bb = run_benchmark( "batched hit", batch_lookup_benchmark, &batched );
+		assert( batched.found == num_keys * bb.runs );
+		batch_ns[b] = bb.average_seconds * 1e9 / num_keys;
+	}
+
+	// unpin everything, now every hit revives an item from the free list and releases it again
+	for( size_t i=0; i<store->capacity; i++ ) {
+		release_item( store, NULL, i * 2 );
+	}
+	lookup_params revives = { .store = store, .keys = hit_keys, .num_keys = num_keys };
+	benchmark br = run_benchmark( "revive", lookup_benchmark, &revives );
+	assert( revives.found == num_keys * br.runs );
+
+	printf("items\thit lookups/s\tmiss lookups/s\trevives/s\n");
+	printf("%lu\t%.0f\t%.0f\t%.0f\n", store->capacity, num_keys / bh.average_seconds, num_keys / bm.average_seconds, num_keys / br.average_seconds );
+	printf("batch\tns per hit\n");
+	printf("single\t%.1f\n", bh.average_seconds * 1e9 / num_keys );
+	printf("handle\t%.1f\n", bhh.average_seconds * 1e9 / num_keys );
+	for( size_t b=0; b<num_batches; b++ ) {
+		printf("%lu\t%.1f\n", batch_sizes[b], batch_ns[b] );
+	}
+
+	free( hit_keys );
+	free( miss_keys );
 	clear_cache( store );
-	print_counters();
-	checks();
-	
+	free_cache( store );
+
+}
+
+static double now_ns() {
+
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+Replace every item a few times over with new ones (evicting the old), then look up random ones.
+Payloads from malloc, the slab, or the slab on huge pages. Fills in ns per add, ns per hit and
+how many chunks the slab allocated after the first.
+*/
+static void churn( int mode, double* results ) {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	if( mode ) {
+		use_foo_slab( store, mode == 2 );
+	}
+	size_t chunks = counters.foo_chunk_allocs;
+
+	size_t num_adds = 4 * store->capacity;
+	srand( 1234 );
+	double start = now_ns();
+	for( size_t key=0; key<num_adds; key++ ) {
+		foo* f = cache_alloc_item( store );
+		f->b = key;
+		f->is_dirty = false;
+		add_item( store, f, key );
+		release_item( store, f, key );
+	}
+	results[0] = (now_ns() - start) / (double)num_adds;
+
+	// whichever ones are left
+	size_t* stored = (size_t*) malloc( store->num_stored * sizeof(size_t) );
+	size_t num_stored = 0;
+	table* t = &store->tables[0];
+	for( size_t slot=0; slot<=t->slot_mask; slot++ ) {
+		if( t->control[slot] != SLOT_EMPTY ) {
+			stored[num_stored++] = t->slots[slot].key;
+		}
+	}
+
+	size_t num_gets = 1000 * 1000;
+	size_t found = 0;
+	start = now_ns();
+	for( size_t n=0; n<num_gets; n++ ) {
+		size_t key = stored[((size_t)rand() << 16 ^ (size_t)rand()) % num_stored];
+		foo* f = get_item( store, key );
+		if( f ) {
+			found += f->b == key;
+			release_item( store, f, key );
+		}
+	}
+	results[1] = (now_ns() - start) / (double)num_gets;
+	results[2] = (double)(counters.foo_chunk_allocs - chunks);
+	assert( found == num_gets );
+
+	free( stored );
+	clear_cache( store );
+	free_cache( store );
+
+}
+
+static void run_churn_benchmark() {
+
+	const char* names[3] = { "malloc", "slab", "slab, huge pages" };
+	double results[3][3];
+	for( int mode=0; mode<3; mode++ ) {
+		churn( mode, results[mode] );
+	}
+
+	printf("payloads\t\tns per add\tns per hit\textra chunks\n");
+	for( int mode=0; mode<3; mode++ ) {
+		printf("%-16s\t%.1f\t\t%.1f\t\t%.0f\n", names[mode], results[mode][0], results[mode][1], results[mode][2] );
+	}
+
+}
+
+// enough for a million items
+#define SNAPSHOT_BENCHMARK_BYTES (400*1024*1024)
+
+// a full cache to a file and back into an empty one, with the payloads from malloc or the slab
+static void snapshot_restore( bool slab, double* results ) {
+
+	cache* store = new_cache( SNAPSHOT_BENCHMARK_BYTES );
+	for( size_t key=0; key<store->capacity; key++ ) {
+		foo* f = cache_alloc_item( store );
+		f->b = key;
+		f->is_dirty = key % 4 == 0;
+		add_item( store, f, key );
+		release_item( store, f, key );
+	}
+	FILE* file = tmpfile();
+	int fd = fileno( file );
+	double start = now_ns();
+	assert( cache_snapshot( store, fd ) );
+	results[0] = (now_ns() - start) / 1e6;
+	results[2] = (double)lseek( fd, 0, SEEK_CUR ) / (double)store->num_stored;
+	results[3] = (double)store->num_stored;
+
+	cache* restored = new_cache( SNAPSHOT_BENCHMARK_BYTES );
+	if( slab ) {
+		use_foo_slab( restored, false );
+	}
+	lseek( fd, 0, SEEK_SET );
+	start = now_ns();
+	assert( cache_restore( restored, fd ) );
+	results[1] = (now_ns() - start) / 1e6;
+	assert( restored->num_stored == store->num_stored );
+	fclose( file );
+
+	clear_cache( restored );
+	free_cache( restored );
+	clear_cache( store );
+	free_cache( store );
+
+}
+
+static void run_snapshot_benchmark() {
+
+	double results[2][4];
+	// the first run pays for faulting in the heap
+	snapshot_restore( false, results[0] );
+	snapshot_restore( false, results[0] );
+	snapshot_restore( true, results[1] );
+
+	printf("%.0f items\tsnapshot ms\trestore ms\tbytes per item\n", results[0][3] );
+	printf("malloc\t\t%.0f\t\t%.0f\t\t%.1f\n", results[0][0], results[0][1], results[0][2] );
+	printf("slab\t\t%.0f\t\t%.0f\t\t%.1f\n", results[1][0], results[1][1], results[1][2] );
+
+}
+
+#define TTL_BENCHMARK_TICKS 1000
+
+/*
+Items with a ttl of TTL_BENCHMARK_TICKS, added at a steady rate so about half the cache is live
+and expiring makes all the room. Compares the wheel with what one sweep of the table per tick
+would cost, looking at every slot for an expired item.
+*/
+static void run_ttl_benchmark() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	set_ttl( store, TTL_BENCHMARK_TICKS );
+	size_t per_tick = store->capacity / 2 / TTL_BENCHMARK_TICKS;
+	size_t num_ticks = 10 * TTL_BENCHMARK_TICKS;
+	size_t key = 0;
+	double add_ns = 0, expire_ns = 0, max_tick_ns = 0;
+	for( uint64_t tick=1; tick<=num_ticks; tick++ ) {
+		double start = now_ns();
+		expire_items( store, tick, SIZE_MAX );
+		double expired = now_ns();
+		for( size_t n=0; n<per_tick; n++, key++ ) {
+			foo* f = cache_alloc_item( store );
+			f->b = key;
+			f->is_dirty = key % 4 == 0;
+			add_item( store, f, key );
+			release_item( store, f, key );
+		}
+		add_ns += now_ns() - expired;
+		expire_ns += expired - start;
+		if( expired - start > max_tick_ns ) {
+			max_tick_ns = expired - start;
+		}
+	}
+	assert( store->stats.clean_evictions + store->stats.dirty_evictions == 0 );
+
+	// what a sweeper would do instead
+	table* t = &store->tables[0];
+	size_t found = 0;
+	double start = now_ns();
+	for( size_t slot=0; slot<=t->slot_mask; slot++ ) {
+		if( t->control[slot] != SLOT_EMPTY && t->slots[slot].refcount == 0 ) {
+			found += t->slots[slot].ptr.to_free_entry->evictable_foo->expires <= store->now;
+		}
+	}
+	double scan_ns = now_ns() - start;
+	assert( found == 0 );
+
+	printf("%lu items, %lu added per tick, %lu expired\n", store->capacity, per_tick, store->stats.expirations );
+	printf("ns per add\tns per expiry\tmax us per tick\tus per table sweep\n");
+	printf("%.1f\t\t%.1f\t\t%.1f\t\t%.1f\n", add_ns / (double)key, expire_ns / (double)store->stats.expirations, max_tick_ns / 1e3, scan_ns / 1e3 );
+
+	clear_cache( store );
+	free_cache( store );
+
+}
+
+static int compare_doubles( const void* a, const void* b ) {
+
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// time every get/release while the cache grows to twice the budget, either all at once
+// or a few items per operation. Fills in p50, p99, p99.9 and max
+static void resize_latency( bool incremental, double* percentiles ) {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	for( size_t i=0; i<store->capacity; i++ ) {
+		foo* f = (foo*)malloc( sizeof(foo) );
+		f->b = i;
+		f->is_dirty = i % 4 == 0;
+		add_item( store, f, i );
+		release_item( store, f, i );
+	}
+
+	size_t num_ops = 1000 * 1000;
+	size_t resize_at = num_ops / 10;
+	double* latency = (double*) malloc( num_ops * sizeof(double) );
+	srand( 1234 );
+	for( size_t n=0; n<num_ops; n++ ) {
+		size_t key = ((size_t)rand() << 16 ^ (size_t)rand()) % store->capacity;
+		double start = now_ns();
+		if( n == resize_at ) {
+			resize_cache( store, CACHE_MEMORY_BYTES * 2 );
+			if( !incremental ) {
+				finish_rehash( store );
+			}
+		}
+		foo* f = get_item( store, key );
+		release_item( store, f, key );
+		latency[n] = now_ns() - start;
+	}
+	assert( !store->rehashing );
+
+	qsort( latency, num_ops, sizeof(double), compare_doubles );
+	percentiles[0] = latency[num_ops / 2];
+	percentiles[1] = latency[num_ops * 99 / 100];
+	percentiles[2] = latency[num_ops * 999 / 1000];
+	percentiles[3] = latency[num_ops - 1];
+
+	free( latency );
+	clear_cache( store );
+	free_cache( store );
+
+}
+
+static void run_resize_benchmark() {
+
+	double stop[4], incremental[4];
+	resize_latency( false, stop );
+	resize_latency( true, incremental );
+
+	printf("get+release latency (ns) around a resize\n");
+	printf("resize\t\tp50\tp99\tp99.9\tmax\n");
+	printf("stop the world\t%.0f\t%.0f\t%.0f\t%.0f\n", stop[0], stop[1], stop[2], stop[3] );
+	printf("incremental\t%.0f\t%.0f\t%.0f\t%.0f\n", incremental[0], incremental[1], incremental[2], incremental[3] );
+
 }
 
+#endif
+
 int main() {
 
+#ifdef BENCHMARK
+	run_lookup_benchmark();
+	run_resize_benchmark();
+	run_churn_benchmark();
+	run_snapshot_benchmark();
+	run_ttl_benchmark();
+	run_probe_benchmark();
+	return 0;
+#endif
+
 	test_evict_middle_item_in_bucket();
 
 	test_evict_first_item_in_bucket();
@@ -654,5 +3291,37 @@ int main() {
 	
 	test_dirty_items();
 	
+	test_churn();
+
+	test_steady_state_no_allocs();
+
+	test_sizing();
+
+	test_resize();
+
+	test_cleaner();
+
+	test_batch();
+
+	test_stats();
+
+	test_foo_slab( false );
+
+	test_foo_slab( true );
+
+	test_snapshot();
+
+	test_byte_budget();
+
+	test_ttl();
+
+	test_handles();
+
+	test_probes();
+
+#ifdef TRACE_RING
+	test_trace_ring();
+#endif
+
 	return 0;
 }
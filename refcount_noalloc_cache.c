@@ -2,25 +2,51 @@
 #include <stdio.h> // printf
 #include <string.h> // memset
 #include <assert.h>
+#include <stdint.h>
+#include <stddef.h> // offsetof
 #include <time.h> // time() for srand
+#include <pthread.h>
+#include <fcntl.h> // open
+#include <unistd.h> // ftruncate
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
 
 static uint64_t item_allocs = 0;
 static uint64_t item_frees = 0;
 
 typedef char bool;
 
+#ifdef BENCHMARK
+#define CACHE_MEMORY_BYTES (4*1024*1024)
+#endif
+
+// budget the tests use
+#ifndef CACHE_MEMORY_BYTES
 #define CACHE_MEMORY_BYTES 256
+#endif
+
+// tracing of the hot paths, see trace.c for the levels and the event ring
+#include "trace.c"
+
+// file format of cache_snapshot/cache_restore
+#include "snapshot.c"
+
+// writes to the bucket chains and entry keys, which the lock free paths of the sharded cache
+// read while another thread holds the shard lock
+#define PUBLISH(field, value) __atomic_store_n( &(field), (value), __ATOMIC_RELEASE )
 
-#define MEMORY_PER_ITEM (sizeof(item) + sizeof(entry) + sizeof(entry*))
-// TODO(chris): replace this by num buckets which is a power of 2
-#define CACHE_SIZE (int)(CACHE_MEMORY_BYTES/MEMORY_PER_ITEM)
+// memory per stored item, and per bucket (there are at least as many buckets as items)
+#define MEMORY_PER_ITEM (sizeof(item) + sizeof(entry))
+#define MEMORY_PER_BUCKET sizeof(uint32_t)
 
 typedef struct item {
 	int id;
 	
 	int value;
 
-	char data[7]; // filler value to make items bigger (but still 8 byte aligned)
+	int size; // bytes it stands for, what counts against the byte budget (see set_byte_budget)
+
+	char data[3]; // filler value to make items bigger (but still 8 byte aligned)
 	bool is_dirty;
 
 } item;
@@ -28,44 +54,151 @@ typedef struct item {
 static item* Item( int id, int value, bool is_dirty ) {
 
 	item* i = (item*) malloc( sizeof(item) );
-	item_allocs++;
+	__atomic_fetch_add( &item_allocs, 1, __ATOMIC_RELAXED );
 	i->id = id;
 	i->value = value;
+	i->size = (int)sizeof(item);
 	i->is_dirty = is_dirty;
 	
 	return i;
 }
 
+/*
+Links are 32 bit indices into entries[], and the bucket chains are single linked (there are at
+least as many buckets as items, so chains are short and finding the one before is cheap).
+Build with -DCOMPACT_ENTRIES to leave the key out (it's item->id) and use a 16 bit refcount,
+24 bytes per entry instead of 32. The sharded cache can't look up keys without the lock then,
+see find_entry.
+*/
+#define NO_ENTRY UINT32_MAX
+
 typedef struct entry {
 
-	// TODO: I think we can union 2 of these
-	// TODO: or even change them to entry indices? That would be great (and smaller)
-	struct entry* next_bucket_entry;
-	struct entry* prev_bucket_entry;
+	item* item;
 
-	struct entry* next_list_entry;
-	struct entry* prev_list_entry;
-	
-	int key;	
-	int refcount;	
+	uint32_t next_bucket_entry; // NO_ENTRY at the end of the chain
+	uint32_t next_list_entry;
+	uint32_t prev_list_entry;
 
-	// TODO: could compress these using union maybe?
-	// item will probably have poor alignment, but what can you do. At least at the end it won't cause padding for entries.
-	item* item;
+#ifdef COMPACT_ENTRIES
+	uint16_t refcount;
+#else
+	int key;
+	int refcount;
+#endif
+
+	bool referenced; // got a hit since it was added (or since the clock hand passed it)
+	uint8_t is_protected : 1; // on the protected lists (2Q)
+	uint8_t on_dirty_list : 1; // which list a pinned entry is on (CLOCK, see pin_available)
+#ifndef COMPACT_ENTRIES
+	uint16_t generation; // one up every time the entry gets an item (see cache_handle), fits in the padding
+#endif
 } entry;
 
+#ifdef COMPACT_ENTRIES
+#define MAX_REFCOUNT UINT16_MAX
+#else
+#define MAX_REFCOUNT INT32_MAX
+#endif
+
+/*
+Which refcount 0 entry goes when a new item needs one. Clean entries always go before dirty
+ones, the policy picks among the clean (or dirty) ones:
+ LRU: the one released the longest ago.
+ CLOCK: the list is the clock, and a hit only sets a bit, the entry keeps its place (pinned
+ ones stay on the clock too). Entries that got a hit since the hand last passed them get another round.
+ 2Q: items that never got a hit since they were added are on probation, and go first (in LRU
+ order). Items that did get one are protected, unless protected items take up more than
+ PROTECTED_PERCENT of the cache. A scan of new keys only churns through probation.
+ (the simplified 2Q, without the queue of keys that were recently evicted)
+*/
+typedef enum policy {
+	POLICY_LRU,
+	POLICY_CLOCK,
+	POLICY_2Q
+} policy;
+
+#define PROTECTED_PERCENT 75
+
+/*
+Counted as things happen, so a snapshot doesn't walk anything. Everything that changes the cache
+is serialized (one thread, or the shard lock) and counts with relaxed loads and stores, not
+atomic adds: on x86 those are full barriers and they stop batched lookups from overlapping.
+Only the lock free get of the sharded cache adds atomically, to its own counters.
+*/
+typedef struct cache_stats {
+	uint64_t hits;
+	uint64_t lock_free_hits; // the snapshot adds these to hits and probes
+	uint64_t lock_free_probes;
+	uint64_t misses;
+	uint64_t revives; // hits on an entry with refcount 0, taken off an available list
+	uint64_t clean_evictions;
+	uint64_t dirty_evictions;
+	uint64_t rejections; // add_item with every entry pinned (or the pinned bytes over the budget), so not stored
+	uint64_t not_admitted; // add_item of a key used less than the item it would evict (see ADMISSION)
+	uint64_t tier_hits; // misses that got the item back from the spill tier (see SPILL TIER)
+	uint64_t queued_hits; // misses that got the item back from the write back queue (see WRITE BACK)
+	uint64_t loads; // loader calls by sharded_get_or_load
+	uint64_t shared_loads; // get_or_loads that waited for another thread's load instead
+	uint64_t probes; // chain entries looked at by the lookups of get
+	uint64_t max_probes; // longest chain one get walked
+	// filled in by cache_stats_snapshot
+	double avg_probes;
+	uint64_t stored;
+	uint64_t pinned;
+	uint64_t bytes; // sizes of the stored items
+	uint64_t pinned_bytes;
+} cache_stats;
+
+#define STAT_ADD(c, field) __atomic_store_n( &(c)->stats.field, __atomic_load_n( &(c)->stats.field, __ATOMIC_RELAXED ) + 1, __ATOMIC_RELAXED )
+
 typedef struct cache {
 	
-	// buckets for the hash. Can't use the entries themselves since we'd have to use them as starting point for the buckets
-	entry* buckets[CACHE_SIZE];
+	// buckets for the hash, the index of the first entry in the chain. Can't use the entries themselves since we'd have to use them as starting point for the buckets
+	uint32_t* buckets;
+	int bucket_mask; // number of buckets - 1 (number of buckets is a power of 2)
 	
 	// all the entries we use
-	entry entries[CACHE_SIZE];
+	entry* entries;
+	int capacity;
 	
 	// refcount 0 ones with status=dirty or status=clean
 	// these are double linked lists for O(1) add/remove
 	entry* available_dirty_entries;
-	entry* available_clean_entries; // initially holds the unused items
+	entry* available_clean_entries;
+	int num_available_dirty;
+	int num_available_clean; // the unused entries count as clean
+	entry* unused_entries; // no item, taken before anything is evicted
+
+	// 0 means only the number of entries limits what's stored
+	size_t byte_budget;
+	size_t bytes_stored;
+	size_t bytes_available; // of the items on the available lists
+
+	policy policy;
+	// refcount 0 entries that are protected (2Q), the ones above are on probation then
+	entry* protected_dirty_entries;
+	entry* protected_clean_entries;
+	int num_protected; // including the pinned ones
+
+	// where evicted dirty items go, NULL writes them right away (see WRITE BACK)
+	struct write_back* wb;
+	// how often keys were asked for, NULL admits every new item (see ADMISSION)
+	struct frequency_sketch* admission;
+	// where evicted clean items go, NULL just frees them (see SPILL TIER)
+	struct spill_tier* tier;
+	uint64_t eviction_writes; // dirty items written because they were evicted
+	uint64_t cleaner_writes; // and ones written before that was needed (see clean_cache)
+
+	int num_stored; // entries that hold an item
+	cache_stats stats;
+
+	// set when the cache lives in a file (see IMAGE), items then come from the slots in there
+	struct image_header* image;
+	size_t image_bytes;
+	item* items;
+	uint32_t num_items;
+	uint32_t free_items; // first unused slot, linked through the first bytes of the slots
 	
 } cache;
 
@@ -79,28 +212,94 @@ static inline void free_item( item* i ) {
 	// TODO(chris): assert refcount?
 
 	if( i->is_dirty ) {
-		printf("Pretending to write dirty item to disk or something: { id = %d, value = %d }\n", i->id, i->value );		
+		TRACE_OP("Pretending to write dirty item to disk or something: { id = %d, value = %d }\n", i->id, i->value );		
 	} else {
-		printf("Freeing clean item { id = %d, value = %d }\n", i->id, i->value );
+		TRACE_OP("Freeing clean item { id = %d, value = %d }\n", i->id, i->value );
 	}
 
 	free( i );
-	item_frees++;
+	__atomic_fetch_add( &item_frees, 1, __ATOMIC_RELAXED );
+}
+
+static void write_back_item( struct write_back* wb, item* i );
+static void write_back_copy( struct write_back* wb, item* i );
+static void free_sketch( struct frequency_sketch* s );
+static void spill_item( struct spill_tier* t, item* i );
+static void tier_drop( struct spill_tier* t, int key );
+
+static inline bool in_image( cache* c, item* i ) {
+	return c->image && i >= c->items && i < c->items + c->num_items;
+}
+
+static inline void free_image_item( cache* c, item* i ) {
+
+	if( i->is_dirty ) {
+		TRACE_OP("Pretending to write dirty item to disk or something: { id = %d, value = %d }\n", i->id, i->value );
+	} else {
+		TRACE_OP("Freeing clean item { id = %d, value = %d }\n", i->id, i->value );
+	}
+	memcpy( i, &c->free_items, sizeof(uint32_t) );
+	c->free_items = (uint32_t)(i - c->items);
+}
+
+// an item leaves the cache: dirty ones go to the write back stage, which frees them once they're written
+static inline void evict_item( cache* c, item* i ) {
+
+	if( i ) {
+		TRACE_RECORD( TRACE_EVICT, i->id, i->is_dirty );
+	}
+	if( i && i->is_dirty ) {
+		c->eviction_writes++;
+		if( c->wb ) {
+			if( !in_image( c, i ) ) {
+				write_back_item( c->wb, i );
+				return;
+			}
+			// the slot is reused right away, so the write gets a copy
+			write_back_copy( c->wb, i );
+		}
+	}
+	if( in_image( c, i ) ) {
+		free_image_item( c, i );
+	} else {
+		free_item( i );
+	}
+}
+
+static inline uint32_t index_of( cache* c, entry* e ) {
+	return (uint32_t)(e - c->entries);
+}
+
+static inline entry* next_in_list( cache* c, entry* e ) {
+	return &c->entries[e->next_list_entry];
+}
+
+static inline entry* prev_in_list( cache* c, entry* e ) {
+	return &c->entries[e->prev_list_entry];
+}
+
+// only for entries that hold an item
+static inline int entry_key( entry* e ) {
+#ifdef COMPACT_ENTRIES
+	return e->item->id;
+#else
+	return e->key;
+#endif
 }
 
-static void remove_from_list( entry** list, entry* element ) {
+static void remove_from_list( cache* c, entry** list, entry* element ) {
 	
 	assert( *list );
 	assert( element );
 	
 	// last element on the list
-	if( element->next_list_entry == element ) {
+	if( element->next_list_entry == index_of( c, element ) ) {
 		*list = NULL;
 	} else {
-		element->prev_list_entry->next_list_entry = element->next_list_entry;
-		element->next_list_entry->prev_list_entry = element->prev_list_entry;
+		prev_in_list( c, element )->next_list_entry = element->next_list_entry;
+		next_in_list( c, element )->prev_list_entry = element->prev_list_entry;
 		if( *list == element ) {
-			*list = element->next_list_entry;
+			*list = next_in_list( c, element );
 		}
 	}
 	
@@ -123,122 +322,334 @@ L prev = d
 L prev next = d
 
 */
-static void insert_into_list( entry** list, entry* element ) {
+static void insert_into_list( cache* c, entry** list, entry* element ) {
 
 	// could be NULL
 	// TODO(chris): explain why, and is that a good idea?
 	assert( element );
 	assert( *list != element );
 	
+	uint32_t index = index_of( c, element );
 	if( *list == NULL ) {
-		element->next_list_entry = element;
-		element->prev_list_entry = element;
+		element->next_list_entry = index;
+		element->prev_list_entry = index;
 		*list = element;
 	} else {
-		element->next_list_entry = *list;
+		element->next_list_entry = index_of( c, *list );
 		element->prev_list_entry = (*list)->prev_list_entry;
 
 		*list = element;
 
-		(*list)->next_list_entry->prev_list_entry = element;
-		(*list)->prev_list_entry->next_list_entry = element;
+		next_in_list( c, element )->prev_list_entry = index;
+		prev_in_list( c, element )->next_list_entry = index;
 	}
 
 }
 
-static void remove_from_bucket( entry** bucket, entry* element ) {
-	
-	assert( *bucket );
-	assert( element );
-	
-	// only element in the bucket
-	if( element->next_bucket_entry == element ) {
-		*bucket = NULL;
+// refcount 0 entries go on the available list that matches their item, unused entries on their own
+static inline entry** available_list( cache* c, entry* e ) {
+
+	if( e->item == NULL ) {
+		return &c->unused_entries;
+	}
+	bool dirty = e->item->is_dirty;
+	if( e->is_protected ) {
+		return dirty ? &c->protected_dirty_entries : &c->protected_clean_entries;
+	}
+	return dirty ? &c->available_dirty_entries : &c->available_clean_entries;
+}
+
+// a hit. The lock free path of the sharded cache sets it too, hence the atomics
+static inline void mark_referenced( entry* e ) {
+
+	if( !__atomic_load_n( &e->referenced, __ATOMIC_RELAXED ) ) {
+		__atomic_store_n( &e->referenced, 1, __ATOMIC_RELAXED );
+	}
+}
+
+// n is 1 when the entry's refcount goes to 0, -1 when it leaves 0
+static inline void count_available( cache* c, entry* e, int n ) {
+
+	if( e->item && e->item->is_dirty ) {
+		c->num_available_dirty += n;
 	} else {
-		element->prev_bucket_entry->next_bucket_entry = element->next_bucket_entry;
-		element->next_bucket_entry->prev_bucket_entry = element->prev_bucket_entry;
-		
-		// if the bucket pointed at this one, move that along
-		if( *bucket == element ) {
-			*bucket = element->next_bucket_entry;
-		}
+		c->num_available_clean += n;
+	}
+	if( e->item ) {
+		c->bytes_available += (size_t)((ptrdiff_t)n * e->item->size);
 	}
-	
 }
 
-/*
-Puts [c] at the end of bucket
- bucket -> [a]<-->[b]<-->[a]..
+static void make_available( cache* c, entry* e ) {
 
- ins [c]
- [c]-> = (*b) = [a]
- <-[c] = (*b)>prev = [b]
- -><-[c] = [c] means [b]-> = [c]
- <-->[c] = [c] means <-[a] = c
+	count_available( c, e, 1 );
+	// 2Q: a hit while on probation gets it protected
+	if( c->policy == POLICY_2Q && !e->is_protected && __atomic_load_n( &e->referenced, __ATOMIC_RELAXED ) ) {
+		e->is_protected = 1;
+		__atomic_store_n( &e->referenced, 0, __ATOMIC_RELAXED );
+		c->num_protected++;
+	}
+	insert_into_list( c, available_list( c, e ), e );
+}
+
+static void make_unavailable( cache* c, entry* e ) {
+
+	count_available( c, e, -1 );
+	remove_from_list( c, available_list( c, e ), e );
+}
 
- result:
-	bucket -> [a]<-->[b]<-->[c]<-->[a]
+/*
+A refcount 0 entry gets pinned. It leaves its list, except with CLOCK: there the list is the clock
+and the entry keeps its place, the hit only sets referenced. The hand passes pinned entries like
+referenced ones. An entry gets on the clock when its item is added, pinned already.
 */
-static void insert_into_bucket( entry** b, entry* element ) {
+static void pin_available( cache* c, entry* e ) {
+
+	if( c->policy != POLICY_CLOCK ) {
+		make_unavailable( c, e );
+		return;
+	}
+	count_available( c, e, -1 );
+	e->on_dirty_list = e->item->is_dirty != 0;
+}
 
-	if( *b == NULL ) {
-		// first item in this bucket
-		*b = element;
-		element->next_bucket_entry = element;
-		element->prev_bucket_entry = element;
+// an entry that just got its item, pinned. With CLOCK it goes on the clock right away, as the newest
+static inline void start_on_clock( cache* c, entry* e ) {
 
-	} else {
-		// already has items in this bucket, insert into the doubly linked list
-		element->next_bucket_entry = *b;
-		element->prev_bucket_entry = (*b)->prev_bucket_entry;
+	if( c->policy == POLICY_CLOCK ) {
+		e->on_dirty_list = e->item->is_dirty != 0;
+		insert_into_list( c, available_list( c, e ), e );
+	}
+}
+
+// and back to refcount 0. A CLOCK entry whose item went clean or dirty meanwhile changes lists
+static void unpin_available( cache* c, entry* e ) {
+
+	if( c->policy != POLICY_CLOCK ) {
+		make_available( c, e );
+		return;
+	}
+	if( e->on_dirty_list != (e->item->is_dirty != 0) ) {
+		remove_from_list( c, e->on_dirty_list ? &c->available_dirty_entries : &c->available_clean_entries, e );
+		insert_into_list( c, available_list( c, e ), e );
+	}
+	count_available( c, e, 1 );
+}
+
+// only with an item still in the entry, the key is needed to find the bucket
+static void remove_from_bucket( cache* c, entry* element ) {
 	
-		element->prev_bucket_entry->next_bucket_entry = element;
-		element->next_bucket_entry->prev_bucket_entry = element;
+	assert( element && element->item );
+	
+	uint32_t index = index_of( c, element );
+	uint32_t* link = &c->buckets[entry_key( element ) & c->bucket_mask];
+	while( *link != index ) {
+		assert( *link != NO_ENTRY );
+		link = &c->entries[*link].next_bucket_entry;
 	}
+	PUBLISH( *link, element->next_bucket_entry );
+	
+}
+
+// puts the entry at the start of the chain (linked before it becomes visible)
+static void insert_into_bucket( cache* c, entry* element ) {
+
+	uint32_t* b = &c->buckets[entry_key( element ) & c->bucket_mask];
+	PUBLISH( element->next_bucket_entry, *b );
+	PUBLISH( *b, index_of( c, element ) );
 	
 }
 
+// the next clean (or dirty) entry to go according to the policy, NULL if there are none
+static entry* pick_victim( cache* c, bool dirty ) {
+
+	entry** probation = dirty ? &c->available_dirty_entries : &c->available_clean_entries;
+	entry** protected = dirty ? &c->protected_dirty_entries : &c->protected_clean_entries;
+
+	entry** from = probation;
+	if( *protected && (*probation == NULL || c->num_protected > c->capacity * PROTECTED_PERCENT / 100) ) {
+		from = protected;
+	}
+	if( *from == NULL ) {
+		return NULL;
+	}
+
+	if( c->policy == POLICY_CLOCK ) {
+		if( (dirty ? c->num_available_dirty : c->num_available_clean) == 0 ) {
+			return NULL;
+		}
+		// the list is the clock, the oldest entry is under the hand. Moving the hand past an
+		// entry makes it the newest, and clears the hit. Twice around and they're all pinned
+		entry* first = prev_in_list( c, *from );
+		int laps = 0;
+		for(;;) {
+			entry* e = prev_in_list( c, *from );
+			if( __atomic_load_n( &e->refcount, __ATOMIC_RELAXED ) == 0 && !__atomic_load_n( &e->referenced, __ATOMIC_RELAXED ) ) {
+				break;
+			}
+			__atomic_store_n( &e->referenced, 0, __ATOMIC_RELAXED );
+			*from = e;
+			if( prev_in_list( c, *from ) == first && ++laps == 2 ) {
+				return NULL;
+			}
+		}
+	}
+
+	// the oldest one
+	return prev_in_list( c, *from );
+}
+
+// takes a refcount 0 entry off its list and out of its bucket, and evicts its item
+static void take_entry( cache* c, entry* target ) {
+
+	make_unavailable( c, target );
+	if( target->is_protected ) {
+		target->is_protected = 0;
+		c->num_protected--;
+	}
+	// unused entries aren't in a bucket yet
+	if( target->item ) {
+		remove_from_bucket( c, target );
+		c->bytes_stored -= (size_t)target->item->size;
+		if( target->item->is_dirty ) {
+			STAT_ADD( c, dirty_evictions );
+		} else {
+			STAT_ADD( c, clean_evictions );
+			if( c->tier ) {
+				spill_item( c->tier, target->item );
+			}
+		}
+	} else {
+		c->num_stored++;
+	}
+	evict_item( c, target->item );
+}
 
-// remove and return the oldest item from the clean (preferred) or dirty entry list
+// remove and return an unused entry, or the one the policy picks, clean ones first
 static entry* get_available_entry( cache* c ) {
 	
-	entry* target = c->available_clean_entries ? c->available_clean_entries : c->available_dirty_entries;
+	entry* target = c->unused_entries ? prev_in_list( c, c->unused_entries ) : pick_victim( c, 0 );
+	if( target == NULL ) {
+		target = pick_victim( c, 1 );
+	}
 
 	// nothing available in either the clean entries or dirty entries list
 	if( target == NULL ) {
 		return NULL;
 	}
 
-	// move to the oldest one
-	target = target->prev_list_entry;
+	take_entry( c, target );
+	return target;
+}
 
-	entry** from_list = c->available_clean_entries ? &c->available_clean_entries : &c->available_dirty_entries;;
-	remove_from_list( from_list, target );
-	free_item( target->item );
+// evicts the item of a refcount 0 entry, which is unused after that
+static void evict_entry( cache* c, entry* e ) {
 
-	return target;
+	take_entry( c, e );
+	e->item = NULL;
+	c->num_stored--;
+	make_available( c, e );
 }
 
+/*
+Evicts refcount 0 items, clean ones first and in the order of the policy, until size more bytes
+fit in the byte budget. Every eviction is O(1). false, without evicting anything, when the pinned
+items alone leave no room for it.
+*/
+static bool make_room( cache* c, size_t size ) {
 
-static cache* new_cache() {
-	
-	cache* c = (cache*) malloc( sizeof(cache) );
-	assert( c );
-	
-	printf("num buckets: %d\n", CACHE_SIZE );
-	memset( c->buckets, 0, sizeof(c->buckets) );
+	if( c->byte_budget == 0 ) {
+		return 1;
+	}
+	size_t pinned_bytes = c->bytes_stored - c->bytes_available;
+	if( pinned_bytes + size > c->byte_budget ) {
+		TRACE_EVENT("Pinned items take %lu of %lu bytes, no room for %lu more\n", pinned_bytes, c->byte_budget, size );
+		return 0;
+	}
+	while( c->bytes_stored + size > c->byte_budget ) {
+		// there are enough bytes on the available lists
+		entry* victim = pick_victim( c, 0 );
+		if( victim == NULL ) {
+			victim = pick_victim( c, 1 );
+		}
+		evict_entry( c, victim );
+	}
+	return 1;
+}
+
+
+// pick the number of buckets (a power of 2) that leaves room for the most items,
+// but no more items than buckets
+static void size_cache( size_t memory_budget, size_t* num_items, size_t* num_bucket_heads ) {
+
+	size_t capacity = 0, num_buckets = 1;
+	for( size_t buckets = 1; buckets * MEMORY_PER_BUCKET <= memory_budget; buckets *= 2 ) {
+		size_t fits = (memory_budget - buckets * MEMORY_PER_BUCKET) / MEMORY_PER_ITEM;
+		if( fits > buckets ) {
+			fits = buckets;
+		}
+		if( fits > capacity ) {
+			capacity = fits;
+			num_buckets = buckets;
+		}
+	}
+	assert( capacity > 0 && capacity <= INT32_MAX );
+	*num_items = capacity;
+	*num_bucket_heads = num_buckets;
+}
+
+// the fields, the buckets have to be empty already and nothing is on the lists yet
+static void init_cache( cache* c, uint32_t* buckets, size_t num_buckets, entry* entries, size_t capacity ) {
+
+	TRACE_EVENT("num buckets: %lu, capacity: %lu\n", num_buckets, capacity );
+	c->buckets = buckets;
+	c->bucket_mask = (int)num_buckets - 1;
+	c->entries = entries;
+	c->capacity = (int)capacity;
 
-	// clear entries so we never have ones that accidentally have the dirty flag set
-	memset( c->entries, 0, sizeof(c->entries) );
-	
 	c->available_clean_entries = NULL;
 	c->available_dirty_entries = NULL;
-	
+	c->num_available_clean = 0;
+	c->num_available_dirty = 0;
+	c->unused_entries = NULL;
+	c->byte_budget = 0;
+	c->bytes_stored = 0;
+	c->bytes_available = 0;
+	c->policy = POLICY_LRU;
+	c->protected_clean_entries = NULL;
+	c->protected_dirty_entries = NULL;
+	c->num_protected = 0;
+	c->wb = NULL;
+	c->admission = NULL;
+	c->tier = NULL;
+	c->eviction_writes = 0;
+	c->cleaner_writes = 0;
+	c->num_stored = 0;
+	memset( &c->stats, 0, sizeof(cache_stats) );
+	c->image = NULL;
+	c->image_bytes = 0;
+	c->items = NULL;
+	c->num_items = 0;
+	c->free_items = NO_ENTRY;
+}
+
+static cache* new_cache( size_t memory_budget ) {
+
+	size_t capacity, num_buckets;
+	size_cache( memory_budget, &capacity, &num_buckets );
+
+	cache* c = (cache*) malloc( sizeof(cache) );
+	uint32_t* buckets = (uint32_t*) malloc( num_buckets * sizeof(uint32_t) );
+	// clear entries so we never have ones that accidentally have the dirty flag set
+	entry* entries = (entry*) calloc( capacity, sizeof(entry) );
+	assert( c && buckets && entries );
+	memset( buckets, 0xff, num_buckets * sizeof(uint32_t) ); // all NO_ENTRY
+
+	init_cache( c, buckets, num_buckets, entries, capacity );
 	// setup the unused list
-	for( int i=0; i<CACHE_SIZE; i++ ) {
-		insert_into_list( &c->available_clean_entries, &c->entries[i] );
+	for( int i=0; i<c->capacity; i++ ) {
+		make_available( c, &c->entries[i] );
 	}
-	
 	return c;
 }
 
@@ -246,34 +657,59 @@ static cache* new_cache() {
 
 static void flush_cache( cache* c ) {
 
-	printf("Flushing all items\n");
+	TRACE_EVENT("Flushing all items\n");
 
-	for( int i=0; i < CACHE_SIZE; i++ ) {
+	for( int i=0; i < c->capacity; i++ ) {
 
 		if( c->entries[i].item ) {
 			if( c->entries[i].refcount > 0 ) {
-				fprintf( stderr, "Warning: freeing item %d with refcount %d\n", c->entries[i].key, c->entries[i].refcount );
+				fprintf( stderr, "Warning: freeing item %d with refcount %d\n", entry_key( &c->entries[i] ), c->entries[i].refcount );
 			}
-			free_item( c->entries[i].item );
+			evict_item( c, c->entries[i].item );
 		}
 	}
 
-	memset( c->buckets, 0, sizeof(c->buckets) );
+	memset( c->buckets, 0xff, (size_t)(c->bucket_mask + 1) * sizeof(uint32_t) ); // all NO_ENTRY
 
 	// clear entries so we never have ones that accidentally have the dirty flag set
-	memset( c->entries, 0, sizeof(c->entries) );
+	memset( c->entries, 0, (size_t)c->capacity * sizeof(entry) );
 	
 	c->available_clean_entries = NULL;
 	c->available_dirty_entries = NULL;
+	c->num_available_clean = 0;
+	c->num_available_dirty = 0;
+	c->unused_entries = NULL;
+	c->bytes_stored = 0;
+	c->bytes_available = 0;
+	c->protected_clean_entries = NULL;
+	c->protected_dirty_entries = NULL;
+	c->num_protected = 0;
+	c->num_stored = 0;
 
 	// no you could reuse the thing if you wanted to. (though I don't see the use case for that)
 }
 
+static void free_cache( cache* c ) {
+
+	if( c->image ) {
+		// everything is in the file, see IMAGE
+		msync( c->image, c->image_bytes, MS_SYNC );
+		munmap( c->image, c->image_bytes );
+		free_sketch( c->admission );
+		free( c );
+		return;
+	}
+	free( c->buckets );
+	free( c->entries );
+	free_sketch( c->admission );
+	free( c );
+}
+
 static void print_entry( cache* c, entry* e ) {
 	if( e->item == NULL ) {
-		printf("\tkey %d, refcount %d (no item) [entry %ld]\n", e->key, e->refcount, e - &c->entries[0] );				
+		printf("\trefcount %d (no item) [entry %ld]\n", e->refcount, e - &c->entries[0] );				
 	} else {
-		printf("\tkey %d, refcount %d, item { id = %d, value = %d, dirty = %s } [entry %ld]\n", e->key, e->refcount, e->item->id, e->item->value, e->item->is_dirty ? "true" : "false", e - &c->entries[0] );				
+		printf("\tkey %d, refcount %d, item { id = %d, value = %d, dirty = %s } [entry %ld]\n", entry_key( e ), e->refcount, e->item->id, e->item->value, e->item->is_dirty ? "true" : "false", e - &c->entries[0] );				
 	}
 	
 }
@@ -286,7 +722,7 @@ static void dump_list( cache* c, const char* title, entry* head ) {
 	if( (current = head) ) {
 		do {
 			print_entry( c, current );
-			current = current->next_list_entry;
+			current = next_in_list( c, current );
 		} while( current != head && sentinel++ < 50 );		
 	}
 	
@@ -296,248 +732,4264 @@ static void dump( cache* c ) {
 	
 	printf("###############################\n");
 
-	printf("Cache (size %d)\nBuckets start %p\n", CACHE_SIZE, c->buckets);
-	for(int i=0; i<CACHE_SIZE; i++) {
+	printf("Cache (size %d)\nBuckets start %p\n", c->capacity, c->buckets);
+	for(int i=0; i<=c->bucket_mask; i++) {
 		printf( "Bucket[%d]\n", i );
-		entry* current;
 		int sentinel = 0;
-		if( (current = c->buckets[i]) ) {
-			do {
-				print_entry( c, current );
-				current = current->next_bucket_entry;
-			} while( current != c->buckets[i] && sentinel++ < 20 );		
+		for( uint32_t current = c->buckets[i]; current != NO_ENTRY && sentinel++ < 20; current = c->entries[current].next_bucket_entry ) {
+			print_entry( c, &c->entries[current] );
 		}
 	}
 	
+	dump_list( c, "Unused entries", c->unused_entries );
 	dump_list( c, "Available clean entries", c->available_clean_entries );
 	dump_list( c, "Available dirty entries", c->available_dirty_entries );
+	if( c->policy == POLICY_2Q ) {
+		dump_list( c, "Protected clean entries", c->protected_clean_entries );
+		dump_list( c, "Protected dirty entries", c->protected_dirty_entries );
+	}
 
 	printf("###############################\n\n");
 	
 }
 
-static item* get_item( cache* c, int key ) {
-	
-	// TODO(chris): Maybe enforce power of 2 size cache, that would also mean no mod (which is expensive)
-	int b = key % CACHE_SIZE; // works if IDs are autoinc keys I think, and avoids hashing
+/*
+Lookups are safe without a lock (the sharded cache does that, see SHARDED) except with
+COMPACT_ENTRIES, where the key is in the item and the item of an entry that is recycled
+can be freed while it's being compared.
+*/
+static inline int load_key( entry* e ) {
+#ifdef COMPACT_ENTRIES
+	return __atomic_load_n( &e->item, __ATOMIC_ACQUIRE )->id;
+#else
+	return __atomic_load_n( &e->key, __ATOMIC_ACQUIRE );
+#endif
+}
 
-	entry* current;
-	if( (current = c->buckets[b]) ) {
-		do {
-			if( current->key == key ) {
-				printf("Found item in cache\n");
-				// remove it from the available list if it was on there
-				if( current->refcount == 0 ) {
-					entry** from_list = current->item->is_dirty ? &c->available_dirty_entries : &c->available_clean_entries;
-					remove_from_list( from_list, current );
-				}
-				current->refcount++;
-				return current->item;
-			}
-			current = current->next_bucket_entry;
-		} while( current != c->buckets[b] );
+// probes is set to the number of chain entries it looked at
+static entry* find_entry_probes( cache* c, int key, uint64_t* probes ) {
+
+	int b = key & c->bucket_mask; // works if IDs are autoinc keys I think, and avoids hashing
+	uint32_t current = __atomic_load_n( &c->buckets[b], __ATOMIC_ACQUIRE );
+	int steps;
+	for( steps=0; current != NO_ENTRY && steps < c->capacity; steps++ ) {
+		entry* e = &c->entries[current];
+		if( load_key( e ) == key ) {
+			*probes = (uint64_t)steps + 1;
+			return e;
+		}
+		current = __atomic_load_n( &e->next_bucket_entry, __ATOMIC_ACQUIRE );
 	}
-		
+
+	*probes = (uint64_t)steps;
 	return NULL;
 }
 
-static void release_item( cache* c, item* i ) {
+static entry* find_entry( cache* c, int key ) {
 
-	printf("Releasing item %d\n", i->id );
-	assert( i );
+	uint64_t probes;
+	return find_entry_probes( c, key, &probes );
+}
 
-	int b = i->id % CACHE_SIZE; // works if IDs are autoinc keys I think, and avoids hashing
+// a get found e (or not, when it's NULL) after looking at probes entries
+static inline void count_lookup( cache* c, entry* e, uint64_t probes, bool lock_free ) {
 
-	if( c->buckets[b] == NULL ) {
-		printf("Item not in cache, freeing\n");
-		free_item( i );
-		return;
-	}
-	
-	entry* current = c->buckets[b];
-	do {
-		if( current->key == i->id ) { // TODO(performance): yeah, so why not lookup the id from current? would also save space..
-			printf("Found item in cache bucket %d\n", b);
-			assert( current->refcount > 0 );
-			current->refcount--;
-			if( current->refcount == 0 ) {
-				// leave it in the bucket so it can be revived later (aka, this is what caches should do ;)
-				entry** available_list = i->is_dirty ? &c->available_dirty_entries : &c->available_clean_entries;
-				insert_into_list( available_list, current );				
-			}
-			return;
+	if( lock_free ) {
+		__atomic_fetch_add( &c->stats.lock_free_hits, 1, __ATOMIC_RELAXED );
+		__atomic_fetch_add( &c->stats.lock_free_probes, probes, __ATOMIC_RELAXED );
+	} else {
+		if( e ) {
+			STAT_ADD( c, hits );
+		} else {
+			STAT_ADD( c, misses );
 		}
-		current = current->next_bucket_entry;
-	} while( current != c->buckets[b] );
-	
-	printf("Item not in cache, freeing.\n");
-	free_item( i );
-	
+		__atomic_store_n( &c->stats.probes, __atomic_load_n( &c->stats.probes, __ATOMIC_RELAXED ) + probes, __ATOMIC_RELAXED );
+	}
+	// no CAS loop, a racing lock free get with a longer chain wins next time
+	if( probes > __atomic_load_n( &c->stats.max_probes, __ATOMIC_RELAXED ) ) {
+		__atomic_store_n( &c->stats.max_probes, probes, __ATOMIC_RELAXED );
+	}
+
 }
 
-static inline void set_entry( entry* e, item* i ) {
+// compare the item, not just the key: when the cache was full a caller can hold an item
+// that never made it in, while another item with the same id did
+static entry* find_item_entry( cache* c, item* i ) {
 
-	e->item = i;
-	e->key = i->id;
-	e->refcount = 1;
+	int b = i->id & c->bucket_mask;
+	uint32_t current = __atomic_load_n( &c->buckets[b], __ATOMIC_ACQUIRE );
+	for( int steps=0; current != NO_ENTRY && steps < c->capacity; steps++ ) {
+		entry* e = &c->entries[current];
+		if( __atomic_load_n( &e->item, __ATOMIC_ACQUIRE ) == i ) {
+			return e;
+		}
+		current = __atomic_load_n( &e->next_bucket_entry, __ATOMIC_ACQUIRE );
+	}
 
+	return NULL;
 }
 
-static void add_item( cache* c, item* i ) {
-	
-	int b = i->id % CACHE_SIZE; // works if IDs are autoinc keys I think, and avoids hashing
-	printf("Want to insert { id = %d, value = %d, is_dirty = %s } into bucket %d\n", i->id, i->value, i->is_dirty ? "true" : "false", b);
-
-	// get an available entry
-	entry* available_entry = get_available_entry( c );
-	
-	if( available_entry ) {
-		
-		printf("Recycled an available item (%d)\n", available_entry->item == NULL ? -1 : available_entry->item->id );
-		int old_bucket = available_entry->key % CACHE_SIZE;
-		printf("Old item was in bucket %d\n", old_bucket);
-		// check there was an old item (and not one tak)
-		if( available_entry->item &&	c->buckets[old_bucket] ) {
-			remove_from_bucket( &c->buckets[old_bucket], available_entry );
-		}
-		set_entry( available_entry, i );
-		insert_into_bucket( &c->buckets[b], available_entry );
+static item* pin_entry( cache* c, entry* current ) {
 
+	TRACE_OP("Found item in cache\n");
+	// remove it from the available list if it was on there
+	if( current->refcount == 0 ) {
+		pin_available( c, current );
+		STAT_ADD( c, revives );
 	}
-	 else {
-		printf("Cache full, not storing item %d\n", i->id );
-	}
-	
+	assert( current->refcount < MAX_REFCOUNT );
+	current->refcount++;
+	current->referenced = 1;
+	TRACE_RECORD( TRACE_HIT, entry_key( current ), current->refcount );
+	return current->item;
 }
 
-/********************** TESTS *****************************/
+static void unpin_entry( cache* c, entry* current ) {
 
-static void test_empty() {
-	
-	printf("************** Test new/flush/free ****************\n");
-	cache* store = new_cache();
-	dump( store );
-	
-	// ensure all the unused entries are pushed: order must be CACHE_SIZE, CACHE_SIZE-1, .., 1, 0
-	entry* current = store->available_clean_entries;
-	for(int i=CACHE_SIZE-1; i>=0; i--) {
-		assert( current - &store->entries[0] == i );
-		current = current->next_list_entry;
+	assert( current->refcount > 0 );
+	current->refcount--;
+	TRACE_RECORD( TRACE_RELEASE, entry_key( current ), current->refcount );
+	if( current->refcount == 0 ) {
+		// leave it in the bucket so it can be revived later (aka, this is what caches should do ;)
+		unpin_available( c, current );
 	}
-	
-	flush_cache( store );
-	free(store);	
+
 }
 
-static void test_add_release() {
-	
-	printf("************** Test adding/releasing items (so should recycle items) ****************\n");
-	cache* store = new_cache();
-	for(int i=0; i<CACHE_SIZE * 2; i++) {
+/*
+What get_handle pinned: the item and the entry it's in, so release_handle goes straight to the
+entry instead of looking the item up again (entries never move). The generation tells a stale
+handle, released already and its entry recycled since, from a good one. With COMPACT_ENTRIES
+there's no room for a generation, the item pointer has to do, which misses a stale handle
+whose entry got a new item at the same address. A handle released twice while someone else
+still pins the item can't be told apart either way.
+*/
+typedef struct cache_handle {
+	item* item; // NULL when the get missed
+	uint32_t entry;
+	uint16_t generation;
+	uint16_t shard; // for sharded_release_handle
+} cache_handle;
 
-		item* foo = Item( i, rand() % 256, rand() % 2 == 0 );
-		add_item( store, foo );
-		printf("After insert\n");
-		dump( store );
-		release_item( store, foo );
-		printf("After release\n");
-		dump( store );
-	}
-	
-	dump( store );
-	flush_cache( store );
-	
-	free(store);	
+static inline cache_handle handle_of( cache* c, entry* e ) {
+
+	cache_handle h = { .item = e->item, .entry = index_of( c, e ), .generation = 0, .shard = 0 };
+#ifndef COMPACT_ENTRIES
+	h.generation = __atomic_load_n( &e->generation, __ATOMIC_RELAXED );
+#endif
+	return h;
 }
 
-static void test_revive() {
-	
-	printf("************** Test adding/releasing/getting items (so should revive items) ****************\n");
-	cache* store = new_cache();
+// still the pin it was made for (as far as the entry can tell)
+static inline bool handle_valid( entry* e, cache_handle h ) {
 
-	item* foos[CACHE_SIZE];
-	for(int i=0; i<CACHE_SIZE; i++) {
-		foos[i] = Item( i, rand() % 256, rand() % 2 == 0 );
-		add_item( store, foos[i] );
-		release_item( store, foos[i] );
+#ifndef COMPACT_ENTRIES
+	if( __atomic_load_n( &e->generation, __ATOMIC_RELAXED ) != h.generation ) {
+		return 0;
 	}
-	printf("After filling the cache\n");
-	dump( store );
-	for(int i=0; i<CACHE_SIZE; i++) {
-		printf("Reviving item %d\n", i);
-		item* f = get_item( store, foos[i]->id );
-		assert( f );
-		assert( f == foos[i] );
+#endif
+	return __atomic_load_n( &e->item, __ATOMIC_ACQUIRE ) == h.item && __atomic_load_n( &e->refcount, __ATOMIC_RELAXED ) > 0;
+}
+
+static void record_access( cache* c, int key );
+static bool admit( cache* c, int key, size_t size );
+static entry* fill_from_tier( cache* c, int key );
+static entry* fill_from_write_back( cache* c, int key );
+
+static cache_handle get_handle( cache* c, int key ) {
+
+	record_access( c, key );
+	uint64_t probes;
+	entry* current = find_entry_probes( c, key, &probes );
+	count_lookup( c, current, probes, 0 );
+	if( current == NULL ) {
+		// pinned already if it's there
+		current = c->wb ? fill_from_write_back( c, key ) : NULL;
+		if( current == NULL && c->tier ) {
+			current = fill_from_tier( c, key );
+		}
+		if( current == NULL ) {
+			TRACE_RECORD( TRACE_MISS, key, 0 );
+			return (cache_handle){ .item = NULL };
+		}
+		return handle_of( c, current );
 	}
-	dump( store );
+	pin_entry( c, current );
+	return handle_of( c, current );
+}
 
-	flush_cache( store );	
-	free(store);	
+static item* get_item( cache* c, int key ) {
+	return get_handle( c, key ).item;
 }
 
-// to keep track of unreleased items
-typedef struct item_list {
+static void release_item( cache* c, item* i ) {
+
+	assert( i );
+	TRACE_OP("Releasing item %d\n", i->id );
+
+	entry* current = find_item_entry( c, i );
+	if( current == NULL ) {
+		TRACE_OP("Item not in cache, freeing.\n");
+		evict_item( c, i );
+		return;
+	}
+	unpin_entry( c, current );
+	
+}
+
+// release_item without the lookup. false for a stale handle, which is left alone
+static bool release_handle( cache* c, cache_handle h ) {
+
+	assert( h.item && h.entry < (uint32_t)c->capacity );
+	entry* e = &c->entries[h.entry];
+	if( !handle_valid( e, h ) ) {
+		TRACE_EVENT("Stale handle for entry %u\n", h.entry );
+		return 0;
+	}
+	unpin_entry( c, e );
+	return 1;
+}
+
+/*
+Batched get and release. One at a time every lookup waits on a bucket and then an entry that
+aren't in cache, here a group of BATCH_GROUP keys first prefetches all the buckets, then the first
+entry of every chain, and only then walks the chains, so the misses overlap.
+*/
+#define BATCH_GROUP 32
+
+static inline void prefetch_chains( cache* c, const int* keys, int n ) {
+
+	for( int k=0; k<n; k++ ) {
+		__builtin_prefetch( &c->buckets[keys[k] & c->bucket_mask] );
+	}
+	for( int k=0; k<n; k++ ) {
+		uint32_t head = c->buckets[keys[k] & c->bucket_mask];
+		if( head != NO_ENTRY ) {
+			__builtin_prefetch( &c->entries[head] );
+		}
+	}
+
+}
+
+// out[k] is NULL when keys[k] is not in the cache
+static void get_items( cache* c, const int* keys, int n, item** out ) {
+
+	TRACE_OP("Getting %d items\n", n);
+	for( int start=0; start<n; start+=BATCH_GROUP ) {
+		int end = start + BATCH_GROUP < n ? start + BATCH_GROUP : n;
+		prefetch_chains( c, keys + start, end - start );
+		for( int k=start; k<end; k++ ) {
+			record_access( c, keys[k] );
+			uint64_t probes;
+			entry* e = find_entry_probes( c, keys[k], &probes );
+			count_lookup( c, e, probes, 0 );
+			if( e ) {
+				out[k] = pin_entry( c, e );
+				continue;
+			}
+			e = c->wb ? fill_from_write_back( c, keys[k] ) : NULL;
+			if( e == NULL && c->tier ) {
+				e = fill_from_tier( c, keys[k] );
+			}
+			out[k] = e ? e->item : NULL;
+			if( e == NULL ) {
+				TRACE_RECORD( TRACE_MISS, keys[k], 0 );
+			}
+		}
+	}
+
+}
+
+// NULL items are skipped, so the output of get_items can be passed straight back
+static void release_items( cache* c, item** items, int n ) {
+
+	TRACE_OP("Releasing %d items\n", n);
+	int ids[BATCH_GROUP];
+	for( int start=0; start<n; start+=BATCH_GROUP ) {
+		int end = start + BATCH_GROUP < n ? start + BATCH_GROUP : n;
+		int m = 0;
+		for( int k=start; k<end; k++ ) {
+			if( items[k] ) {
+				ids[m++] = items[k]->id;
+			}
+		}
+		prefetch_chains( c, ids, m );
+		for( int k=start; k<end; k++ ) {
+			if( items[k] ) {
+				release_item( c, items[k] );
+			}
+		}
+	}
+
+}
+
+static inline void set_entry( entry* e, item* i ) {
+
+	__atomic_store_n( &e->referenced, 0, __ATOMIC_RELAXED );
+	PUBLISH( e->item, i );
+#ifndef COMPACT_ENTRIES
+	PUBLISH( e->key, i->id );
+	__atomic_store_n( &e->generation, (uint16_t)(e->generation + 1), __ATOMIC_RELAXED );
+#endif
+	PUBLISH( e->refcount, 1 );
+
+}
+
+// false if it's not stored: every entry is pinned, or the pinned items leave no room in the byte budget
+static bool add_item( cache* c, item* i ) {
+	
+	TRACE_OP("Want to insert { id = %d, value = %d, is_dirty = %s } into bucket %d\n", i->id, i->value, i->is_dirty ? "true" : "false", i->id & c->bucket_mask);
+	// whatever the tier has for the key is older
+	if( c->tier ) {
+		tier_drop( c->tier, i->id );
+	}
+	if( !admit( c, i->id, (size_t)i->size ) ) {
+		return 0;
+	}
+
+	// get an available entry (it's out of its old bucket, and the old item is gone)
+	entry* available_entry = make_room( c, (size_t)i->size ) ? get_available_entry( c ) : NULL;
+	
+	if( available_entry ) {
+		
+		TRACE_STEP("Recycled available entry %u\n", index_of( c, available_entry ) );
+		set_entry( available_entry, i );
+		insert_into_bucket( c, available_entry );
+		start_on_clock( c, available_entry );
+		c->bytes_stored += (size_t)i->size;
+		TRACE_RECORD( TRACE_ADD, i->id, index_of( c, available_entry ) );
+
+	}
+	 else {
+		TRACE_EVENT("Cache full, not storing item %d\n", i->id );
+		TRACE_RECORD( TRACE_FULL, i->id, i->size );
+		STAT_ADD( c, rejections );
+	}
+	return available_entry != NULL;
+	
+}
+
+/*
+Limits the stored items by their sizes as well, so with items of very different sizes the
+entries only need to be enough for the most items that fit. add_item evicts as many items as
+it needs for the new one. Only on an empty cache.
+*/
+static void set_byte_budget( cache* c, size_t bytes ) {
+
+	assert( c->num_stored == 0 );
+	c->byte_budget = bytes;
+}
+
+// the counters so far and what follows from the list counts. For a shard, hold its lock
+static cache_stats cache_stats_snapshot( cache* c ) {
+
+	cache_stats s;
+	uint64_t* from = (uint64_t*)&c->stats;
+	uint64_t* to = (uint64_t*)&s;
+	for( size_t n=0; n < offsetof(cache_stats, avg_probes) / sizeof(uint64_t); n++ ) {
+		to[n] = __atomic_load_n( &from[n], __ATOMIC_RELAXED );
+	}
+	s.hits += s.lock_free_hits;
+	s.probes += s.lock_free_probes;
+	s.avg_probes = s.hits + s.misses ? (double)s.probes / (double)(s.hits + s.misses) : 0;
+	s.stored = (uint64_t)c->num_stored;
+	// unused entries are on the available lists too
+	s.pinned = (uint64_t)(c->capacity - c->num_available_clean - c->num_available_dirty);
+	s.bytes = (uint64_t)c->bytes_stored;
+	s.pinned_bytes = (uint64_t)(c->bytes_stored - c->bytes_available);
+	return s;
+}
+
+static void print_stats( cache_stats* s ) {
+
+	printf("hits %lu, misses %lu, revives %lu\n", s->hits, s->misses, s->revives );
+	printf("evictions %lu clean, %lu dirty, %lu not stored (full), %lu not admitted\n", s->clean_evictions, s->dirty_evictions, s->rejections, s->not_admitted );
+	printf("misses found in the spill tier %lu, in the write back queue %lu\n", s->tier_hits, s->queued_hits );
+	printf("chain entries per get %.2f (max %lu), %lu stored, %lu pinned\n", s->avg_probes, s->max_probes, s->stored, s->pinned );
+	printf("%lu bytes stored, %lu pinned\n", s->bytes, s->pinned_bytes );
+	printf("loads %lu, waited for another thread's load %lu\n", s->loads, s->shared_loads );
+
+}
+
+/********************** WRITE BACK *****************************/
+
+/*
+Evicting a dirty item means writing it somewhere first. Instead of doing that on the thread
+that is adding an item, the item goes into a bounded queue and a flusher thread writes whatever
+is queued in one go. The entry is recycled right away, the item is freed once it's written.
+Until then the store still has the older value, so a miss on a key that's queued takes the queued
+item back into the cache (see fill_from_write_back) instead of letting the caller load the old one.
+
+The flusher is only woken once WRITE_BACK_WAKE records are queued, and then writes until the queue
+is empty: waking it for every item puts a thread switch into every few adds when it has to share
+the CPU. A full queue makes add_item write the oldest batch itself (back pressure), or wait for the
+flusher to finish that one, that's the only time it blocks.
+
+A record only leaves the queue once its write worked. A failed write is counted in errors and
+tried again later, the items stay around until then. If that never works, free_write_back gives
+up on what's left after WRITE_BACK_RETRIES tries and counts it in items_lost.
+
+The backing store is just a file of { id, value } records. Records are appended in the order
+they are queued, so an item that was written twice is in there twice, and the last one wins
+(that's also what happens to the part of a batch that made it before the write failed).
+Call drain_write_back before reading it.
+*/
+
+#define WRITE_BACK_QUEUE 1024
+#define WRITE_BACK_BATCH 64
+#define WRITE_BACK_WAKE (WRITE_BACK_QUEUE / 2)
+#define WRITE_BACK_RETRIES 10
+#define WRITE_BACK_RETRY_MS 1
+
+typedef struct record {
+	int id;
+	int value;
+} record;
+
+// a record to write, and the evicted item to free after that (NULL if it stays in the cache)
+typedef struct pending_write {
+	record r;
+	int size; // of the item, for making it again from the record
+	item* i;
+} pending_write;
+
+typedef struct write_back {
+	FILE* store; // the stand-in for the disk
+	bool async; // 0 writes every item on the calling thread, like before
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_cond_t idle;
+
+	// ring buffer of writes that aren't in the store yet, the oldest batch can be being written
+	pending_write queue[WRITE_BACK_QUEUE];
+	int head;
+	int count;
+	bool writing; // someone writes the oldest batch right now
+	int drains; // drain_write_back calls waiting, the flusher doesn't wait for WRITE_BACK_WAKE then
+	bool stop;
+	pthread_t flusher;
+
+	uint64_t items_written;
+	uint64_t batches_written;
+	uint64_t stalls; // adds that had to wait for a full queue
+	uint64_t errors; // batches that failed to write, they stay queued
+	uint64_t items_lost; // still not written when free_write_back gave up
+} write_back;
+
+/*
+Writes the oldest batch in the queue, with wb->lock held (it's let go for the write). false if the
+write failed, the records are still queued then. Only one batch is written at a time, in queue order.
+*/
+static bool write_queued( write_back* wb ) {
+
+	while( wb->writing ) {
+		pthread_cond_wait( &wb->idle, &wb->lock );
+	}
+	if( wb->count == 0 ) {
+		return 1;
+	}
+
+	int n = wb->count < WRITE_BACK_BATCH ? wb->count : WRITE_BACK_BATCH;
+	record records[WRITE_BACK_BATCH];
+	for( int w=0; w<n; w++ ) {
+		records[w] = wb->queue[(wb->head + w) % WRITE_BACK_QUEUE].r;
+	}
+	FILE* store = wb->store;
+	wb->writing = 1;
+	pthread_mutex_unlock( &wb->lock );
+
+	bool written = fwrite( records, sizeof(record), (size_t)n, store ) == (size_t)n;
+	written = fflush( store ) == 0 && written;
+	if( !written ) {
+		clearerr( store );
+	}
+
+	pthread_mutex_lock( &wb->lock );
+	wb->writing = 0;
+	if( written ) {
+		for( int w=0; w<n; w++ ) {
+			pending_write* p = &wb->queue[wb->head];
+			TRACE_OP("Wrote dirty item { id = %d, value = %d }\n", p->r.id, p->r.value );
+			TRACE_RECORD( TRACE_WRITE, p->r.id, 0 );
+			free_item( p->i );
+			wb->head = (wb->head + 1) % WRITE_BACK_QUEUE;
+			wb->count--;
+		}
+		wb->items_written += (uint64_t)n;
+		wb->batches_written++;
+		pthread_cond_broadcast( &wb->not_full );
+	} else {
+		TRACE_EVENT("Writing %d records failed, they stay queued\n", n );
+		wb->errors++;
+	}
+	pthread_cond_broadcast( &wb->idle );
+
+	return written;
+}
+
+// after a failed write, with wb->lock held
+static void wait_to_retry( write_back* wb ) {
+
+	struct timespec until;
+	clock_gettime( CLOCK_REALTIME, &until );
+	until.tv_nsec += WRITE_BACK_RETRY_MS * 1000 * 1000;
+	if( until.tv_nsec >= 1000 * 1000 * 1000 ) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000 * 1000 * 1000;
+	}
+	pthread_cond_timedwait( &wb->not_empty, &wb->lock, &until );
+}
+
+// everything that's queued, but only WRITE_BACK_RETRIES tries. What's left is freed unwritten, with wb->lock held
+static void write_all_or_give_up( write_back* wb ) {
+
+	for( int tries=0; wb->count > 0 && tries < WRITE_BACK_RETRIES; ) {
+		if( !write_queued( wb ) ) {
+			tries++;
+			wait_to_retry( wb );
+		}
+	}
+	if( wb->count > 0 ) {
+		TRACE_EVENT("Giving up on %d records that couldn't be written\n", wb->count );
+	}
+	while( wb->count > 0 ) {
+		free_item( wb->queue[wb->head].i );
+		wb->head = (wb->head + 1) % WRITE_BACK_QUEUE;
+		wb->count--;
+		wb->items_lost++;
+	}
+}
+
+static void* flusher( void* params ) {
+
+	write_back* wb = (write_back*) params;
+
+	pthread_mutex_lock( &wb->lock );
+	for(;;) {
+		while( wb->count < WRITE_BACK_WAKE && !(wb->count > 0 && wb->drains > 0) && !wb->stop ) {
+			pthread_cond_wait( &wb->not_empty, &wb->lock );
+		}
+		// only stops once everything is written
+		if( wb->stop ) {
+			write_all_or_give_up( wb );
+			break;
+		}
+		while( wb->count > 0 && !wb->stop ) {
+			if( !write_queued( wb ) ) {
+				wait_to_retry( wb );
+			}
+		}
+	}
+	pthread_mutex_unlock( &wb->lock );
+
+	return NULL;
+}
+
+static write_back* new_write_back( FILE* store, bool async ) {
+
+	write_back* wb = (write_back*) calloc( 1, sizeof(write_back) );
+	assert( wb && store );
+	wb->store = store;
+	wb->async = async;
+	pthread_mutex_init( &wb->lock, NULL );
+	pthread_cond_init( &wb->not_empty, NULL );
+	pthread_cond_init( &wb->not_full, NULL );
+	pthread_cond_init( &wb->idle, NULL );
+	if( async ) {
+		pthread_create( &wb->flusher, NULL, flusher, wb );
+	}
+
+	return wb;
+}
+
+// false if the queue is full and wait isn't set. Can be called from any thread (the shards all share one)
+static bool queue_write( write_back* wb, pending_write w, bool wait ) {
+
+	pthread_mutex_lock( &wb->lock );
+	if( wb->count == WRITE_BACK_QUEUE ) {
+		if( !wait ) {
+			pthread_mutex_unlock( &wb->lock );
+			return 0;
+		}
+		TRACE_EVENT("Write back queue full, writing a batch\n");
+		TRACE_RECORD( TRACE_STALL, w.r.id, 0 );
+		wb->stalls++;
+		// waits if the flusher is writing one already. Then there's room, unless that failed
+		while( wb->count == WRITE_BACK_QUEUE ) {
+			if( !write_queued( wb ) ) {
+				wait_to_retry( wb );
+			}
+		}
+	}
+	wb->queue[(wb->head + wb->count) % WRITE_BACK_QUEUE] = w;
+	wb->count++;
+	if( wb->async ) {
+		if( wb->count >= WRITE_BACK_WAKE ) {
+			pthread_cond_signal( &wb->not_empty );
+		}
+	} else {
+		// right away, along with what failed before. Another failure leaves them all queued
+		while( wb->count > 0 && write_queued( wb ) ) {
+		}
+	}
+	pthread_mutex_unlock( &wb->lock );
+
+	return 1;
+}
+
+// the item is freed once it's written
+static void write_back_item( write_back* wb, item* i ) {
+
+	queue_write( wb, (pending_write){ .r = { .id = i->id, .value = i->value }, .size = i->size, .i = i }, 1 );
+}
+
+// for items the caller frees right away (the slots of an image), the queue only gets the record
+static void write_back_copy( write_back* wb, item* i ) {
+
+	queue_write( wb, (pending_write){ .r = { .id = i->id, .value = i->value }, .size = i->size, .i = NULL }, 1 );
+}
+
+// wait until everything that was queued is in the backing store. false once WRITE_BACK_RETRIES
+// writes failed while waiting, what isn't written yet stays queued
+static bool drain_write_back( write_back* wb ) {
+
+	pthread_mutex_lock( &wb->lock );
+	uint64_t errors = wb->errors;
+	wb->drains++;
+	pthread_cond_signal( &wb->not_empty );
+	while( (wb->count > 0 || wb->writing) && wb->errors - errors < WRITE_BACK_RETRIES ) {
+		if( wb->async ) {
+			pthread_cond_wait( &wb->idle, &wb->lock );
+		} else if( !write_queued( wb ) ) {
+			wait_to_retry( wb );
+		}
+	}
+	wb->drains--;
+	bool drained = wb->count == 0;
+	pthread_mutex_unlock( &wb->lock );
+
+	return drained;
+}
+
+// writes out whatever is still queued, the store stays open (it's the caller's)
+static void free_write_back( write_back* wb ) {
+
+	if( wb->async ) {
+		pthread_mutex_lock( &wb->lock );
+		wb->stop = 1;
+		pthread_cond_signal( &wb->not_empty );
+		pthread_mutex_unlock( &wb->lock );
+		pthread_join( wb->flusher, NULL );
+	} else {
+		pthread_mutex_lock( &wb->lock );
+		write_all_or_give_up( wb );
+		pthread_mutex_unlock( &wb->lock );
+	}
+	pthread_mutex_destroy( &wb->lock );
+	pthread_cond_destroy( &wb->not_empty );
+	pthread_cond_destroy( &wb->not_full );
+	pthread_cond_destroy( &wb->idle );
+	free( wb );
+
+}
+
+// the newest queued write for key, false if there's none. The record stays queued, the item is the caller's now
+static bool take_pending( write_back* wb, int key, pending_write* w ) {
+
+	bool found = 0;
+	pthread_mutex_lock( &wb->lock );
+	for( int n=wb->count - 1; n >= 0; n-- ) {
+		pending_write* p = &wb->queue[(wb->head + n) % WRITE_BACK_QUEUE];
+		if( p->r.id == key ) {
+			*w = *p;
+			p->i = NULL;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &wb->lock );
+
+	return found;
+}
+
+static item* cache_alloc_item( cache* c, int id, int value, bool is_dirty );
+
+/*
+A miss on a key that's still in the write back queue: the item comes back clean, the record is
+written anyway. An image item was only copied into the record, so that's made again from it, and
+so is an item that clean_cache wrote and that was evicted after that. Returns the entry pinned,
+NULL if it isn't queued or doesn't fit. One that doesn't fit is queued again, dirty.
+*/
+static entry* fill_from_write_back( cache* c, int key ) {
+
+	pending_write w;
+	if( !take_pending( c->wb, key, &w ) ) {
+		return NULL;
+	}
+	item* i = w.i;
+	if( i == NULL ) {
+		// the record is still queued, nothing's lost if there's no slot
+		i = cache_alloc_item( c, w.r.id, w.r.value, 0 );
+		if( i == NULL ) {
+			return NULL;
+		}
+		i->size = w.size;
+	}
+	i->is_dirty = 0;
+	if( add_item( c, i ) ) {
+		STAT_ADD( c, queued_hits );
+		TRACE_RECORD( TRACE_FILL, key, 1 );
+		return find_entry( c, key );
+	}
+	i->is_dirty = 1;
+	evict_item( c, i );
+	return NULL;
+}
+
+/*
+Write back the oldest dirty available items until there are low_water clean available entries
+(at most max in one go), so evictions can take a clean entry and add_item doesn't have to write
+anything. The items stay in the cache, clean, as the oldest clean entries. Returns how many it cleaned.
+*/
+static int clean_cache( cache* c, int low_water, int max ) {
+
+	int cleaned = 0;
+	while( cleaned < max && c->num_available_clean < low_water && c->num_available_dirty > 0 ) {
+
+		// the one that would be evicted next
+		entry* e = pick_victim( c, 1 );
+		item* i = e->item;
+		if( c->wb ) {
+			// don't wait for a full queue, this runs with the shard locked
+			if( !queue_write( c->wb, (pending_write){ .r = { .id = i->id, .value = i->value }, .size = i->size, .i = NULL }, 0 ) ) {
+				break;
+			}
+		} else {
+			TRACE_OP("Pretending to write dirty item to disk or something: { id = %d, value = %d }\n", i->id, i->value );
+			TRACE_RECORD( TRACE_WRITE, i->id, 0 );
+		}
+
+		make_unavailable( c, e );
+		i->is_dirty = 0;
+		make_available( c, e );
+		// it was older than the clean ones, so it goes first
+		*available_list( c, e ) = next_in_list( c, e );
+
+		c->cleaner_writes++;
+		cleaned++;
+	}
+
+	return cleaned;
+}
+
+/********************** ADMISSION *****************************/
+
+/*
+TinyLFU: when the cache is full, a new item only gets in if its key was asked for more often
+than the key of the item it would evict. Otherwise a key that is used once pushes out a hot one,
+whatever the policy. How often is estimated by a count-min sketch: SKETCH_ROWS rows of 4 bit
+counters, a key counts in one counter per row and its estimate is the smallest of them. Every
+get counts (hits and misses), and after SKETCH_SAMPLE gets per entry every counter is halved so
+keys that were hot a while ago fade. That's O(counters) once every SKETCH_SAMPLE * capacity
+gets, one word op per 16 counters. The sketch has at least one counter per entry in every
+row, 2 bytes per entry for 4 rows.
+
+Only the serialized gets count. The lock free get of the sharded cache doesn't, and its shards
+don't use admission.
+*/
+
+#define SKETCH_ROWS 4
+#define SKETCH_SAMPLE 10
+
+typedef struct frequency_sketch {
+	uint64_t* words; // SKETCH_ROWS rows of row_mask + 1 words, 16 counters per word
+	uint32_t row_mask;
+	uint32_t accesses; // counted since the last halving
+	uint32_t sample_size;
+	uint64_t halvings;
+} frequency_sketch;
+
+// MurmurHash3 64 bit finalizer (the buckets inside a shard still use the low bits of the key)
+static inline uint64_t hash( int key ) {
+
+	uint64_t h = (uint64_t)key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+	return h;
+}
+
+static frequency_sketch* new_sketch( int capacity ) {
+
+	uint32_t words = 1;
+	while( words * 16 < (uint32_t)capacity ) {
+		words *= 2;
+	}
+	frequency_sketch* s = (frequency_sketch*) malloc( sizeof(frequency_sketch) );
+	assert( s );
+	s->words = (uint64_t*) calloc( (size_t)words * SKETCH_ROWS, sizeof(uint64_t) );
+	assert( s->words );
+	s->row_mask = words - 1;
+	s->accesses = 0;
+	s->sample_size = (uint32_t)capacity * SKETCH_SAMPLE;
+	s->halvings = 0;
+	return s;
+}
+
+static void free_sketch( frequency_sketch* s ) {
+
+	if( s ) {
+		free( s->words );
+		free( s );
+	}
+}
+
+// the word with the counter of a key (hash h) in a row, and where in the word it is.
+// Double hashing, the rows take different bits of the hash
+static inline uint64_t* sketch_counter( frequency_sketch* s, uint64_t h, int row, int* shift ) {
+
+	uint32_t x = (uint32_t)h + (uint32_t)row * (uint32_t)(h >> 32);
+	*shift = (int)(x & 15) * 4;
+	return &s->words[(size_t)row * (s->row_mask + 1) + ((x >> 4) & s->row_mask)];
+}
+
+static void sketch_add( frequency_sketch* s, uint64_t h ) {
+
+	for( int row=0; row<SKETCH_ROWS; row++ ) {
+		int shift;
+		uint64_t* w = sketch_counter( s, h, row, &shift );
+		if( ((*w >> shift) & 15) < 15 ) {
+			*w += (uint64_t)1 << shift;
+		}
+	}
+	if( ++s->accesses >= s->sample_size ) {
+		// every counter at once, the bits that shift into the next counter are masked off
+		size_t n = (size_t)(s->row_mask + 1) * SKETCH_ROWS;
+		for( size_t k=0; k<n; k++ ) {
+			s->words[k] = (s->words[k] >> 1) & 0x7777777777777777;
+		}
+		s->accesses /= 2;
+		s->halvings++;
+	}
+}
+
+static int sketch_estimate( frequency_sketch* s, uint64_t h ) {
+
+	int estimate = 15;
+	for( int row=0; row<SKETCH_ROWS; row++ ) {
+		int shift;
+		uint64_t* w = sketch_counter( s, h, row, &shift );
+		int count = (int)((*w >> shift) & 15);
+		if( count < estimate ) {
+			estimate = count;
+		}
+	}
+	return estimate;
+}
+
+static void record_access( cache* c, int key ) {
+
+	if( c->admission ) {
+		sketch_add( c->admission, hash( key ) );
+	}
+}
+
+/*
+false when storing size more bytes means evicting, and the item that goes first was asked for
+at least as often as key. Compares with that one only, even if the byte budget makes add_item
+evict more.
+*/
+static bool admit( cache* c, int key, size_t size ) {
+
+	if( c->admission == NULL ) {
+		return 1;
+	}
+	if( c->unused_entries && (c->byte_budget == 0 || c->bytes_stored + size <= c->byte_budget) ) {
+		return 1;
+	}
+	entry* victim = pick_victim( c, 0 );
+	if( victim == NULL ) {
+		victim = pick_victim( c, 1 );
+	}
+	// nothing to evict, add_item doesn't store it either way
+	if( victim == NULL ) {
+		return 1;
+	}
+	int candidate = sketch_estimate( c->admission, hash( key ) );
+	int incumbent = sketch_estimate( c->admission, hash( entry_key( victim ) ) );
+	if( candidate > incumbent ) {
+		return 1;
+	}
+	TRACE_OP("Not admitting item %d (estimate %d), item %d is used more (%d)\n", key, candidate, entry_key( victim ), incumbent );
+	TRACE_RECORD( TRACE_REJECT, key, candidate );
+	STAT_ADD( c, not_admitted );
+	return 0;
+}
+
+// TinyLFU admission on or off, the counts so far are dropped either way
+static void set_admission( cache* c, bool on ) {
+
+	free_sketch( c->admission );
+	c->admission = on ? new_sketch( c->capacity ) : NULL;
+}
+
+/********************** IMAGE *****************************/
+
+/*
+The cache in a file, so a restarted process gets it back warm. The file is a header, the
+buckets, the entries and a slab of item slots, all mapped MAP_SHARED, so it's the cache itself
+and not a copy: nothing is written out on the way, close_cache_image just syncs and unmaps.
+Items have to come from cache_alloc_item for that (ones from Item() still work, they just
+don't survive).
+
+Entries link by index already, the one pointer is entry->item. The header has the address the
+slab was mapped at, and a reopen rebases the item pointers from that. Reopening doesn't trust
+anything but the header: every entry is checked (its item in the slab, in one piece, not shared
+with another entry, and with the entry's key), the buckets and lists are rebuilt from the ones
+that pass with refcount 0 (nothing is pinned in a new process), clean and dirty as their items
+say, and the rest is unused. A header that doesn't match (another budget, layout or build)
+starts an empty image.
+
+Only the plain cache, the sharded one has an allocation per shard.
+*/
+
+#define IMAGE_MAGIC 0x6e69766e63616368ULL
+#define IMAGE_VERSION 2
+#define IMAGE_ALIGN 64
+
+typedef struct image_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t entry_size; // sizeof(entry), differs with COMPACT_ENTRIES
+	uint32_t item_size;
+	uint32_t capacity;
+	uint32_t num_buckets;
+	uint32_t num_items;
+	uint64_t items_base; // where the slab was mapped when the item pointers were written
+	uint64_t bytes; // of the whole file
+} image_header;
+
+static inline size_t image_align( size_t n ) {
+	return (n + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+// offsets in the file, the header is at 0
+typedef struct image_layout {
+	size_t buckets;
+	size_t entries;
+	size_t items;
+	size_t bytes;
+	uint32_t num_items;
+} image_layout;
+
+static image_layout layout_image( size_t capacity, size_t num_buckets ) {
+
+	image_layout l;
+	// room for what's stored and some that are out of the cache but still held
+	l.num_items = (uint32_t)(capacity + capacity / 8 + 1);
+	l.buckets = image_align( sizeof(image_header) );
+	l.entries = image_align( l.buckets + num_buckets * sizeof(uint32_t) );
+	l.items = image_align( l.entries + capacity * sizeof(entry) );
+	l.bytes = image_align( l.items + l.num_items * sizeof(item) );
+	return l;
+}
+
+static bool image_header_valid( image_header* h, size_t capacity, size_t num_buckets, image_layout* l ) {
+
+	return h->magic == IMAGE_MAGIC && h->version == IMAGE_VERSION
+		&& h->entry_size == sizeof(entry) && h->item_size == sizeof(item)
+		&& h->capacity == capacity && h->num_buckets == num_buckets
+		&& h->num_items == l->num_items && h->bytes == l->bytes
+		&& h->items_base % sizeof(uint64_t) == 0;
+}
+
+// the slot the entry of an old mapping points to, NO_ENTRY if it doesn't point into the slab
+static uint32_t image_slot( image_header* h, entry* e ) {
+
+	uint64_t old = (uint64_t)(uintptr_t)e->item;
+	if( old < h->items_base || (old - h->items_base) % sizeof(item) != 0 ) {
+		return NO_ENTRY;
+	}
+	uint64_t slot = (old - h->items_base) / sizeof(item);
+	return slot < h->num_items ? (uint32_t)slot : NO_ENTRY;
+}
+
+// puts what survived the checks back into the buckets and lists, all of it with refcount 0
+static void rebuild_image( cache* c, image_header* h ) {
+
+	// slots that an entry already has
+	uint8_t* taken = (uint8_t*) calloc( c->num_items, 1 );
+	assert( taken );
+
+	int dropped = 0;
+	for( int n=0; n<c->capacity; n++ ) {
+		entry* e = &c->entries[n];
+		uint32_t slot = e->item ? image_slot( h, e ) : NO_ENTRY;
+		bool valid = slot != NO_ENTRY && !taken[slot];
+		if( valid ) {
+			e->item = &c->items[slot];
+#ifndef COMPACT_ENTRIES
+			valid = e->key == e->item->id;
+#endif
+			// the key is what finds its bucket, it can't be in there twice
+			valid = valid && e->item->size >= 0 && find_entry( c, entry_key( e ) ) == NULL;
+		}
+
+		if( valid ) {
+			taken[slot] = 1;
+			e->refcount = 0;
+			e->referenced = 0;
+			e->is_protected = 0;
+			insert_into_bucket( c, e );
+			make_available( c, e );
+			c->num_stored++;
+			c->bytes_stored += (size_t)e->item->size;
+		} else {
+			dropped += e->item != NULL;
+			memset( e, 0, sizeof(entry) );
+		}
+	}
+	for( int n=0; n<c->capacity; n++ ) {
+		if( c->entries[n].item == NULL ) {
+			make_available( c, &c->entries[n] );
+		}
+	}
+	for( uint32_t slot=c->num_items; slot-- > 0; ) {
+		if( !taken[slot] ) {
+			free_image_item( c, &c->items[slot] );
+		}
+	}
+	free( taken );
+
+	h->items_base = (uint64_t)(uintptr_t)c->items;
+	TRACE_EVENT("Reopened cache image: %d items, %d entries dropped\n", c->num_stored, dropped );
+}
+
+/*
+Opens (or creates) the image at path for a cache that fits in memory_budget, NULL if the
+file can't be mapped. The budget is for the cache like new_cache's, the file is bigger by the
+header and the slots for items that are held but not in the cache. free_cache closes it.
+*/
+static cache* open_cache_image( const char* path, size_t memory_budget ) {
+
+	size_t capacity, num_buckets;
+	size_cache( memory_budget, &capacity, &num_buckets );
+	image_layout l = layout_image( capacity, num_buckets );
+
+	int fd = open( path, O_RDWR | O_CREAT, 0644 );
+	if( fd < 0 ) {
+		return NULL;
+	}
+	struct stat st;
+	bool reuse = fstat( fd, &st ) == 0 && (size_t)st.st_size == l.bytes;
+	if( !reuse && ftruncate( fd, (off_t)l.bytes ) != 0 ) {
+		close( fd );
+		return NULL;
+	}
+	void* mapped = mmap( NULL, l.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	// the mapping keeps the file
+	close( fd );
+	if( mapped == MAP_FAILED ) {
+		return NULL;
+	}
+
+	char* base = (char*) mapped;
+	image_header* h = (image_header*) base;
+	reuse = reuse && image_header_valid( h, capacity, num_buckets, &l );
+	entry* entries = (entry*)( base + l.entries );
+	if( !reuse ) {
+		TRACE_EVENT("New cache image %s\n", path );
+		memset( entries, 0, capacity * sizeof(entry) );
+	}
+
+	cache* c = (cache*) malloc( sizeof(cache) );
+	assert( c );
+	uint32_t* buckets = (uint32_t*)( base + l.buckets );
+	memset( buckets, 0xff, num_buckets * sizeof(uint32_t) );
+	init_cache( c, buckets, num_buckets, entries, capacity );
+	c->image = h;
+	c->image_bytes = l.bytes;
+	c->items = (item*)( base + l.items );
+	c->num_items = l.num_items;
+
+	if( reuse ) {
+		rebuild_image( c, h );
+	} else {
+		for( int n=0; n<c->capacity; n++ ) {
+			make_available( c, &c->entries[n] );
+		}
+		for( uint32_t slot=c->num_items; slot-- > 0; ) {
+			free_image_item( c, &c->items[slot] );
+		}
+		h->magic = IMAGE_MAGIC;
+		h->version = IMAGE_VERSION;
+		h->entry_size = sizeof(entry);
+		h->item_size = sizeof(item);
+		h->capacity = (uint32_t)capacity;
+		h->num_buckets = (uint32_t)num_buckets;
+		h->num_items = l.num_items;
+		h->items_base = (uint64_t)(uintptr_t)c->items;
+		h->bytes = l.bytes;
+	}
+
+	return c;
+}
+
+/*
+An item for add_item: a slot of the image, or Item() without one. When all slots are taken,
+the entry the policy picks gives its item up. NULL when that's not possible, every item in the
+cache is pinned and the rest of the slots are held outside it.
+*/
+static item* cache_alloc_item( cache* c, int id, int value, bool is_dirty ) {
+
+	if( c->image == NULL ) {
+		return Item( id, value, is_dirty );
+	}
+	if( c->free_items == NO_ENTRY ) {
+		// only a stored item has a slot to give up
+		entry* e = pick_victim( c, 0 );
+		if( e == NULL ) {
+			e = pick_victim( c, 1 );
+		}
+		if( e == NULL ) {
+			return NULL;
+		}
+		evict_entry( c, e );
+	}
+
+	item* i = &c->items[c->free_items];
+	memcpy( &c->free_items, i, sizeof(uint32_t) );
+	memset( i, 0, sizeof(item) );
+	i->id = id;
+	i->value = value;
+	i->size = (int)sizeof(item);
+	i->is_dirty = is_dirty;
+	return i;
+}
+
+/********************** SPILL TIER *****************************/
+
+/*
+A second tier on local disk for clean items that get evicted, so a miss in memory can read them
+back instead of going to wherever they came from. The file is a log of fixed size records in
+SPILL_SEGMENT record segments, used as a ring: records are appended to the open segment, which
+is kept in memory and written in one go when it's full, and before a segment is written over,
+whatever is still in it is dropped. Records are in the order their items were evicted, so that
+drops the ones that left memory the longest ago, a segment at a time. No compaction: a record
+that was read back (or replaced) is just a hole until its segment comes round again.
+
+The index of the records is in memory, a chained hash over the record slots, 12 bytes per record
+plus 4 per bucket. The tier only has what memory doesn't: a get that finds the key in the tier
+moves the item back into the cache (add_item, so that can push another item out to the tier),
+and add_item drops an older copy of the key. Dirty items aren't spilled, they go to write back.
+
+The caller owns the file (tmpfs will do for tests) and sets c->tier. One cache per tier, the
+sharded cache doesn't have one.
+*/
+
+#define SPILL_SEGMENT 256
+
+typedef struct spill_record {
+	int id;
+	int value;
+	int size;
+} spill_record;
+
+#define SPILL_SEGMENT_BYTES (SPILL_SEGMENT * sizeof(spill_record))
+
+typedef struct tier_slot {
+	int key;
+	uint32_t next; // in the bucket chain, NO_ENTRY at the end
+	bool live; // in the index, the record is the tier's copy of key
+} tier_slot;
+
+typedef struct spill_tier {
+	int fd;
+	uint32_t num_slots; // records in the file, a whole number of segments
+	uint32_t write_slot; // next record, in the open segment
+	uint32_t* buckets;
+	uint32_t bucket_mask;
+	tier_slot* slots;
+	uint32_t stored;
+	uint64_t spills;
+	uint64_t hits;
+	uint64_t reclaimed; // dropped when their segment was written over, without being read back
+	uint64_t segments_written;
+	uint64_t errors; // failed writes (the records of the segment are dropped) and reads
+	spill_record open[SPILL_SEGMENT];
+} spill_tier;
+
+// bytes is the most the file grows to, at least one segment
+static spill_tier* new_spill_tier( int fd, size_t bytes ) {
+
+	size_t num_segments = bytes / SPILL_SEGMENT_BYTES;
+	assert( num_segments > 0 && num_segments * SPILL_SEGMENT < UINT32_MAX );
+	spill_tier* t = (spill_tier*) malloc( sizeof(spill_tier) );
+	assert( t );
+	t->fd = fd;
+	t->num_slots = (uint32_t)(num_segments * SPILL_SEGMENT);
+	t->write_slot = 0;
+	uint32_t num_buckets = 1;
+	while( num_buckets < t->num_slots ) {
+		num_buckets *= 2;
+	}
+	t->buckets = (uint32_t*) malloc( num_buckets * sizeof(uint32_t) );
+	t->slots = (tier_slot*) calloc( t->num_slots, sizeof(tier_slot) );
+	assert( t->buckets && t->slots );
+	memset( t->buckets, 0xff, num_buckets * sizeof(uint32_t) ); // all NO_ENTRY
+	t->bucket_mask = num_buckets - 1;
+	t->stored = 0;
+	t->spills = 0;
+	t->hits = 0;
+	t->reclaimed = 0;
+	t->segments_written = 0;
+	t->errors = 0;
+	return t;
+}
+
+// the file stays open, it's the caller's
+static void free_spill_tier( spill_tier* t ) {
+
+	free( t->buckets );
+	free( t->slots );
+	free( t );
+}
+
+// the link to the slot with key, or the NO_ENTRY at the end of its chain
+static uint32_t* tier_link( spill_tier* t, int key ) {
+
+	uint32_t* link = &t->buckets[hash( key ) & t->bucket_mask];
+	while( *link != NO_ENTRY && t->slots[*link].key != key ) {
+		link = &t->slots[*link].next;
+	}
+	return link;
+}
+
+static void tier_unlink( spill_tier* t, uint32_t* link ) {
+
+	tier_slot* s = &t->slots[*link];
+	s->live = 0;
+	*link = s->next;
+	t->stored--;
+}
+
+static void tier_drop( spill_tier* t, int key ) {
+
+	uint32_t* link = tier_link( t, key );
+	if( *link != NO_ENTRY ) {
+		tier_unlink( t, link );
+	}
+}
+
+// the records of a segment leave the index, returns how many there were
+static uint64_t drop_segment( spill_tier* t, uint32_t first ) {
+
+	uint64_t dropped = 0;
+	for( uint32_t n=first; n<first + SPILL_SEGMENT; n++ ) {
+		if( t->slots[n].live ) {
+			tier_unlink( t, tier_link( t, t->slots[n].key ) );
+			dropped++;
+		}
+	}
+	return dropped;
+}
+
+static void write_segment( spill_tier* t, uint32_t first ) {
+
+	TRACE_STEP("Writing spill segment at record %u\n", first );
+	if( pwrite( t->fd, t->open, sizeof(t->open), (off_t)first * (off_t)sizeof(spill_record) ) != (ssize_t)sizeof(t->open) ) {
+		TRACE_EVENT("Writing spill segment at record %u failed, its records are gone\n", first );
+		t->errors++;
+		drop_segment( t, first );
+		return;
+	}
+	t->segments_written++;
+}
+
+static void spill_item( spill_tier* t, item* i ) {
+
+	TRACE_OP("Spilling clean item { id = %d, value = %d }\n", i->id, i->value );
+	tier_drop( t, i->id );
+	if( t->write_slot % SPILL_SEGMENT == 0 ) {
+		// the oldest segment, the ones it has left go
+		t->reclaimed += drop_segment( t, t->write_slot );
+	}
+	uint32_t slot = t->write_slot++;
+	t->open[slot % SPILL_SEGMENT] = (spill_record){ .id = i->id, .value = i->value, .size = i->size };
+	uint32_t* b = &t->buckets[hash( i->id ) & t->bucket_mask];
+	t->slots[slot] = (tier_slot){ .key = i->id, .next = *b, .live = 1 };
+	*b = slot;
+	t->stored++;
+	t->spills++;
+	TRACE_RECORD( TRACE_SPILL, i->id, slot );
+	if( t->write_slot % SPILL_SEGMENT == 0 ) {
+		write_segment( t, t->write_slot - SPILL_SEGMENT );
+		if( t->write_slot == t->num_slots ) {
+			t->write_slot = 0;
+		}
+	}
+}
+
+// takes the record of key out of the tier, false if it isn't there (or can't be read)
+static bool tier_take( spill_tier* t, int key, spill_record* r ) {
+
+	uint32_t* link = tier_link( t, key );
+	if( *link == NO_ENTRY ) {
+		return 0;
+	}
+	uint32_t slot = *link;
+	tier_unlink( t, link );
+	if( slot < t->write_slot && slot >= t->write_slot - t->write_slot % SPILL_SEGMENT ) {
+		// in the open segment
+		*r = t->open[slot % SPILL_SEGMENT];
+	} else if( pread( t->fd, r, sizeof(*r), (off_t)slot * (off_t)sizeof(spill_record) ) != (ssize_t)sizeof(*r) || r->id != key ) {
+		TRACE_EVENT("Reading spilled record %u of key %d failed\n", slot, key );
+		t->errors++;
+		return 0;
+	}
+	t->hits++;
+	return 1;
+}
+
+// a miss in memory: the item comes back from the tier if it's there, stored and pinned
+static entry* fill_from_tier( cache* c, int key ) {
+
+	spill_record r;
+	if( !tier_take( c->tier, key, &r ) ) {
+		return NULL;
+	}
+	item* i = cache_alloc_item( c, r.id, r.value, 0 );
+	if( i ) {
+		i->size = r.size;
+		if( add_item( c, i ) ) {
+			STAT_ADD( c, tier_hits );
+			TRACE_RECORD( TRACE_FILL, key, 0 );
+			return find_entry( c, key );
+		}
+		// everything pinned, or admission kept it out. It goes back
+		spill_item( c->tier, i );
+		evict_item( c, i );
+	} else {
+		spill_item( c->tier, &(item){ .id = r.id, .value = r.value, .size = r.size } );
+	}
+	return NULL;
+}
+
+/********************** SNAPSHOT *****************************/
+
+/*
+The cache contents in a file (see snapshot.c), to fill another cache with. A record is the
+key, the value, the size and the dirty flag, oldest use first: the probation lists from the end that
+goes first, then the protected lists (2Q) the same way, then the pinned entries (they're in
+use, so the newest). cache_restore replays them as add and release in that order, so the
+lists come back in the same order. What's not in there: 2Q protection and CLOCK hits, the
+restored items start on probation with no hits.
+*/
+#define SNAPSHOT_RECORD (3 * sizeof(int) + 1)
+
+static inline void put_record( snapshot_file* s, item* i ) {
+
+	uint8_t record[SNAPSHOT_RECORD];
+	memcpy( record, &i->id, sizeof(int) );
+	memcpy( record + sizeof(int), &i->value, sizeof(int) );
+	memcpy( record + 2 * sizeof(int), &i->size, sizeof(int) );
+	record[3 * sizeof(int)] = (uint8_t)(i->is_dirty != 0);
+	snapshot_put( s, record );
+}
+
+// false if the file couldn't be written. For a shard, hold its lock
+static bool cache_snapshot( cache* c, int fd ) {
+
+	snapshot_file* s = snapshot_write_begin( fd, SNAPSHOT_RECORD, (uint64_t)c->num_stored );
+	entry* lists[4] = { c->available_clean_entries, c->available_dirty_entries, c->protected_clean_entries, c->protected_dirty_entries };
+	for( int l=0; l<4; l++ ) {
+		if( lists[l] == NULL ) {
+			continue;
+		}
+		entry* current = prev_in_list( c, lists[l] );
+		do {
+			// pinned CLOCK entries are on the lists too, they go with the pinned ones
+			if( current->refcount == 0 ) {
+				put_record( s, current->item );
+			}
+			current = prev_in_list( c, current );
+		} while( current != prev_in_list( c, lists[l] ) );
+	}
+	for( int n=0; n<c->capacity; n++ ) {
+		if( c->entries[n].item && c->entries[n].refcount > 0 ) {
+			put_record( s, c->entries[n].item );
+		}
+	}
+	TRACE_EVENT("Snapshot of %d items\n", c->num_stored );
+	return snapshot_write_end( s );
+}
+
+/*
+Fills an empty cache from a snapshot, everything with refcount 0. When the file has more
+items than fit, the clean ones at its start (the oldest) are skipped. The rest go in like with
+add_item, a full cache evicts the oldest clean one, or else the oldest dirty one, which is written
+then (and counted in dirty_evictions). No dirty record is just dropped. false if the
+file isn't a snapshot, or is damaged (the items before the damage are in the cache then).
+*/
+static bool cache_restore( cache* c, int fd ) {
+
+	assert( c->num_stored == 0 );
+	snapshot_file* s = snapshot_read_begin( fd, SNAPSHOT_RECORD );
+	if( s == NULL ) {
+		return 0;
+	}
+
+	uint64_t skip = s->count > (uint64_t)c->capacity ? s->count - (uint64_t)c->capacity : 0;
+#if TRACE_LEVEL >= 1
+	uint64_t dirty_evictions = c->stats.dirty_evictions;
+#endif
+	const uint8_t* record;
+	while( (record = snapshot_next( s )) ) {
+		bool is_dirty = record[3 * sizeof(int)] != 0;
+		if( skip > 0 && !is_dirty ) {
+			skip--;
+			continue;
+		}
+		skip = 0;
+		int id, value, size;
+		memcpy( &id, record, sizeof(int) );
+		memcpy( &value, record + sizeof(int), sizeof(int) );
+		memcpy( &size, record + 2 * sizeof(int), sizeof(int) );
+		// a key that is in there twice keeps the first
+		if( size < 0 || find_entry( c, id ) || !make_room( c, (size_t)size ) ) {
+			continue;
+		}
+		item* i = cache_alloc_item( c, id, value, is_dirty );
+		i->size = size;
+		// an unused one, until the clean ones at the start are skipped
+		entry* e = get_available_entry( c );
+		set_entry( e, i );
+		insert_into_bucket( c, e );
+		start_on_clock( c, e );
+		c->bytes_stored += (size_t)size;
+		unpin_entry( c, e );
+	}
+	TRACE_EVENT("Restored %d items, %lu dirty ones didn't fit and were written\n", c->num_stored, c->stats.dirty_evictions - dirty_evictions );
+	return snapshot_read_end( s );
+}
+
+/********************** SHARDED *****************************/
+
+/*
+Thread safe version: keys are spread over a number of independent caches (shards) by hash,
+each with its own lock, so threads only contend when they use the same shard.
+The memory budget is split evenly over the shards.
+*/
+
+struct pending_load;
+
+typedef struct shard {
+	pthread_mutex_t lock;
+	cache* c;
+	struct pending_load* loading; // keys sharded_get_or_load is loading right now
+	// keep every shard on its own cache line(s) so taking one lock doesn't slow down the neighbours
+	char padding[64 - (sizeof(pthread_mutex_t) + sizeof(cache*) + sizeof(struct pending_load*)) % 64];
+} shard;
+
+typedef struct sharded_cache {
+	int num_shards; // power of 2
+	shard* shards;
+	// per thread front caches (see FRONT CACHE)
+	bool front;
+	int front_slots;
+	pthread_key_t front_key;
+} sharded_cache;
+
+static void free_front( void* f );
+
+static sharded_cache* new_sharded_cache( int num_shards, size_t memory_budget ) {
+
+	assert( num_shards > 0 && (num_shards & (num_shards - 1)) == 0 && num_shards <= UINT16_MAX );
+
+	sharded_cache* sc = (sharded_cache*) malloc( sizeof(sharded_cache) );
+	assert( sc );
+	sc->num_shards = num_shards;
+	sc->front = 0;
+	sc->front_slots = 0;
+	sc->shards = (shard*) aligned_alloc( 64, (size_t)num_shards * sizeof(shard) );
+	assert( sc->shards );
+	for( int s=0; s<num_shards; s++ ) {
+		pthread_mutex_init( &sc->shards[s].lock, NULL );
+		sc->shards[s].c = new_cache( memory_budget / (size_t)num_shards );
+		sc->shards[s].loading = NULL;
+	}
+
+	return sc;
+}
+
+static void free_sharded_cache( sharded_cache* sc ) {
+
+	if( sc->front ) {
+		// the calling thread's, other threads flushed theirs when they exited
+		free_front( pthread_getspecific( sc->front_key ) );
+		pthread_setspecific( sc->front_key, NULL );
+		pthread_key_delete( sc->front_key );
+	}
+	for( int s=0; s<sc->num_shards; s++ ) {
+		assert( sc->shards[s].loading == NULL );
+		flush_cache( sc->shards[s].c );
+		free_cache( sc->shards[s].c );
+		pthread_mutex_destroy( &sc->shards[s].lock );
+	}
+	free( sc->shards );
+	free( sc );
+}
+
+static void sharded_set_write_back( sharded_cache* sc, write_back* wb ) {
+
+	for( int s=0; s<sc->num_shards; s++ ) {
+		sc->shards[s].c->wb = wb;
+	}
+}
+
+static int sharded_capacity( sharded_cache* sc ) {
+
+	int capacity = 0;
+	for( int s=0; s<sc->num_shards; s++ ) {
+		capacity += sc->shards[s].c->capacity;
+	}
+	return capacity;
+}
+
+static inline shard* get_shard( sharded_cache* sc, int key ) {
+	return &sc->shards[ hash( key ) & (uint64_t)(sc->num_shards - 1) ];
+}
+
+/*
+Lock free fast path: once an item is pinned, more gets and releases are a single atomic op
+on the refcount. Only the 0 <-> 1 transitions, which move the entry on or off the available
+lists, take the shard lock.
+
+The lookups walk the bucket chain without the lock, so another thread can be changing it.
+Entries are never freed, so the worst case is a stale chain: the walk gives up after capacity
+steps, and get checks the key again once the entry is pinned (after that it can't be recycled).
+With COMPACT_ENTRIES only release has a fast path (it compares item pointers, not keys).
+*/
+#ifndef COMPACT_ENTRIES
+// only succeeds if the entry is pinned already
+static inline bool try_pin( entry* e ) {
+
+	int refcount = __atomic_load_n( &e->refcount, __ATOMIC_RELAXED );
+	while( refcount > 0 ) {
+		if( __atomic_compare_exchange_n( &e->refcount, &refcount, refcount + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+// only succeeds if this isn't the last reference
+static inline bool try_unpin( entry* e ) {
+
+	int refcount = __atomic_load_n( &e->refcount, __ATOMIC_RELAXED );
+	while( refcount > 1 ) {
+		if( __atomic_compare_exchange_n( &e->refcount, &refcount, refcount - 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// with the shard lock held (the refcount is still atomic, the fast path doesn't take the lock)
+static void pin_locked( cache* c, entry* e ) {
+
+	if( __atomic_load_n( &e->refcount, __ATOMIC_RELAXED ) == 0 ) {
+		// nobody can pin it without the lock while it's 0
+		pin_available( c, e );
+		STAT_ADD( c, revives );
+		__atomic_store_n( &e->refcount, 1, __ATOMIC_RELEASE );
+	} else {
+		assert( __atomic_load_n( &e->refcount, __ATOMIC_RELAXED ) < MAX_REFCOUNT );
+		__atomic_fetch_add( &e->refcount, 1, __ATOMIC_ACQUIRE );
+	}
+	mark_referenced( e );
+	TRACE_RECORD( TRACE_HIT, entry_key( e ), __atomic_load_n( &e->refcount, __ATOMIC_RELAXED ) );
+
+}
+
+static void unpin_locked( cache* c, entry* e ) {
+
+	assert( __atomic_load_n( &e->refcount, __ATOMIC_RELAXED ) > 0 );
+	int refcount = __atomic_sub_fetch( &e->refcount, 1, __ATOMIC_ACQ_REL );
+	TRACE_RECORD( TRACE_RELEASE, entry_key( e ), refcount );
+	if( refcount == 0 ) {
+		unpin_available( c, e );
+	}
+
+}
+
+// the pinned entry for key, or NULL
+static entry* sharded_get_entry( shard* s, int key ) {
+
+	entry* e;
+	uint64_t probes;
+
+#ifndef COMPACT_ENTRIES
+	e = find_entry_probes( s->c, key, &probes );
+	if( e && try_pin( e ) ) {
+		if( __atomic_load_n( &e->key, __ATOMIC_ACQUIRE ) == key ) {
+			mark_referenced( e );
+			count_lookup( s->c, e, probes, 1 );
+			TRACE_RECORD( TRACE_HIT, key, 0 );
+			return e;
+		}
+		// recycled for another key between the lookup and the pin
+		pthread_mutex_lock( &s->lock );
+		unpin_locked( s->c, e );
+		pthread_mutex_unlock( &s->lock );
+	}
+#endif
+
+	pthread_mutex_lock( &s->lock );
+	e = find_entry_probes( s->c, key, &probes );
+	count_lookup( s->c, e, probes, 0 );
+	if( e ) {
+		pin_locked( s->c, e );
+	} else {
+		// pinned already if it's there
+		e = s->c->wb ? fill_from_write_back( s->c, key ) : NULL;
+		if( e == NULL ) {
+			TRACE_RECORD( TRACE_MISS, key, 0 );
+		}
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	return e;
+}
+
+static item* sharded_get_item( sharded_cache* sc, int key ) {
+
+	entry* e = sharded_get_entry( get_shard( sc, key ), key );
+	return e ? e->item : NULL;
+}
+
+static cache_handle sharded_get_handle( sharded_cache* sc, int key ) {
+
+	shard* s = get_shard( sc, key );
+	entry* e = sharded_get_entry( s, key );
+	if( e == NULL ) {
+		return (cache_handle){ .item = NULL };
+	}
+	cache_handle h = handle_of( s->c, e );
+	h.shard = (uint16_t)(s - sc->shards);
+	return h;
+}
+
+static void sharded_release_item( sharded_cache* sc, item* i ) {
+
+	shard* s = get_shard( sc, i->id );
+
+	entry* e = find_item_entry( s->c, i );
+	if( e && try_unpin( e ) ) {
+		TRACE_RECORD( TRACE_RELEASE, i->id, 0 );
+		return;
+	}
+
+	pthread_mutex_lock( &s->lock );
+	e = find_item_entry( s->c, i );
+	if( e ) {
+		unpin_locked( s->c, e );
+	} else {
+		TRACE_OP("Item not in cache, freeing\n");
+		evict_item( s->c, i );
+	}
+	pthread_mutex_unlock( &s->lock );
+
+}
+
+// the entry is pinned by the handle, so it can't be recycled while the fast path looks at it
+static bool sharded_release_handle( sharded_cache* sc, cache_handle h ) {
+
+	assert( h.item && h.shard < sc->num_shards );
+	shard* s = &sc->shards[h.shard];
+	assert( h.entry < (uint32_t)s->c->capacity );
+	entry* e = &s->c->entries[h.entry];
+	if( handle_valid( e, h ) && try_unpin( e ) ) {
+		TRACE_RECORD( TRACE_RELEASE, h.item->id, 0 );
+		return 1;
+	}
+
+	pthread_mutex_lock( &s->lock );
+	bool valid = handle_valid( e, h );
+	if( valid ) {
+		unpin_locked( s->c, e );
+	} else {
+		TRACE_EVENT("Stale handle for entry %u\n", h.entry );
+	}
+	pthread_mutex_unlock( &s->lock );
+	return valid;
+}
+
+/*
+Unlike add_item this first checks whether the key is in the cache already: two threads can both miss
+in get and load the same item. Returns the cached item (pinned), and if that isn't i, i is freed.
+*/
+static item* add_locked( cache* c, item* i ) {
+
+	entry* e = find_entry( c, i->id );
+	if( e ) {
+		pin_locked( c, e );
+		return e->item;
+	}
+	add_item( c, i );
+	return i;
+}
+
+static item* sharded_add_item( sharded_cache* sc, item* i ) {
+
+	shard* s = get_shard( sc, i->id );
+	pthread_mutex_lock( &s->lock );
+	item* cached = add_locked( s->c, i );
+	pthread_mutex_unlock( &s->lock );
+
+	if( cached != i ) {
+		TRACE_OP("Item %d was added by another thread\n", i->id );
+		free_item( i );
+	}
+
+	return cached;
+}
+
+/*
+get_item that loads the item on a miss, and only once however many threads miss on the key at the
+same time. The first one puts a pending_load on the shard and calls load without the lock, the
+others find it there and wait. Everyone gets the item pinned, or NULL when load returned NULL.
+The pending loads are a short list per shard instead of placeholder entries: an entry without an
+item is an unused one to the rest of the cache (and the lock free get), and with COMPACT_ENTRIES
+an entry has no key without its item.
+*/
+typedef item* (*loader_fn)( int key, void* ctx );
+
+typedef struct pending_load {
+	int key;
+	int waiters;
+	item* item; // the result, once done
+	bool done;
+	pthread_cond_t cond; // done, and then the last waiter leaving
+	struct pending_load* next;
+} pending_load;
+
+// with the lock held, returns with it held. The pending_load is on the stack here, so this waits
+// until every waiter has its result
+static item* load_locked( shard* s, int key, loader_fn load, void* ctx ) {
+
+	pending_load p = { .key = key, .waiters = 0, .item = NULL, .done = 0, .next = s->loading };
+	pthread_cond_init( &p.cond, NULL );
+	s->loading = &p;
+	STAT_ADD( s->c, loads );
+	pthread_mutex_unlock( &s->lock );
+
+	item* i = load( key, ctx );
+
+	pthread_mutex_lock( &s->lock );
+	if( i ) {
+		// other threads can't load it, but sharded_add_item can still add it
+		item* cached = add_locked( s->c, i );
+		if( cached != i ) {
+			TRACE_OP("Item %d was added by another thread while loading\n", key );
+			free_item( i );
+			i = cached;
+		}
+	}
+	pending_load** link = &s->loading;
+	while( *link != &p ) {
+		link = &(*link)->next;
+	}
+	*link = p.next;
+
+	p.item = i;
+	p.done = 1;
+	pthread_cond_broadcast( &p.cond );
+	while( p.waiters > 0 ) {
+		pthread_cond_wait( &p.cond, &s->lock );
+	}
+	pthread_cond_destroy( &p.cond );
+	return i;
+}
+
+static item* sharded_get_or_load( sharded_cache* sc, int key, loader_fn load, void* ctx ) {
+
+	item* i = sharded_get_item( sc, key );
+	if( i ) {
+		return i;
+	}
+
+	shard* s = get_shard( sc, key );
+	pthread_mutex_lock( &s->lock );
+	for( ;; ) {
+		// added since the miss (or evicted into the write back queue)
+		entry* e = find_entry( s->c, key );
+		if( e ) {
+			pin_locked( s->c, e );
+		} else if( s->c->wb ) {
+			e = fill_from_write_back( s->c, key );
+		}
+		if( e ) {
+			i = e->item;
+			break;
+		}
+
+		pending_load* p = s->loading;
+		while( p && p->key != key ) {
+			p = p->next;
+		}
+		if( p == NULL ) {
+			i = load_locked( s, key, load, ctx );
+			break;
+		}
+
+		TRACE_OP("Waiting for another thread to load %d\n", key );
+		STAT_ADD( s->c, shared_loads );
+		p->waiters++;
+		while( !p->done ) {
+			pthread_cond_wait( &p->cond, &s->lock );
+		}
+		i = p->item;
+		// the loader still has it pinned, so if it's in the cache it stays there
+		e = i ? find_item_entry( s->c, i ) : NULL;
+		if( e ) {
+			pin_locked( s->c, e );
+		}
+		if( --p->waiters == 0 ) {
+			pthread_cond_signal( &p->cond );
+		}
+		// a NULL item is a shared result too. But an item that didn't fit in the cache
+		// belongs to the loader (release frees it), so load another one
+		if( i == NULL || e ) {
+			break;
+		}
+	}
+	pthread_mutex_unlock( &s->lock );
+
+	return i;
+}
+
+/*
+Background thread that runs clean_cache on every shard now and then. It skips shards that are
+locked at the time, they get their turn in the next pass.
+*/
+typedef struct cleaner {
+	sharded_cache* sc;
+	int low_water_percent; // of the capacity of a shard, that should be clean and available
+	int batch; // most items cleaned per shard per pass
+	int interval_us; // between passes
+	bool stop;
+	pthread_t thread;
+} cleaner;
+
+static void* cleaner_thread( void* params ) {
+
+	cleaner* cl = (cleaner*) params;
+	while( !__atomic_load_n( &cl->stop, __ATOMIC_ACQUIRE ) ) {
+		for( int s=0; s<cl->sc->num_shards; s++ ) {
+			shard* sh = &cl->sc->shards[s];
+			if( pthread_mutex_trylock( &sh->lock ) == 0 ) {
+				clean_cache( sh->c, sh->c->capacity * cl->low_water_percent / 100, cl->batch );
+				pthread_mutex_unlock( &sh->lock );
+			}
+		}
+		struct timespec ts = { .tv_sec = cl->interval_us / 1000000, .tv_nsec = (long)(cl->interval_us % 1000000) * 1000 };
+		nanosleep( &ts, NULL );
+	}
+
+	return NULL;
+}
+
+static cleaner* start_cleaner( sharded_cache* sc, int low_water_percent, int batch, int interval_us ) {
+
+	cleaner* cl = (cleaner*) malloc( sizeof(cleaner) );
+	assert( cl );
+	*cl = (cleaner){ .sc = sc, .low_water_percent = low_water_percent, .batch = batch, .interval_us = interval_us, .stop = 0 };
+	pthread_create( &cl->thread, NULL, cleaner_thread, cl );
+
+	return cl;
+}
+
+static void stop_cleaner( cleaner* cl ) {
+
+	__atomic_store_n( &cl->stop, 1, __ATOMIC_RELEASE );
+	pthread_join( cl->thread, NULL );
+	free( cl );
+}
+
+// dirty items written at eviction time, and by the cleaner, over all shards
+static void sharded_write_counts( sharded_cache* sc, uint64_t* eviction_writes, uint64_t* cleaner_writes ) {
+
+	*eviction_writes = 0;
+	*cleaner_writes = 0;
+	for( int s=0; s<sc->num_shards; s++ ) {
+		pthread_mutex_lock( &sc->shards[s].lock );
+		*eviction_writes += sc->shards[s].c->eviction_writes;
+		*cleaner_writes += sc->shards[s].c->cleaner_writes;
+		pthread_mutex_unlock( &sc->shards[s].lock );
+	}
+}
+
+// all shards added up
+static cache_stats sharded_stats_snapshot( sharded_cache* sc ) {
+
+	cache_stats total;
+	memset( &total, 0, sizeof(cache_stats) );
+	for( int n=0; n<sc->num_shards; n++ ) {
+		pthread_mutex_lock( &sc->shards[n].lock );
+		cache_stats s = cache_stats_snapshot( sc->shards[n].c );
+		pthread_mutex_unlock( &sc->shards[n].lock );
+		total.hits += s.hits;
+		total.misses += s.misses;
+		total.revives += s.revives;
+		total.clean_evictions += s.clean_evictions;
+		total.dirty_evictions += s.dirty_evictions;
+		total.rejections += s.rejections;
+		total.not_admitted += s.not_admitted;
+		total.tier_hits += s.tier_hits;
+		total.queued_hits += s.queued_hits;
+		total.loads += s.loads;
+		total.shared_loads += s.shared_loads;
+		total.probes += s.probes;
+		total.max_probes = s.max_probes > total.max_probes ? s.max_probes : total.max_probes;
+		total.stored += s.stored;
+		total.pinned += s.pinned;
+		total.bytes += s.bytes;
+		total.pinned_bytes += s.pinned_bytes;
+	}
+	total.avg_probes = total.hits + total.misses ? (double)total.probes / (double)(total.hits + total.misses) : 0;
+	return total;
+}
+
+/********************** FRONT CACHE *****************************/
+
+/*
+A small direct mapped cache per thread in front of the sharded cache, for threads that keep asking
+for the same few dozen keys. A slot holds one pin on the shared entry and counts the thread's own
+pins of the item locally, so a get that hits the front and its release don't touch the shared
+refcount (and its cache line) at all. When another key takes the slot, or the front is flushed,
+the count goes back to the shared entry as one add (the slot's own pin counts as one of them), so
+an item the thread still uses stays pinned and can't be evicted.
+
+sharded_use_front turns it on for all threads. A thread's front is made by its first
+front_get_item, and flushed when the thread exits. The items in the fronts stay pinned, so
+with T threads up to T * slots entries can't be evicted. free_sharded_cache flushes the
+front of the calling thread. Other threads must have exited (or called front_flush) before that.
+*/
+
+#define FRONT_SLOTS 64
+
+typedef struct front_slot {
+	cache_handle h; // the slot's own pin, h.item is NULL when the slot is empty
+	int key;
+	int uses; // pins of this thread, not counted in the shared refcount
+} front_slot;
+
+typedef struct front_cache {
+	sharded_cache* sc;
+	uint64_t hits;
+	uint64_t misses;
+	front_slot slots[]; // sc->front_slots of them
+} front_cache;
+
+// slots a power of 2, 64 to 256 is about right. Before any thread uses the cache
+static void sharded_use_front( sharded_cache* sc, int slots ) {
+
+	assert( !sc->front && slots > 0 && (slots & (slots - 1)) == 0 );
+	int err = pthread_key_create( &sc->front_key, free_front );
+	assert( err == 0 );
+	sc->front_slots = slots;
+	sc->front = 1;
+}
+
+static front_cache* thread_front( sharded_cache* sc ) {
+
+	front_cache* f = (front_cache*) pthread_getspecific( sc->front_key );
+	if( f == NULL ) {
+		f = (front_cache*) calloc( 1, sizeof(front_cache) + (size_t)sc->front_slots * sizeof(front_slot) );
+		assert( f );
+		f->sc = sc;
+		pthread_setspecific( sc->front_key, f );
+	}
+	return f;
+}
+
+static inline front_slot* front_slot_of( front_cache* f, int key ) {
+	return &f->slots[hash( key ) & (uint64_t)(f->sc->front_slots - 1)];
+}
+
+// the uses go to the shared refcount, and the slot is empty after
+static void front_drop( front_cache* f, front_slot* s ) {
+
+	if( s->uses == 0 ) {
+		sharded_release_handle( f->sc, s->h );
+	} else if( s->uses > 1 ) {
+		// pinned by the slot, so this doesn't move the entry between lists and needs no lock
+		entry* e = &f->sc->shards[s->h.shard].c->entries[s->h.entry];
+		assert( __atomic_load_n( &e->refcount, __ATOMIC_RELAXED ) + s->uses - 1 <= MAX_REFCOUNT );
+		__atomic_fetch_add( &e->refcount, s->uses - 1, __ATOMIC_RELAXED );
+	}
+	s->h.item = NULL;
+	s->uses = 0;
+}
+
+// sharded_get_item through the thread's front, release with front_release_item
+static item* front_get_item( sharded_cache* sc, int key ) {
+
+	front_cache* f = thread_front( sc );
+	front_slot* s = front_slot_of( f, key );
+	if( s->h.item && s->key == key ) {
+		s->uses++;
+		f->hits++;
+		return s->h.item;
+	}
+	f->misses++;
+	cache_handle h = sharded_get_handle( sc, key );
+	if( h.item == NULL ) {
+		return NULL;
+	}
+	if( s->h.item ) {
+		front_drop( f, s );
+	}
+	s->h = h;
+	s->key = key;
+	s->uses = 1;
+	return h.item;
+}
+
+// any pin of the item, from front_get_item or not
+static void front_release_item( sharded_cache* sc, item* i ) {
+
+	front_cache* f = (front_cache*) pthread_getspecific( sc->front_key );
+	if( f ) {
+		front_slot* s = front_slot_of( f, i->id );
+		if( s->h.item == i && s->uses > 0 ) {
+			s->uses--;
+			return;
+		}
+	}
+	sharded_release_item( sc, i );
+}
+
+static void flush_front( front_cache* f ) {
+
+	for( int n=0; n<f->sc->front_slots; n++ ) {
+		if( f->slots[n].h.item ) {
+			front_drop( f, &f->slots[n] );
+		}
+	}
+}
+
+// empties the calling thread's front
+static void front_flush( sharded_cache* sc ) {
+
+	front_cache* f = (front_cache*) pthread_getspecific( sc->front_key );
+	if( f ) {
+		flush_front( f );
+	}
+}
+
+// the destructor of the thread key, so it runs when the thread exits (the key is NULL by then)
+static void free_front( void* p ) {
+
+	front_cache* f = (front_cache*) p;
+	if( f ) {
+		TRACE_EVENT("Front cache flushed, %lu hits, %lu misses\n", (unsigned long)f->hits, (unsigned long)f->misses );
+		flush_front( f );
+		free( f );
+	}
+}
+
+/********************** TESTS *****************************/
+
+static void test_empty() {
+	
+	printf("************** Test new/flush/free ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	dump( store );
+	
+	// ensure all the unused entries are pushed: order must be capacity-1, .., 1, 0
+	entry* current = store->unused_entries;
+	for(int i=store->capacity-1; i>=0; i--) {
+		assert( current - &store->entries[0] == i );
+		current = next_in_list( store, current );
+	}
+	
+	flush_cache( store );
+	free_cache(store);	
+}
+
+static void test_add_release() {
+	
+	printf("************** Test adding/releasing items (so should recycle items) ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	for(int i=0; i<store->capacity * 2; i++) {
+
+		item* foo = Item( i, rand() % 256, rand() % 2 == 0 );
+		add_item( store, foo );
+		printf("After insert\n");
+		dump( store );
+		release_item( store, foo );
+		printf("After release\n");
+		dump( store );
+	}
+	
+	dump( store );
+	flush_cache( store );
+	
+	free_cache(store);	
+}
+
+static void test_revive() {
+	
+	printf("************** Test adding/releasing/getting items (so should revive items) ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+
+	item* foos[store->capacity];
+	for(int i=0; i<store->capacity; i++) {
+		foos[i] = Item( i, rand() % 256, rand() % 2 == 0 );
+		add_item( store, foos[i] );
+		release_item( store, foos[i] );
+	}
+	printf("After filling the cache\n");
+	dump( store );
+	for(int i=0; i<store->capacity; i++) {
+		printf("Reviving item %d\n", i);
+		item* f = get_item( store, foos[i]->id );
+		assert( f );
+		assert( f == foos[i] );
+	}
+	dump( store );
+
+	flush_cache( store );	
+	free_cache(store);	
+}
+
+static void test_sizing() {
+
+	printf("************** Test sizing caches from a memory budget ****************\n");
+	for( size_t budget=256; budget < 1024 * 1024; budget = budget * 3 / 2 ) {
+		cache* store = new_cache( budget );
+		size_t num_buckets = (size_t)store->bucket_mask + 1;
+		assert( (num_buckets & (size_t)store->bucket_mask) == 0 );
+		assert( (size_t)store->capacity <= num_buckets );
+		assert( (size_t)store->capacity * MEMORY_PER_ITEM + num_buckets * MEMORY_PER_BUCKET <= budget );
+		// one more item wouldn't have fit, not even with twice the buckets
+		assert( (size_t)(store->capacity + 1) * MEMORY_PER_ITEM + 2 * num_buckets * MEMORY_PER_BUCKET > budget );
+		flush_cache( store );
+		free_cache( store );
+	}
+
+}
+
+// every dirty item that leaves the cache is written exactly once, clean ones never
+static void test_write_back() {
+
+	printf("************** Test writing back dirty items ****************\n");
+	for( int async=0; async<2; async++ ) {
+
+		FILE* f = tmpfile();
+		assert( f );
+		write_back* wb = new_write_back( f, (bool)async );
+		cache* store = new_cache( CACHE_MEMORY_BYTES );
+		store->wb = wb;
+
+		uint64_t frees_before = __atomic_load_n( &item_frees, __ATOMIC_RELAXED );
+		int num_items = store->capacity * 4;
+		for( int i=0; i<num_items; i++ ) {
+			item* foo = Item( i, i * 3, i % 2 == 0 );
+			add_item( store, foo );
+			release_item( store, foo );
+		}
+		// flushing writes the dirty ones that are still in the cache
+		flush_cache( store );
+		drain_write_back( wb );
+
+		int num_dirty = (num_items + 1) / 2;
+		assert( wb->items_written == (uint64_t)num_dirty );
+		assert( __atomic_load_n( &item_frees, __ATOMIC_RELAXED ) - frees_before == (uint64_t)num_items );
+
+		bool seen[num_items];
+		memset( seen, 0, sizeof(seen) );
+		record r;
+		rewind( f );
+		while( fread( &r, sizeof(record), 1, f ) == 1 ) {
+			assert( r.id >= 0 && r.id < num_items && r.id % 2 == 0 );
+			assert( r.value == r.id * 3 );
+			assert( !seen[r.id] );
+			seen[r.id] = 1;
+		}
+		printf("%s: wrote %llu items in %llu batches\n", async ? "async" : "sync", (unsigned long long)wb->items_written, (unsigned long long)wb->batches_written );
+
+		free_cache( store );
+		free_write_back( wb );
+		fclose( f );
+	}
+
+}
+
+// writes that fail leave the records queued and the items unfreed, until the store works again
+static void test_write_back_errors() {
+
+	printf("************** Test writing back to a store that fails ****************\n");
+	for( int async=0; async<2; async++ ) {
+
+		FILE* broken = fopen( "/dev/null", "r" ); // every write fails
+		FILE* f = tmpfile();
+		assert( broken && f );
+		write_back* wb = new_write_back( broken, (bool)async );
+		cache* store = new_cache( CACHE_MEMORY_BYTES );
+		store->wb = wb;
+
+		uint64_t frees_before = __atomic_load_n( &item_frees, __ATOMIC_RELAXED );
+		int num_dirty = 100;
+		for( int i=0; i<num_dirty; i++ ) {
+			item* foo = Item( i, i * 3, 1 );
+			add_item( store, foo );
+			release_item( store, foo );
+		}
+		flush_cache( store );
+		assert( !drain_write_back( wb ) );
+
+		pthread_mutex_lock( &wb->lock );
+		assert( wb->errors >= WRITE_BACK_RETRIES && wb->items_written == 0 && wb->count == num_dirty );
+		assert( __atomic_load_n( &item_frees, __ATOMIC_RELAXED ) == frees_before );
+		wb->store = f;
+		pthread_mutex_unlock( &wb->lock );
+
+		assert( drain_write_back( wb ) );
+		assert( wb->items_written == (uint64_t)num_dirty );
+		assert( __atomic_load_n( &item_frees, __ATOMIC_RELAXED ) - frees_before == (uint64_t)num_dirty );
+		bool seen[num_dirty];
+		memset( seen, 0, sizeof(seen) );
+		record r;
+		rewind( f );
+		while( fread( &r, sizeof(record), 1, f ) == 1 ) {
+			assert( r.id >= 0 && r.id < num_dirty && r.value == r.id * 3 && !seen[r.id] );
+			seen[r.id] = 1;
+		}
+		for( int i=0; i<num_dirty; i++ ) {
+			assert( seen[i] );
+		}
+		printf("%s: %llu failed writes before the store worked\n", async ? "async" : "sync", (unsigned long long)wb->errors );
+
+		free_cache( store );
+		free_write_back( wb );
+		fclose( f );
+		fclose( broken );
+	}
+
+	// a store that never works: free_write_back still returns, and frees the items
+	FILE* broken = fopen( "/dev/null", "r" );
+	write_back* wb = new_write_back( broken, 1 );
+	write_back_item( wb, Item( 1, 1, 1 ) );
+	free_write_back( wb );
+	fclose( broken );
+
+}
+
+// a miss on a key that's still queued gets the queued value back, not the older one in the store
+static void test_write_back_miss() {
+
+	printf("************** Test getting items that wait to be written ****************\n");
+	FILE* f = tmpfile();
+	assert( f );
+	write_back* wb = new_write_back( f, 1 );
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	store->wb = wb;
+	item* pinned[store->capacity];
+
+	item* foo = Item( 1, 10, 1 );
+	add_item( store, foo );
+	release_item( store, foo );
+	// the clean ones go first, so it takes a cache full of pinned ones to evict it
+	for( int k=0; k<store->capacity; k++ ) {
+		pinned[k] = Item( 100 + k, 0, 0 );
+		add_item( store, pinned[k] );
+	}
+	for( int k=0; k<store->capacity; k++ ) {
+		release_item( store, pinned[k] );
+	}
+	assert( find_entry( store, 1 ) == NULL );
+	item* i = get_item( store, 1 );
+	assert( i == foo && i->value == 10 && !i->is_dirty && store->stats.queued_hits == 1 );
+	release_item( store, i );
+
+	// written by clean_cache, evicted clean after that, the item is made again from the record
+	foo = Item( 2, 20, 1 );
+	add_item( store, foo );
+	release_item( store, foo );
+	assert( clean_cache( store, store->capacity, 1 ) == 1 );
+	for( int k=0; k<store->capacity; k++ ) {
+		pinned[k] = Item( 200 + k, 0, 0 );
+		add_item( store, pinned[k] );
+	}
+	for( int k=0; k<store->capacity; k++ ) {
+		release_item( store, pinned[k] );
+	}
+	assert( find_entry( store, 2 ) == NULL );
+	i = get_item( store, 2 );
+	assert( i && i->id == 2 && i->value == 20 && store->stats.queued_hits == 2 );
+	release_item( store, i );
+
+	// both were written once, coming back clean didn't add another write
+	flush_cache( store );
+	assert( drain_write_back( wb ) && wb->items_written == 2 );
+
+	free_cache( store );
+	free_write_back( wb );
+	fclose( f );
+
+}
+
+// the cleaner writes the oldest dirty items ahead of time, so the evictions after that are all clean
+static void test_cleaner() {
+
+	printf("************** Test cleaning dirty items before they're evicted ****************\n");
+	FILE* f = tmpfile();
+	write_back* wb = new_write_back( f, 1 );
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	store->wb = wb;
+
+	for( int i=0; i<store->capacity; i++ ) {
+		item* foo = Item( i, i, 1 );
+		add_item( store, foo );
+		release_item( store, foo );
+	}
+	assert( store->num_available_dirty == store->capacity && store->num_available_clean == 0 );
+
+	int half = store->capacity / 2;
+	assert( clean_cache( store, half, 1 ) == 1 );
+	assert( clean_cache( store, half, store->capacity ) == half - 1 );
+	assert( clean_cache( store, half, store->capacity ) == 0 );
+	assert( store->num_available_clean == half && store->num_available_dirty == store->capacity - half );
+	assert( store->cleaner_writes == (uint64_t)half && store->eviction_writes == 0 );
+
+	// the oldest ones were cleaned, and they are the first to go. Not oldest first among themselves
+	// though, every one clean_cache writes goes to the front of the clean list, so only check once
+	// they're all gone
+	for( int i=0; i<half; i++ ) {
+		item* foo = Item( store->capacity + i, 0, 0 );
+		add_item( store, foo );
+		release_item( store, foo );
+	}
+	// written, so a miss doesn't get them back from the queue either
+	assert( drain_write_back( wb ) );
+	for( int i=0; i<half; i++ ) {
+		assert( get_item( store, i ) == NULL );
+	}
+	assert( store->eviction_writes == 0 );
+	// the dirty ones are all still there
+	for( int i=half; i<store->capacity; i++ ) {
+		item* foo = get_item( store, i );
+		assert( foo && foo->is_dirty );
+		release_item( store, foo );
+	}
+
+	flush_cache( store );
+	drain_write_back( wb );
+	assert( store->eviction_writes == (uint64_t)(store->capacity - half) );
+	assert( wb->items_written == store->cleaner_writes + store->eviction_writes );
+
+	free_cache( store );
+	free_write_back( wb );
+	fclose( f );
+
+}
+
+// every refcount 0 entry is on the list that matches it, and the counts add up. With CLOCK
+// the pinned ones are on the lists as well, but not in the counts
+static void check_lists( cache* c ) {
+
+	entry* lists[4] = { c->available_clean_entries, c->available_dirty_entries, c->protected_clean_entries, c->protected_dirty_entries };
+	int counts[2] = { 0, 0 };
+	int num_protected = 0;
+	size_t bytes = 0;
+	for( int l=0; l<4; l++ ) {
+		entry* current = lists[l];
+		if( current ) {
+			do {
+				assert( current->item );
+				if( current->refcount > 0 ) {
+					assert( c->policy == POLICY_CLOCK && current->on_dirty_list == (l % 2) );
+					current = next_in_list( c, current );
+					continue;
+				}
+				assert( current->item->is_dirty == (l % 2) );
+				assert( current->is_protected == (l / 2) );
+				counts[l % 2]++;
+				num_protected += l / 2;
+				bytes += (size_t)current->item->size;
+				current = next_in_list( c, current );
+			} while( current != lists[l] );
+		}
+	}
+	entry* current = c->unused_entries;
+	if( current ) {
+		do {
+			assert( current->refcount == 0 && current->item == NULL && !current->is_protected );
+			counts[0]++;
+			current = next_in_list( c, current );
+		} while( current != c->unused_entries );
+	}
+	assert( counts[0] == c->num_available_clean && counts[1] == c->num_available_dirty );
+	assert( num_protected <= c->num_protected );
+	assert( bytes == c->bytes_available && c->bytes_available <= c->bytes_stored );
+	assert( c->byte_budget == 0 || c->bytes_stored <= c->byte_budget );
+
+}
+
+static void add_and_release( cache* c, int key, bool is_dirty ) {
+
+	item* foo = Item( key, key, is_dirty );
+	add_item( c, foo );
+	release_item( c, foo );
+	check_lists( c );
+}
+
+static void test_policies() {
+
+	printf("************** Test eviction policies ****************\n");
+	const char* names[] = { "LRU", "CLOCK", "2Q" };
+	for( int p=POLICY_LRU; p<=POLICY_2Q; p++ ) {
+
+		printf("Policy %s\n", names[p]);
+		cache* store = new_cache( 16 * CACHE_MEMORY_BYTES );
+		store->policy = (policy)p;
+		int capacity = store->capacity;
+
+		// a hot set, every key got a hit
+		int hot = capacity / 2;
+		for( int k=0; k<hot; k++ ) {
+			add_and_release( store, k, 0 );
+			release_item( store, get_item( store, k ) );
+		}
+		// one pinned item, which no policy can evict
+		item* pinned = get_item( store, 0 );
+
+		// scan through lots of keys that are used once
+		for( int k=1000; k<1000 + 2 * capacity; k++ ) {
+			add_and_release( store, k, 0 );
+		}
+		int hot_left = 0;
+		for( int k=1; k<hot; k++ ) {
+			item* foo = get_item( store, k );
+			if( foo ) {
+				hot_left++;
+				release_item( store, foo );
+			}
+		}
+		printf("%d of %d hot items left after the scan\n", hot_left, hot - 1);
+		if( p == POLICY_2Q ) {
+			assert( hot_left == hot - 1 );
+		} else {
+			assert( hot_left == 0 );
+		}
+		assert( get_item( store, 0 ) == pinned );
+		release_item( store, pinned );
+		release_item( store, pinned );
+		check_lists( store );
+
+		// a clean entry goes before any dirty one, however hot
+		flush_cache( store );
+		free_cache( store );
+		store = new_cache( 16 * CACHE_MEMORY_BYTES );
+		store->policy = (policy)p;
+		for( int k=0; k<capacity; k++ ) {
+			add_and_release( store, k, k != capacity - 1 );
+		}
+		release_item( store, get_item( store, capacity - 1 ) );
+		add_and_release( store, capacity, 1 );
+		assert( get_item( store, capacity - 1 ) == NULL );
+		assert( store->eviction_writes == 0 );
+
+		flush_cache( store );
+		free_cache( store );
+	}
+
+	// CLOCK gives an item that got a hit another round
+	cache* store = new_cache( 16 * CACHE_MEMORY_BYTES );
+	store->policy = POLICY_CLOCK;
+	for( int k=0; k<store->capacity; k++ ) {
+		item* foo = Item( k, k, 0 );
+		add_item( store, foo );
+		if( k == 0 ) {
+			// a hit while it's pinned, it doesn't move on the list
+			assert( get_item( store, 0 ) == foo );
+			release_item( store, foo );
+		}
+		release_item( store, foo );
+	}
+	add_and_release( store, store->capacity, 0 );
+	assert( get_item( store, 1 ) == NULL );
+	item* first = get_item( store, 0 );
+	assert( first != NULL );
+	release_item( store, first );
+	flush_cache( store );
+	free_cache( store );
+
+	// and a hit after the release doesn't move it either. Hits on 1 and then 0 leave them in
+	// their places, the hand passes 0 first, so that's older than 1 afterwards (LRU: the other way around)
+	store = new_cache( 16 * CACHE_MEMORY_BYTES );
+	store->policy = POLICY_CLOCK;
+	int capacity = store->capacity;
+	for( int k=0; k<capacity; k++ ) {
+		add_and_release( store, k, 0 );
+	}
+	release_item( store, get_item( store, 1 ) );
+	release_item( store, get_item( store, 0 ) );
+	check_lists( store );
+	for( int k=0; k<capacity - 1; k++ ) {
+		add_and_release( store, capacity + k, 0 );
+	}
+	assert( get_item( store, 0 ) == NULL );
+	first = get_item( store, 1 );
+	assert( first != NULL );
+	release_item( store, first );
+	check_lists( store );
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+// batched gets and releases pin and unpin like the single calls, misses stay NULL
+static void test_batch() {
+
+	printf("************** Test batched get/release ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	uint64_t allocs = item_allocs, frees = item_frees;
+
+	int capacity = store->capacity;
+	item* foos[capacity];
+	for( int i=0; i<capacity; i++ ) {
+		foos[i] = Item( i, i, i % 3 == 0 );
+		add_item( store, foos[i] );
+		// odd ids stay pinned
+		if( i % 2 == 0 ) {
+			release_item( store, foos[i] );
+		}
+	}
+	check_lists( store );
+
+	// every id twice, and as many that aren't in the cache
+	int n = 4 * capacity;
+	int keys[n];
+	item* items[n];
+	for( int k=0; k<n; k++ ) {
+		keys[k] = k % 2 ? k / 2 % capacity : capacity + k;
+	}
+	get_items( store, keys, n, items );
+	check_lists( store );
+	assert( store->num_available_clean + store->num_available_dirty == 0 );
+	for( int k=0; k<n; k++ ) {
+		if( keys[k] < capacity ) {
+			assert( items[k] == foos[keys[k]] );
+			assert( find_entry( store, keys[k] )->refcount == keys[k] % 2 + 2 );
+		} else {
+			assert( items[k] == NULL );
+		}
+	}
+
+	// an item that never made it into the cache is freed like release_item does
+	item* extra = Item( 1, 1, 0 );
+	items[0] = extra;
+	release_items( store, items, n );
+	check_lists( store );
+	for( int i=0; i<capacity; i++ ) {
+		assert( find_entry( store, i )->refcount == i % 2 );
+	}
+	assert( store->num_available_clean + store->num_available_dirty == (capacity + 1) / 2 );
+
+	for( int i=1; i<capacity; i+=2 ) {
+		release_item( store, foos[i] );
+	}
+	flush_cache( store );
+	free_cache( store );
+	assert( item_allocs - allocs == item_frees - frees );
+
+}
+
+// the stats count what the operations did
+static void test_stats() {
+
+	printf("************** Test stats ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	int capacity = store->capacity;
+
+	item* foos[capacity];
+	for( int i=0; i<capacity; i++ ) {
+		foos[i] = Item( i, i, i % 2 == 1 );
+		add_item( store, foos[i] );
+	}
+	cache_stats s = cache_stats_snapshot( store );
+	assert( s.stored == (uint64_t)capacity && s.pinned == (uint64_t)capacity );
+	assert( s.hits == 0 && s.misses == 0 && s.revives == 0 && s.clean_evictions == 0 );
+
+	// everything is pinned, so this doesn't fit
+	item* rejected = Item( capacity, 0, 0 );
+	add_item( store, rejected );
+	release_item( store, rejected );
+	assert( cache_stats_snapshot( store ).rejections == 1 );
+
+	// the first half are pinned twice, so only the second half are revived later
+	for( int i=0; i<capacity; i++ ) {
+		if( i < capacity / 2 ) {
+			assert( get_item( store, i ) == foos[i] );
+		}
+		release_item( store, foos[i] );
+	}
+	assert( get_item( store, capacity ) == NULL );
+	for( int i=0; i<capacity; i++ ) {
+		assert( get_item( store, i ) == foos[i] );
+	}
+	s = cache_stats_snapshot( store );
+	print_stats( &s );
+	assert( s.hits == (uint64_t)(capacity / 2 + capacity) && s.misses == 1 );
+	assert( s.revives == (uint64_t)(capacity - capacity / 2) );
+	assert( s.pinned == (uint64_t)capacity && s.max_probes >= 1 && s.avg_probes > 0 );
+
+	// unpin all, the new (dirty) items push out every clean one and then one dirty one
+	for( int i=0; i<capacity; i++ ) {
+		release_item( store, foos[i] );
+		if( i < capacity / 2 ) {
+			release_item( store, foos[i] );
+		}
+	}
+	int num_clean = (capacity + 1) / 2;
+	for( int i=0; i<num_clean + 1; i++ ) {
+		add_and_release( store, capacity + 1 + i, 1 );
+	}
+	s = cache_stats_snapshot( store );
+	print_stats( &s );
+	assert( s.clean_evictions == (uint64_t)num_clean && s.dirty_evictions == 1 );
+	assert( s.stored == (uint64_t)capacity && s.pinned == 0 );
+
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+static int count_free_slots( cache* c ) {
+
+	int n = 0;
+	for( uint32_t slot = c->free_items; slot != NO_ENTRY; n++ ) {
+		memcpy( &slot, &c->items[slot], sizeof(uint32_t) );
+	}
+	return n;
+}
+
+static void test_image() {
+
+	printf("************** Test image ****************\n");
+	char path[] = "/tmp/cache_image_XXXXXX";
+	int fd = mkstemp( path );
+	assert( fd >= 0 );
+	close( fd );
+
+	// an empty file isn't an image yet
+	cache* store = open_cache_image( path, CACHE_MEMORY_BYTES );
+	assert( store && store->num_stored == 0 );
+	int capacity = store->capacity;
+	int num_slots = (int)store->num_items;
+	assert( count_free_slots( store ) == num_slots );
+
+	// half of them dirty, and the first quarter still pinned when it's closed
+	uint64_t allocs_before = __atomic_load_n( &item_allocs, __ATOMIC_RELAXED );
+	for( int i=0; i<capacity; i++ ) {
+		item* foo = cache_alloc_item( store, i, i * 3, i % 2 == 1 );
+		add_item( store, foo );
+		if( i >= capacity / 4 ) {
+			release_item( store, foo );
+		}
+	}
+	assert( __atomic_load_n( &item_allocs, __ATOMIC_RELAXED ) == allocs_before );
+	free_cache( store );
+
+	// all back, none pinned, on the lists their items say
+	store = open_cache_image( path, CACHE_MEMORY_BYTES );
+	assert( store->capacity == capacity && store->num_stored == capacity );
+	assert( store->num_available_clean + store->num_available_dirty == capacity );
+	assert( store->num_available_dirty == capacity / 2 );
+	check_lists( store );
+	assert( count_free_slots( store ) == num_slots - capacity );
+	for( int i=0; i<capacity; i++ ) {
+		item* foo = get_item( store, i );
+		assert( foo && foo->id == i && foo->value == i * 3 && foo->is_dirty == (i % 2 == 1) );
+		assert( in_image( store, foo ) );
+		release_item( store, foo );
+	}
+	assert( cache_stats_snapshot( store ).hits == (uint64_t)capacity );
+
+	// the slots of evicted items are reused, and dirty ones are written from a copy
+	FILE* f = tmpfile();
+	assert( f );
+	store->wb = new_write_back( f, 1 );
+	int num_dirty = capacity / 2;
+	for( int i=0; i<capacity * 3; i++ ) {
+		item* foo = cache_alloc_item( store, capacity + i, i, i % 3 == 0 );
+		add_item( store, foo );
+		release_item( store, foo );
+		num_dirty += i % 3 == 0;
+	}
+	drain_write_back( store->wb );
+	assert( store->wb->items_written == (uint64_t)(num_dirty - store->num_available_dirty) );
+	free_write_back( store->wb );
+	fclose( f );
+	store->wb = NULL;
+	check_lists( store );
+	assert( store->num_stored == capacity && count_free_slots( store ) == num_slots - capacity );
+
+	// items held outside the cache take the spare slots, then the ones of stored items
+	int spare = num_slots - capacity;
+	item* held[spare + 1];
+	for( int i=0; i<spare + 1; i++ ) {
+		held[i] = cache_alloc_item( store, -1 - i, 0, 0 );
+		assert( held[i] );
+	}
+	assert( store->num_stored == capacity - 1 );
+	check_lists( store );
+	for( int i=0; i<spare + 1; i++ ) {
+		release_item( store, held[i] );
+	}
+	assert( count_free_slots( store ) == num_slots - capacity + 1 );
+
+	// an item pointer that isn't a slot, and two entries with the same slot, only lose those entries
+	entry* bad = NULL;
+	entry* twice = NULL;
+	for( int n=0; n<capacity; n++ ) {
+		if( store->entries[n].item && bad == NULL ) {
+			bad = &store->entries[n];
+		} else if( store->entries[n].item && twice == NULL ) {
+			twice = &store->entries[n];
+		}
+	}
+	int bad_key = entry_key( bad );
+	int twice_key = entry_key( twice );
+	bad->item = (item*)( (char*)bad->item + 1 );
+	twice->item = store->entries[capacity - 1].item;
+	assert( twice != &store->entries[capacity - 1] );
+	free_cache( store );
+
+	store = open_cache_image( path, CACHE_MEMORY_BYTES );
+	assert( store->num_stored == capacity - 3 );
+	assert( get_item( store, bad_key ) == NULL && get_item( store, twice_key ) == NULL );
+	check_lists( store );
+	assert( count_free_slots( store ) == num_slots - store->num_stored );
+
+	// a header from something else starts over
+	store->image->magic = 0;
+	free_cache( store );
+	store = open_cache_image( path, CACHE_MEMORY_BYTES );
+	assert( store->num_stored == 0 && count_free_slots( store ) == num_slots );
+	item* foo = cache_alloc_item( store, 1, 1, 0 );
+	add_item( store, foo );
+	release_item( store, foo );
+	free_cache( store );
+
+	// and so does another budget
+	store = open_cache_image( path, CACHE_MEMORY_BYTES * 2 );
+	assert( store->capacity > capacity && store->num_stored == 0 );
+	free_cache( store );
+
+	unlink( path );
+
+}
+
+// keys on a list from the newest to the oldest
+static int list_keys( cache* c, entry* head, int* keys ) {
+
+	int n = 0;
+	entry* current = head;
+	if( current ) {
+		do {
+			keys[n++] = entry_key( current );
+			current = next_in_list( c, current );
+		} while( current != head );
+	}
+	return n;
+}
+
+// a snapshot restores every item, on the same list in the same order
+static void test_snapshot() {
+
+	printf("************** Test snapshot ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	int capacity = store->capacity;
+	item* foos[capacity];
+	for( int i=0; i<capacity; i++ ) {
+		foos[i] = Item( i, i * 3, i % 3 == 0 );
+		add_item( store, foos[i] );
+	}
+	// not in key order, and the last one is still pinned
+	for( int i=capacity - 2; i>=0; i-=2 ) {
+		release_item( store, foos[i] );
+	}
+	for( int i=capacity - 3; i>=0; i-=2 ) {
+		release_item( store, foos[i] );
+	}
+	FILE* file = tmpfile();
+	assert( file );
+	int fd = fileno( file );
+	assert( cache_snapshot( store, fd ) );
+	// same place in the lists as the restored one
+	release_item( store, foos[capacity - 1] );
+
+	cache* restored = new_cache( CACHE_MEMORY_BYTES );
+	lseek( fd, 0, SEEK_SET );
+	assert( cache_restore( restored, fd ) );
+	check_lists( restored );
+	assert( restored->num_stored == capacity && cache_stats_snapshot( restored ).pinned == 0 );
+	int keys[capacity], restored_keys[capacity];
+	int n = list_keys( store, store->available_clean_entries, keys );
+	assert( list_keys( restored, restored->available_clean_entries, restored_keys ) == n && memcmp( keys, restored_keys, (size_t)n * sizeof(int) ) == 0 );
+	n = list_keys( store, store->available_dirty_entries, keys );
+	assert( list_keys( restored, restored->available_dirty_entries, restored_keys ) == n && memcmp( keys, restored_keys, (size_t)n * sizeof(int) ) == 0 );
+	for( int i=0; i<capacity; i++ ) {
+		item* foo = get_item( restored, i );
+		assert( foo && foo != foos[i] && foo->value == i * 3 && foo->is_dirty == (i % 3 == 0) );
+		release_item( restored, foo );
+	}
+	flush_cache( restored );
+	free_cache( restored );
+
+	// CLOCK has the pinned entries on its lists too. They're in the file once, and all the restored
+	// ones are on the clock
+	cache* clock = new_cache( CACHE_MEMORY_BYTES );
+	clock->policy = POLICY_CLOCK;
+	for( int i=0; i<clock->capacity; i++ ) {
+		add_and_release( clock, i, i % 2 );
+	}
+	item* pinned = get_item( clock, 0 );
+	FILE* clock_file = tmpfile();
+	assert( clock_file && cache_snapshot( clock, fileno( clock_file ) ) );
+	release_item( clock, pinned );
+	restored = new_cache( CACHE_MEMORY_BYTES );
+	restored->policy = POLICY_CLOCK;
+	lseek( fileno( clock_file ), 0, SEEK_SET );
+	assert( cache_restore( restored, fileno( clock_file ) ) );
+	check_lists( restored );
+	assert( restored->num_stored == clock->capacity && cache_stats_snapshot( restored ).pinned == 0 );
+	add_and_release( restored, clock->capacity, 0 );
+	assert( restored->num_stored == clock->capacity );
+	fclose( clock_file );
+	flush_cache( restored );
+	free_cache( restored );
+	flush_cache( clock );
+	free_cache( clock );
+
+	// a smaller cache skips the start of the file (the oldest clean one is first), and an image cache puts them in its slots
+	char path[] = "/tmp/cache_image_XXXXXX";
+	int image_fd = mkstemp( path );
+	assert( image_fd >= 0 );
+	close( image_fd );
+	restored = open_cache_image( path, CACHE_MEMORY_BYTES / 2 );
+	lseek( fd, 0, SEEK_SET );
+	assert( cache_restore( restored, fd ) );
+	check_lists( restored );
+	assert( restored->capacity < capacity && restored->num_stored == restored->capacity );
+	item* newest = get_item( restored, capacity - 1 );
+	assert( newest && in_image( restored, newest ) );
+	assert( get_item( restored, entry_key( prev_in_list( store, store->available_clean_entries ) ) ) == NULL );
+	release_item( restored, newest );
+	flush_cache( restored );
+	free_cache( restored );
+	unlink( path );
+
+	// more dirty ones than fit: none are skipped, the oldest are evicted like in add_item (so written)
+	cache* dirty_store = new_cache( 16 * CACHE_MEMORY_BYTES );
+	int num_items = dirty_store->capacity;
+	for( int i=0; i<num_items; i++ ) {
+		add_and_release( dirty_store, i, i % 4 != 0 );
+	}
+	FILE* dirty_file = tmpfile();
+	assert( dirty_file && cache_snapshot( dirty_store, fileno( dirty_file ) ) );
+	restored = new_cache( 8 * CACHE_MEMORY_BYTES );
+	lseek( fileno( dirty_file ), 0, SEEK_SET );
+	assert( cache_restore( restored, fileno( dirty_file ) ) );
+	check_lists( restored );
+	int num_dirty = num_items - (num_items + 3) / 4;
+	assert( restored->capacity < num_dirty );
+	assert( restored->num_stored == restored->capacity && restored->num_available_dirty == restored->capacity );
+	assert( restored->stats.dirty_evictions == (uint64_t)(num_dirty - restored->capacity) && restored->eviction_writes == restored->stats.dirty_evictions );
+	newest = get_item( restored, num_items % 4 == 1 ? num_items - 2 : num_items - 1 );
+	assert( newest && newest->is_dirty );
+	release_item( restored, newest );
+	fclose( dirty_file );
+	flush_cache( restored );
+	free_cache( restored );
+	flush_cache( dirty_store );
+	free_cache( dirty_store );
+
+	// damaged or cut short, the block with the damage isn't used
+	restored = new_cache( CACHE_MEMORY_BYTES );
+	uint8_t byte;
+	off_t damage = (off_t)(sizeof(snapshot_header) + sizeof(snapshot_block) + 5);
+	assert( pread( fd, &byte, 1, damage ) == 1 );
+	byte ^= 1;
+	assert( pwrite( fd, &byte, 1, damage ) == 1 );
+	lseek( fd, 0, SEEK_SET );
+	assert( !cache_restore( restored, fd ) && restored->num_stored == 0 );
+	byte ^= 1;
+	assert( pwrite( fd, &byte, 1, damage ) == 1 );
+	assert( ftruncate( fd, lseek( fd, 0, SEEK_END ) - 1 ) == 0 );
+	lseek( fd, 0, SEEK_SET );
+	assert( !cache_restore( restored, fd ) && restored->num_stored == 0 );
+	assert( ftruncate( fd, 0 ) == 0 );
+	lseek( fd, 0, SEEK_SET );
+	assert( !cache_restore( restored, fd ) );
+	fclose( file );
+
+	free_cache( restored );
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+static item* add_sized( cache* c, int key, int size, bool is_dirty ) {
+
+	item* foo = Item( key, key, is_dirty );
+	foo->size = size;
+	add_item( c, foo );
+	return foo;
+}
+
+// with a byte budget add_item evicts by size, clean first, and can't evict pinned bytes
+static void test_byte_budget() {
+
+	printf("************** Test byte budget ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES * 16 );
+	set_byte_budget( store, 1000 );
+	assert( store->capacity > 20 );
+
+	// the odd ones dirty
+	for( int i=0; i<10; i++ ) {
+		release_item( store, add_sized( store, i, 100, i % 2 == 1 ) );
+	}
+	cache_stats s = cache_stats_snapshot( store );
+	assert( s.stored == 10 && s.bytes == 1000 && s.pinned_bytes == 0 );
+
+	// needs three to go, the oldest clean ones
+	release_item( store, add_sized( store, 10, 250, 0 ) );
+	check_lists( store );
+	s = cache_stats_snapshot( store );
+	assert( s.stored == 8 && s.bytes == 950 && s.clean_evictions == 3 && s.dirty_evictions == 0 );
+	assert( !find_entry( store, 0 ) && !find_entry( store, 2 ) && !find_entry( store, 4 ) && find_entry( store, 6 ) );
+
+	// everything pinned: no room, and nothing is evicted for it
+	item* pinned[11];
+	int num_pinned = 0;
+	for( int i=0; i<=10; i++ ) {
+		if( (pinned[num_pinned] = get_item( store, i )) ) {
+			num_pinned++;
+		}
+	}
+	item* big = Item( 11, 11, 0 );
+	big->size = 200;
+	assert( !add_item( store, big ) );
+	release_item( store, big );
+	s = cache_stats_snapshot( store );
+	assert( s.stored == 8 && s.pinned_bytes == 950 && s.rejections == 1 );
+
+	// with half of them released there's room, and the dirty ones go once the clean ones are gone
+	for( int i=0; i<num_pinned; i+=2 ) {
+		release_item( store, pinned[i] );
+	}
+	check_lists( store );
+	s = cache_stats_snapshot( store );
+	release_item( store, add_sized( store, 12, 1000 - (int)s.pinned_bytes, 1 ) );
+	check_lists( store );
+	s = cache_stats_snapshot( store );
+	assert( s.bytes == 1000 && s.stored == (uint64_t)(num_pinned / 2 + 1) && s.dirty_evictions > 0 );
+	for( int i=1; i<num_pinned; i+=2 ) {
+		release_item( store, pinned[i] );
+	}
+
+	// one that's bigger than the budget never fits
+	big = Item( 13, 13, 0 );
+	big->size = 1001;
+	assert( !add_item( store, big ) );
+	release_item( store, big );
+	print_stats( &s );
+
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+// evicted clean items go to the tier and a miss gets them back, the oldest segments go when it's full
+static void test_tier() {
+
+	printf("************** Test spill tier ****************\n");
+	FILE* f = tmpfile();
+	assert( f );
+	spill_tier* tier = new_spill_tier( fileno( f ), 4 * SPILL_SEGMENT_BYTES );
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	store->tier = tier;
+	int capacity = store->capacity;
+
+	// the first capacity are pushed out by the next capacity
+	for( int k=0; k<2 * capacity; k++ ) {
+		add_and_release( store, k, 0 );
+	}
+	assert( tier->stored == (uint32_t)capacity && tier->spills == (uint64_t)capacity );
+	item* i = get_item( store, 0 );
+	assert( i && i->id == 0 && i->value == 0 && store->stats.tier_hits == 1 && store->stats.misses == 1 );
+	// it's in memory now, and the item it pushed out is in the tier instead
+	assert( find_entry( store, 0 ) && tier->stored == (uint32_t)capacity );
+	uint32_t* link = tier_link( tier, 0 );
+	assert( *link == NO_ENTRY );
+	release_item( store, i );
+	check_lists( store );
+
+	// dirty ones don't go there (clean ones go first, so it takes a cache full of dirty ones)
+	add_and_release( store, 5000, 1 );
+	for( int k=0; k<capacity; k++ ) {
+		add_and_release( store, 6000 + k, 1 );
+	}
+	assert( find_entry( store, 5000 ) == NULL && *tier_link( tier, 5000 ) == NO_ENTRY );
+
+	// a new item for a key drops what the tier had for it
+	int key = 1;
+	assert( find_entry( store, key ) == NULL && *tier_link( tier, key ) != NO_ENTRY );
+	i = Item( key, 42, 0 );
+	add_item( store, i );
+	release_item( store, i );
+	assert( *tier_link( tier, key ) == NO_ENTRY );
+	for( int k=0; k<capacity; k++ ) {
+		add_and_release( store, 7000 + k, 0 );
+	}
+	i = get_item( store, key );
+	assert( i && i->value == 42 );
+	release_item( store, i );
+
+	// past the budget the oldest segments go, the records in the file read back the same as the open ones
+	// (the newest segment's worth, the items these gets push out don't get round to those)
+	int first = 10000, num_keys = 5 * SPILL_SEGMENT + capacity;
+	for( int k=first; k<first + num_keys; k++ ) {
+		add_and_release( store, k, 0 );
+	}
+	assert( tier->segments_written >= 5 && tier->reclaimed > 0 && tier->stored <= tier->num_slots );
+	assert( get_item( store, first ) == NULL );
+	int from_file = 0;
+	uint64_t hits = store->stats.tier_hits;
+	for( int k=first + num_keys - 1; k>=first + num_keys - SPILL_SEGMENT; k-- ) {
+		from_file += *tier_link( tier, k ) != NO_ENTRY && *tier_link( tier, k ) < tier->write_slot - tier->write_slot % SPILL_SEGMENT;
+		i = get_item( store, k );
+		assert( i && i->id == k && i->value == k );
+		release_item( store, i );
+	}
+	assert( from_file > 0 && store->stats.tier_hits > hits );
+	check_lists( store );
+	assert( tier->errors == 0 );
+
+	flush_cache( store );
+	free_cache( store );
+	free_spill_tier( tier );
+	fclose( f );
+
+}
+
+// a handle releases the entry it pinned without a lookup, and one that outlived its pin is refused
+static void test_handles() {
+
+	printf("************** Test handles ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	assert( get_handle( store, 1 ).item == NULL );
+	for( int i=0; i<store->capacity; i++ ) {
+		add_and_release( store, i, i % 2 );
+	}
+	cache_handle h = get_handle( store, 1 );
+	assert( h.item && h.item->id == 1 );
+	cache_handle again = get_handle( store, 1 );
+	assert( again.item == h.item && again.entry == h.entry && again.generation == h.generation );
+	entry* e = &store->entries[h.entry];
+	assert( e->refcount == 2 );
+	cache_stats before = cache_stats_snapshot( store );
+	assert( release_handle( store, again ) && e->refcount == 1 );
+	assert( release_handle( store, h ) && e->refcount == 0 );
+	cache_stats after = cache_stats_snapshot( store );
+	assert( after.hits == before.hits && after.misses == before.misses && after.probes == before.probes );
+	check_lists( store );
+
+	// released already
+	assert( !release_handle( store, h ) && e->refcount == 0 );
+
+	// and the entry has a new item since (dirty ones, or the clean ones would only push out each other)
+	for( int i=store->capacity; i<store->capacity * 2; i++ ) {
+		add_and_release( store, i, 1 );
+	}
+	assert( e->item && entry_key( e ) >= store->capacity );
+	cache_handle newer = get_handle( store, entry_key( e ) );
+	assert( newer.entry == h.entry );
+#ifndef COMPACT_ENTRIES
+	// (without a generation it depends on where the new item was allocated)
+	assert( newer.generation != h.generation );
+	assert( !release_handle( store, h ) && e->refcount == 1 );
+#endif
+	assert( release_handle( store, newer ) && e->refcount == 0 );
+	check_lists( store );
+
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+// a full cache only takes a key that was asked for more often than the one it would evict
+static void test_admission() {
+
+	printf("************** Test admission ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	set_admission( store, 1 );
+	int capacity = store->capacity;
+	// not full yet, so everything gets in
+	for( int i=0; i<capacity; i++ ) {
+		add_and_release( store, i, 0 );
+	}
+	for( int n=0; n<2; n++ ) {
+		for( int i=0; i<capacity; i++ ) {
+			release_item( store, get_item( store, i ) );
+		}
+	}
+	assert( store->num_stored == capacity && store->stats.not_admitted == 0 );
+
+	// used once
+	int once = 1000;
+	assert( get_item( store, once ) == NULL );
+	item* i = Item( once, once, 0 );
+	assert( !add_item( store, i ) );
+	release_item( store, i );
+	assert( store->stats.not_admitted == 1 && store->stats.rejections == 0 );
+	assert( find_entry( store, once ) == NULL && store->num_stored == capacity );
+	check_lists( store );
+
+	// used more than the oldest one, which goes
+	int often = 2000;
+	for( int n=0; n<5; n++ ) {
+		assert( get_item( store, often ) == NULL );
+	}
+	int victim = entry_key( pick_victim( store, 0 ) );
+	i = Item( often, often, 0 );
+	assert( add_item( store, i ) );
+	release_item( store, i );
+	assert( find_entry( store, often ) && find_entry( store, victim ) == NULL );
+	assert( store->stats.not_admitted == 1 && store->stats.clean_evictions == 1 );
+	check_lists( store );
+
+	// the counts halve after SKETCH_SAMPLE gets per entry
+	frequency_sketch* sketch = store->admission;
+	int estimate = sketch_estimate( sketch, hash( often ) );
+	assert( estimate >= 5 );
+	while( sketch->halvings == 0 ) {
+		record_access( store, 3000 );
+	}
+	assert( sketch_estimate( sketch, hash( often ) ) == estimate / 2 );
+	assert( sketch_estimate( sketch, hash( 3000 ) ) == 7 );
+
+	// off, the one hit wonder gets in after all
+	set_admission( store, 0 );
+	add_and_release( store, once, 0 );
+	assert( find_entry( store, once ) && store->stats.not_admitted == 1 );
+
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+#ifdef TRACE_RING
+// the ring has every operation in order, run after test_threads to check that nothing
+// it recorded from many threads at once was torn
+static void test_trace_ring() {
+
+	printf("************** Test the trace ring ****************\n");
+	trace_event* events = (trace_event*) malloc( TRACE_RING_SIZE * sizeof(trace_event) );
+	size_t count = trace_read( events, TRACE_RING_SIZE );
+	assert( count > 0 );
+	for( size_t n=0; n<count; n++ ) {
+		assert( events[n].type < NUM_TRACE_TYPES );
+		assert( n == 0 || events[n].seq > events[n-1].seq );
+	}
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	trace_reset();
+	item* foo = Item( 1, 1, 1 );
+	add_item( store, foo );
+	assert( get_item( store, 1 ) == foo );
+	assert( get_item( store, 2 ) == NULL );
+	release_item( store, foo );
+	release_item( store, foo );
+	// push it out
+	for( int i=0; i<store->capacity; i++ ) {
+		add_and_release( store, 100 + i, 1 );
+	}
+	trace_dump( stdout );
+
+	count = trace_read( events, TRACE_RING_SIZE );
+	trace_type expected[] = { TRACE_ADD, TRACE_HIT, TRACE_MISS, TRACE_RELEASE, TRACE_RELEASE };
+	for( size_t n=0; n<5; n++ ) {
+		assert( events[n].seq == n + 1 );
+		assert( events[n].type == expected[n] );
+		assert( events[n].a == (expected[n] == TRACE_MISS ? 2u : 1u) );
+	}
+	assert( events[1].b == 2 && events[4].b == 0 );
+	bool evicted = 0;
+	for( size_t n=5; n<count; n++ ) {
+		evicted |= events[n].type == TRACE_EVICT && events[n].a == 1 && events[n].b == 1;
+	}
+	assert( evicted );
+
+	free( events );
+	flush_cache( store );
+	free_cache( store );
+
+}
+#endif
+
+// to keep track of unreleased items
+typedef struct item_list {
 	item* i;
 	struct item_list* next;
 } item_list;
 
-static void test_sim() {
-	
-	printf("************** Test simulating real usage ****************\n");
-	cache* store = new_cache();
-	item_list* item_queue = NULL;
+static void test_sim() {
+	
+	printf("************** Test simulating real usage ****************\n");
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	item_list* item_queue = NULL;
+
+	int num_items = store->capacity * 2;
+	for( int i=0; i<100; i++ ) {
+		int key = rand() % num_items;
+		item* f = get_item( store, key );
+		printf("Item %d from the cache: %s\n", key, f ? "true" : "false");
+		if( !f ) {
+			f = Item( key, rand() % 256, 0 );
+			item_list* il = (item_list*)malloc( sizeof(item_list) );
+			il->i = f;
+			il->next = item_queue;
+			item_queue = il;
+			// stick it in the cache, and forget about it
+			add_item( store, f );
+		}
+		// maybe do some work and change this item with 20% chance
+		f->is_dirty = rand() % 10 < 2;
+		// maybe release some item
+		if( item_queue && rand() % 10 < 4 ) {
+			item_list* head = item_queue;
+			item* tofree = head->i;
+			item_queue = head->next;
+			free(head);
+			release_item( store, tofree );
+		}
+	}
+	dump( store );
+	// free all remaining stuff
+	while( item_queue ) {
+		item_list* head = item_queue;
+		item* tofree = head->i;
+		item_queue = head->next;
+		free(head);
+		release_item( store, tofree );
+	}
+	printf("After freeing outstanding items\n");
+	dump( store );
+	flush_cache( store );	
+	free_cache( store );
+
+}
+
+typedef struct thread_params {
+	sharded_cache* store;
+	int num_keys;
+	int num_ops;
+	bool repin;
+	bool handles; // get and release through handles where it can
+	bool front; // or through the thread's front cache (sharded_use_front)
+	unsigned int seed;
+	int gets;
+} thread_params;
+
+// random get (or load + add) and release, always has to come back with the item for the key it asked for
+static void* cache_worker( void* params ) {
+
+	thread_params* p = (thread_params*) params;
+	for( int n=0; n<p->num_ops; n++ ) {
+		int key = rand_r( &p->seed ) % p->num_keys;
+		cache_handle h = { .item = NULL };
+		item* i;
+		if( p->front ) {
+			i = front_get_item( p->store, key );
+		} else if( p->handles ) {
+			h = sharded_get_handle( p->store, key );
+			i = h.item;
+		} else {
+			i = sharded_get_item( p->store, key );
+		}
+		p->gets++;
+		if( i == NULL ) {
+			i = sharded_add_item( p->store, Item( key, key, rand_r( &p->seed ) % 2 == 0 ) );
+		}
+		assert( i->id == key && i->value == key );
+		if( p->repin && rand_r( &p->seed ) % 2 == 0 ) {
+			// pinned already, so this is the lock free path (unless i didn't fit in the cache)
+			if( p->front ) {
+				item* again = front_get_item( p->store, key );
+				p->gets++;
+				if( again ) {
+					assert( again->id == key );
+					front_release_item( p->store, again );
+				}
+			} else if( p->handles ) {
+				cache_handle again = sharded_get_handle( p->store, key );
+				p->gets++;
+				if( again.item ) {
+					assert( again.item->id == key );
+					assert( sharded_release_handle( p->store, again ) );
+				}
+			} else {
+				item* again = sharded_get_item( p->store, key );
+				p->gets++;
+				if( again ) {
+					assert( again->id == key );
+					sharded_release_item( p->store, again );
+				}
+			}
+		}
+		if( h.item ) {
+			assert( sharded_release_handle( p->store, h ) );
+		} else if( p->front ) {
+			front_release_item( p->store, i );
+		} else {
+			sharded_release_item( p->store, i );
+		}
+	}
+	// the hits in the front never got to the shards
+	if( p->front ) {
+		p->gets -= (int)thread_front( p->store )->hits;
+	}
+
+	return NULL;
+}
+
+static void test_threads() {
+
+	printf("************** Test sharded cache from multiple threads ****************\n");
+	sharded_cache* store = new_sharded_cache( 4, 4 * CACHE_MEMORY_BYTES );
+	FILE* f = tmpfile();
+	write_back* wb = new_write_back( f, 1 );
+	sharded_set_write_back( store, wb );
+	// the policy that uses the hits from the lock free path the most
+	for( int s=0; s<store->num_shards; s++ ) {
+		store->shards[s].c->policy = POLICY_2Q;
+	}
+	cleaner* cl = start_cleaner( store, 50, 8, 100 );
+	sharded_use_front( store, FRONT_SLOTS );
+
+	pthread_t threads[4];
+	thread_params params[4];
+	for( int t=0; t<4; t++ ) {
+		// twice as many keys as fit, so there's plenty of recycling (and full shards). The
+		// thread with a front flushes it when it exits, so nothing is pinned after the join
+		params[t] = (thread_params){ .store = store, .num_keys = sharded_capacity( store ) * 2, .num_ops = 1000, .repin = 1, .handles = t % 2, .front = t == 2, .seed = (unsigned int)rand() };
+		pthread_create( &threads[t], NULL, cache_worker, &params[t] );
+	}
+	for( int t=0; t<4; t++ ) {
+		pthread_join( threads[t], NULL );
+	}
+	stop_cleaner( cl );
+	uint64_t eviction_writes, cleaner_writes;
+	sharded_write_counts( store, &eviction_writes, &cleaner_writes );
+	printf("Eviction writes %llu, cleaner writes %llu\n", (unsigned long long)eviction_writes, (unsigned long long)cleaner_writes );
+	cache_stats stats = sharded_stats_snapshot( store );
+	print_stats( &stats );
+	int gets = 0;
+	for( int t=0; t<4; t++ ) {
+		gets += params[t].gets;
+	}
+	assert( stats.hits + stats.misses == (uint64_t)gets );
+	assert( stats.pinned == 0 && stats.stored == (uint64_t)sharded_capacity( store ) );
+
+	// everything was released, so nothing can be pinned
+	for( int s=0; s<store->num_shards; s++ ) {
+		dump( store->shards[s].c );
+		for( int e=0; e<store->shards[s].c->capacity; e++ ) {
+			assert( store->shards[s].c->entries[e].refcount == 0 );
+		}
+	}
+
+	free_sharded_cache( store );
+	drain_write_back( wb );
+	fseek( f, 0, SEEK_END );
+	assert( (uint64_t)ftell( f ) == wb->items_written * sizeof(record) );
+	assert( wb->items_written >= eviction_writes + cleaner_writes );
+	free_write_back( wb );
+	fclose( f );
+}
+
+static void* front_thread( void* params ) {
+
+	sharded_cache* sc = (sharded_cache*) params;
+	item* i = front_get_item( sc, 3 );
+	assert( i && front_get_item( sc, 3 ) == i );
+	front_release_item( sc, i );
+	front_release_item( sc, i );
+	// the front still pins it
+	assert( find_entry( get_shard( sc, 3 )->c, 3 )->refcount == 1 );
+	return NULL;
+}
+
+// hits in the front leave the shared refcount alone, and the uses go back to it when the slot is taken
+static void test_front() {
+
+	printf("************** Test front cache ****************\n");
+	sharded_cache* sc = new_sharded_cache( 2, 4 * CACHE_MEMORY_BYTES );
+	sharded_use_front( sc, FRONT_SLOTS );
+	int capacity = sharded_capacity( sc );
+	// a key for the same front slot as 1
+	int other = 2;
+	while( (hash( other ) & (FRONT_SLOTS - 1)) != (hash( 1 ) & (FRONT_SLOTS - 1)) ) {
+		other++;
+	}
+	sharded_release_item( sc, sharded_add_item( sc, Item( 1, 1, 0 ) ) );
+	sharded_release_item( sc, sharded_add_item( sc, Item( other, other, 0 ) ) );
+
+	entry* e = find_entry( get_shard( sc, 1 )->c, 1 );
+	item* i = front_get_item( sc, 1 );
+	assert( i && i->id == 1 && e->refcount == 1 );
+	assert( front_get_item( sc, 1 ) == i && front_get_item( sc, 1 ) == i );
+	front_cache* f = thread_front( sc );
+	assert( f->hits == 2 && f->misses == 1 && e->refcount == 1 );
+
+	// the slot's own pin was one of the 3
+	item* o = front_get_item( sc, other );
+	assert( o && o->id == other && e->refcount == 3 );
+	// so it stays whatever comes after it
+	for( int k=0; k<2 * capacity; k++ ) {
+		sharded_release_item( sc, sharded_add_item( sc, Item( 1000 + k, k, 0 ) ) );
+	}
+	assert( find_entry( get_shard( sc, 1 )->c, 1 ) == e && e->item == i );
+	for( int n=0; n<3; n++ ) {
+		front_release_item( sc, i );
+	}
+	assert( e->refcount == 0 );
+
+	entry* oe = find_entry( get_shard( sc, other )->c, other );
+	front_release_item( sc, o );
+	assert( oe->refcount == 1 );
+	front_flush( sc );
+	assert( oe->refcount == 0 );
+
+	// a thread's front is flushed when it exits
+	sharded_release_item( sc, sharded_add_item( sc, Item( 3, 3, 0 ) ) );
+	pthread_t t;
+	pthread_create( &t, NULL, front_thread, sc );
+	pthread_join( t, NULL );
+	assert( sharded_stats_snapshot( sc ).pinned == 0 );
+
+	free_sharded_cache( sc );
+
+}
+
+typedef struct load_ctx {
+	int calls;
+	int sleep_us; // a slow backing store
+	bool odd_missing; // odd keys aren't in the backing store
+} load_ctx;
+
+static item* test_loader( int key, void* ctx ) {
+
+	load_ctx* l = (load_ctx*) ctx;
+	__atomic_fetch_add( &l->calls, 1, __ATOMIC_RELAXED );
+	if( l->sleep_us ) {
+		struct timespec ts = { .tv_sec = 0, .tv_nsec = l->sleep_us * 1000L };
+		nanosleep( &ts, NULL );
+	}
+	if( l->odd_missing && key % 2 ) {
+		return NULL;
+	}
+	return Item( key, key, 0 );
+}
+
+typedef struct load_params {
+	sharded_cache* store;
+	load_ctx* ctx;
+	int key; // -1 for random keys
+	int num_keys;
+	int num_ops;
+	unsigned int seed;
+	item* result;
+	bool naive; // get, and load and add on a miss, like before get_or_load (for the benchmark)
+} load_params;
 
-	int num_items = CACHE_SIZE * 2;
-	for( int i=0; i<100; i++ ) {
-		int key = rand() % num_items;
-		item* f = get_item( store, key );
-		printf("Item %d from the cache: %s\n", key, f ? "true" : "false");
-		if( !f ) {
-			f = Item( key, rand() % 256, 0 );
-			item_list* il = (item_list*)malloc( sizeof(item_list) );
-			il->i = f;
-			il->next = item_queue;
-			item_queue = il;
-			// stick it in the cache, and forget about it
-			add_item( store, f );
+static void* load_worker( void* params ) {
+
+	load_params* p = (load_params*) params;
+	for( int n=0; n<p->num_ops; n++ ) {
+		int key = p->key >= 0 ? p->key : rand_r( &p->seed ) % p->num_keys;
+		item* i = sharded_get_or_load( p->store, key, test_loader, p->ctx );
+		if( p->ctx->odd_missing && key % 2 ) {
+			assert( i == NULL );
+			continue;
 		}
-		// maybe do some work and change this item with 20% chance
-		f->is_dirty = rand() % 10 < 2;
-		// maybe release some item
-		if( item_queue && rand() % 10 < 4 ) {
-			item_list* head = item_queue;
-			item* tofree = head->i;
-			item_queue = head->next;
-			free(head);
-			release_item( store, tofree );
+		assert( i && i->id == key );
+		if( p->key >= 0 ) {
+			// keep it pinned, to compare
+			p->result = i;
+		} else {
+			sharded_release_item( p->store, i );
 		}
 	}
-	dump( store );
-	// free all remaining stuff
-	while( item_queue ) {
-		item_list* head = item_queue;
-		item* tofree = head->i;
-		item_queue = head->next;
-		free(head);
-		release_item( store, tofree );
+	return NULL;
+}
+
+static void test_get_or_load() {
+
+	printf("************** Test get or load ****************\n");
+
+	// every thread misses on the same key at once, one of them loads it
+	sharded_cache* store = new_sharded_cache( 4, 4 * CACHE_MEMORY_BYTES );
+	load_ctx slow = { .calls = 0, .sleep_us = 20000 };
+	pthread_t threads[8];
+	load_params params[8];
+	for( int t=0; t<8; t++ ) {
+		params[t] = (load_params){ .store = store, .ctx = &slow, .key = 8, .num_ops = 1 };
+		pthread_create( &threads[t], NULL, load_worker, &params[t] );
 	}
-	printf("After freeing outstanding items\n");
-	dump( store );
-	flush_cache( store );	
-	free( store );
+	for( int t=0; t<8; t++ ) {
+		pthread_join( threads[t], NULL );
+	}
+	assert( slow.calls == 1 );
+	shard* s = get_shard( store, 8 );
+	entry* e = find_entry( s->c, 8 );
+	assert( e && e->refcount == 8 );
+	for( int t=0; t<8; t++ ) {
+		assert( params[t].result == e->item );
+		sharded_release_item( store, params[t].result );
+	}
+	cache_stats stats = sharded_stats_snapshot( store );
+	print_stats( &stats );
+	assert( stats.loads == 1 && stats.pinned == 0 );
+
+	// and with lots of keys, some that can't be loaded
+	load_ctx fast = { .calls = 0, .odd_missing = 1 };
+	for( int t=0; t<4; t++ ) {
+		params[t] = (load_params){ .store = store, .ctx = &fast, .key = -1, .num_keys = sharded_capacity( store ) * 2, .num_ops = 1000, .seed = (unsigned int)rand() };
+		pthread_create( &threads[t], NULL, load_worker, &params[t] );
+	}
+	for( int t=0; t<4; t++ ) {
+		pthread_join( threads[t], NULL );
+	}
+	stats = sharded_stats_snapshot( store );
+	print_stats( &stats );
+	assert( stats.loads == (uint64_t)fast.calls + 1 && stats.pinned == 0 );
+	free_sharded_cache( store );
+
+	// an item that didn't fit is still returned, and freed on release
+	store = new_sharded_cache( 1, CACHE_MEMORY_BYTES );
+	int capacity = sharded_capacity( store );
+	load_ctx all = { .calls = 0 };
+	for( int key=0; key<capacity; key++ ) {
+		assert( sharded_get_or_load( store, key, test_loader, &all ) );
+	}
+	uint64_t frees = item_frees;
+	item* extra = sharded_get_or_load( store, capacity + 1, test_loader, &all );
+	assert( extra && extra->id == capacity + 1 );
+	assert( find_item_entry( store->shards[0].c, extra ) == NULL );
+	sharded_release_item( store, extra );
+	assert( item_frees == frees + 1 );
+	for( int key=0; key<capacity; key++ ) {
+		sharded_release_item( store, store->shards[0].c->entries[key].item );
+	}
+	free_sharded_cache( store );
+
+}
+
+/********************** BENCHMARK *****************************/
+
+#ifdef BENCHMARK
+
+static double now_seconds() {
+
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// total get/release pairs per second over all threads (wall clock, run_benchmark measures cpu time)
+// with pin_keys every key is held by the main thread, so the workers only use the lock free path
+// hot_keys 0 is keys for half the capacity
+static double thread_throughput( int num_shards, int num_threads, int total_ops, bool pin_keys, int hot_keys, bool front ) {
+
+	sharded_cache* store = new_sharded_cache( num_shards, CACHE_MEMORY_BYTES );
+	if( front ) {
+		sharded_use_front( store, FRONT_SLOTS );
+	}
+
+	int num_keys = hot_keys ? hot_keys : sharded_capacity( store ) / 2;
+	item* pinned[num_keys];
+	for( int k=0; k<num_keys && pin_keys; k++ ) {
+		pinned[k] = sharded_add_item( store, Item( k, k, 0 ) );
+	}
+
+	pthread_t threads[num_threads];
+	thread_params params[num_threads];
+	double start = now_seconds();
+	for( int t=0; t<num_threads; t++ ) {
+		// at most half the capacity, so after warming up this is (almost) all hits
+		params[t] = (thread_params){ .store = store, .num_keys = num_keys, .num_ops = total_ops / num_threads, .front = front, .seed = (unsigned int)t + 1 };
+		pthread_create( &threads[t], NULL, cache_worker, &params[t] );
+	}
+	for( int t=0; t<num_threads; t++ ) {
+		pthread_join( threads[t], NULL );
+	}
+	double seconds = now_seconds() - start;
+
+	for( int k=0; k<num_keys && pin_keys; k++ ) {
+		sharded_release_item( store, pinned[k] );
+	}
+	free_sharded_cache( store );
+
+	return (double)total_ops / seconds;
+}
+
+static void run_thread_benchmark() {
+
+	printf("threads\t1 shard ops/s\t64 shards ops/s\t64 shards, pinned ops/s\t32 keys ops/s\t32 keys, front ops/s\n");
+	for( int threads=1; threads<=32; threads*=2 ) {
+		double global_lock = thread_throughput( 1, threads, 4 * 1000 * 1000, 0, 0, 0 );
+		double sharded = thread_throughput( 64, threads, 4 * 1000 * 1000, 0, 0, 0 );
+		double pinned = thread_throughput( 64, threads, 4 * 1000 * 1000, 1, 0, 0 );
+		double hot = thread_throughput( 64, threads, 4 * 1000 * 1000, 0, 32, 0 );
+		double front = thread_throughput( 64, threads, 4 * 1000 * 1000, 0, 32, 1 );
+		printf("%d\t%.0f\t%.0f\t%.0f\t\t\t%.0f\t%.0f\n", threads, global_lock, sharded, pinned, hot, front );
+	}
+
+}
+
+static int compare_doubles( const void* a, const void* b ) {
+
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// add (and release) new items into a cache full of dirty ones, so every add evicts a dirty item.
+// Fills in the add latency p50, p99, p99.9 and max in ns, and the total adds/s
+static void write_back_latency( bool async, double* results ) {
+
+	FILE* f = tmpfile();
+	write_back* wb = new_write_back( f, async );
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	store->wb = wb;
+	for( int i=0; i<store->capacity; i++ ) {
+		item* foo = Item( i, i, 1 );
+		add_item( store, foo );
+		release_item( store, foo );
+	}
+
+	int num_adds = 500 * 1000;
+	double* latency = (double*) malloc( (size_t)num_adds * sizeof(double) );
+	double start = now_seconds();
+	for( int n=0; n<num_adds; n++ ) {
+		int key = store->capacity + n;
+		double t = now_seconds();
+		item* foo = Item( key, key, 1 );
+		add_item( store, foo );
+		release_item( store, foo );
+		latency[n] = (now_seconds() - t) * 1e9;
+	}
+	drain_write_back( wb );
+	double seconds = now_seconds() - start;
+	assert( wb->items_written == (uint64_t)num_adds );
+	printf("%s: %llu batches, %llu stalls\n", async ? "async" : "sync", (unsigned long long)wb->batches_written, (unsigned long long)wb->stalls );
+
+	qsort( latency, (size_t)num_adds, sizeof(double), compare_doubles );
+	results[0] = latency[num_adds / 2];
+	results[1] = latency[num_adds / 100 * 99];
+	results[2] = latency[num_adds / 1000 * 999];
+	results[3] = latency[num_adds - 1];
+	results[4] = num_adds / seconds;
+
+	free( latency );
+	flush_cache( store );
+	free_cache( store );
+	free_write_back( wb );
+	fclose( f );
+
+}
+
+static void run_write_back_benchmark() {
+
+	double sync[5], async[5];
+	write_back_latency( 0, sync );
+	write_back_latency( 1, async );
+
+	printf("add latency (ns), every add evicts a dirty item\n");
+	printf("write back\tp50\tp99\tp99.9\tmax\tadds/s\n");
+	printf("sync\t\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\n", sync[0], sync[1], sync[2], sync[3], sync[4] );
+	printf("async\t\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\n", async[0], async[1], async[2], async[3], async[4] );
+
+}
+
+// one thread doing random get/add/release with twice as many keys as fit (half the items loaded dirty),
+// with or without the cleaner. Fills in ops/s, eviction writes and cleaner writes
+static void cleaner_run( bool with_cleaner, double* results ) {
+
+	sharded_cache* store = new_sharded_cache( 64, CACHE_MEMORY_BYTES );
+	FILE* f = tmpfile();
+	write_back* wb = new_write_back( f, 1 );
+	sharded_set_write_back( store, wb );
+	cleaner* cl = with_cleaner ? start_cleaner( store, 25, 32, 1000 ) : NULL;
+
+	thread_params params = { .store = store, .num_keys = sharded_capacity( store ) * 2, .num_ops = 2 * 1000 * 1000, .seed = 1 };
+	double start = now_seconds();
+	cache_worker( &params );
+	results[0] = params.num_ops / (now_seconds() - start);
+
+	if( cl ) {
+		stop_cleaner( cl );
+	}
+	uint64_t eviction_writes, cleaner_writes;
+	sharded_write_counts( store, &eviction_writes, &cleaner_writes );
+	results[1] = (double)eviction_writes;
+	results[2] = (double)cleaner_writes;
+
+	free_sharded_cache( store );
+	free_write_back( wb );
+	fclose( f );
+
+}
+
+// every thread asks for the same new keys at about the same time, and keeps them pinned for a bit
+static void* herd_worker( void* params ) {
+
+	load_params* p = (load_params*) params;
+	for( int n=0; n<p->num_ops; n++ ) {
+		int key = n / 4;
+		item* i;
+		if( p->naive ) {
+			i = sharded_get_item( p->store, key );
+			if( i == NULL ) {
+				i = sharded_add_item( p->store, test_loader( key, p->ctx ) );
+			}
+		} else {
+			i = sharded_get_or_load( p->store, key, test_loader, p->ctx );
+		}
+		assert( i && i->id == key );
+		sharded_release_item( p->store, i );
+	}
+	return NULL;
+}
+
+// loads and seconds for 16 threads going through 1000 new keys, with a 100us load
+static void herd_run( bool naive, double* results ) {
+
+	sharded_cache* store = new_sharded_cache( 16, CACHE_MEMORY_BYTES );
+	load_ctx ctx = { .calls = 0, .sleep_us = 100 };
+	pthread_t threads[16];
+	load_params params[16];
+	double start = now_seconds();
+	for( int t=0; t<16; t++ ) {
+		params[t] = (load_params){ .store = store, .ctx = &ctx, .num_ops = 4000, .naive = naive };
+		pthread_create( &threads[t], NULL, herd_worker, &params[t] );
+	}
+	for( int t=0; t<16; t++ ) {
+		pthread_join( threads[t], NULL );
+	}
+	results[1] = now_seconds() - start;
+	results[0] = ctx.calls;
+	free_sharded_cache( store );
+
+}
+
+static void run_load_benchmark() {
+
+	double naive[2], single_flight[2];
+	herd_run( 1, naive );
+	herd_run( 0, single_flight );
+
+	printf("16 threads, 1000 keys\tloads\tseconds\n");
+	printf("get, load, add\t\t%.0f\t%.2f\n", naive[0], naive[1] );
+	printf("get_or_load\t\t%.0f\t%.2f\n", single_flight[0], single_flight[1] );
+
+}
+
+static void run_cleaner_benchmark() {
+
+	double without[3], with[3];
+	cleaner_run( 0, without );
+	cleaner_run( 1, with );
+
+	printf("cleaner\tops/s\teviction writes\tcleaner writes\n");
+	printf("off\t%.0f\t%.0f\t%.0f\n", without[0], without[1], without[2] );
+	printf("on\t%.0f\t%.0f\t%.0f\n", with[0], with[1], with[2] );
 
 }
 
+/*
+Synthetic traces. The hot set is half the capacity, used at random. Zipf is over 16 times the
+capacity of keys, key k (from 1) is used in proportion to 1/k. With scans every 4 * capacity
+of those there is a scan through twice the capacity of keys that are never used again.
+*/
+#define ZIPF_KEYS_PER_ITEM 16
+
+static void make_trace( int* trace, int length, int capacity, bool zipf, bool scans ) {
+
+	unsigned int seed = 42;
+	int num_keys = zipf ? ZIPF_KEYS_PER_ITEM * capacity : capacity / 2;
+	double* cdf = NULL;
+	if( zipf ) {
+		cdf = (double*) malloc( (size_t)num_keys * sizeof(double) );
+		double sum = 0;
+		for( int k=0; k<num_keys; k++ ) {
+			sum += 1.0 / (k + 1);
+			cdf[k] = sum;
+		}
+		for( int k=0; k<num_keys; k++ ) {
+			cdf[k] /= sum;
+		}
+	}
+	int next_scan_key = num_keys;
+	int n = 0;
+	while( n < length ) {
+		for( int i=0; i<4 * capacity && n < length; i++ ) {
+			if( !zipf ) {
+				trace[n++] = rand_r( &seed ) % num_keys;
+				continue;
+			}
+			// the first key with cdf >= u
+			double u = ((double)rand_r( &seed ) + 0.5) / ((double)RAND_MAX + 1);
+			int low = 0, high = num_keys - 1;
+			while( low < high ) {
+				int mid = low + (high - low) / 2;
+				if( cdf[mid] < u ) {
+					low = mid + 1;
+				} else {
+					high = mid;
+				}
+			}
+			trace[n++] = low;
+		}
+		for( int i=0; i<2 * capacity && n < length && scans; i++ ) {
+			trace[n++] = next_scan_key++;
+		}
+	}
+	free( cdf );
+}
+
+static double hit_ratio( policy p, bool admission, int* trace, int length ) {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	store->policy = p;
+	set_admission( store, admission );
+	int hits = 0;
+	for( int n=0; n<length; n++ ) {
+		item* i = get_item( store, trace[n] );
+		if( i ) {
+			hits++;
+		} else {
+			i = Item( trace[n], trace[n], 0 );
+			add_item( store, i );
+		}
+		release_item( store, i );
+	}
+	flush_cache( store );
+	free_cache( store );
+
+	return (double)hits / length;
+}
+
+#define IMAGE_BENCHMARK_BYTES (64*1024*1024)
+
+// gets of every key once, the misses load (add) the item like a cold cache would have to
+static int first_pass( cache* store ) {
+
+	int hits = 0;
+	for( int key=0; key<store->capacity; key++ ) {
+		item* i = get_item( store, key );
+		if( i ) {
+			hits++;
+		} else {
+			i = cache_alloc_item( store, key, key, 0 );
+			add_item( store, i );
+		}
+		release_item( store, i );
+	}
+	return hits;
+}
+
+// a restart with a new cache against one that reopens the image the last process left
+static void run_image_benchmark() {
+
+	char path[] = "/tmp/cache_image_XXXXXX";
+	int fd = mkstemp( path );
+	assert( fd >= 0 );
+	close( fd );
+
+	cache* store = open_cache_image( path, IMAGE_BENCHMARK_BYTES );
+	first_pass( store );
+	free_cache( store );
+
+	double start = now_seconds();
+	cache* cold = new_cache( IMAGE_BENCHMARK_BYTES );
+	double cold_open = now_seconds() - start;
+	int cold_hits = first_pass( cold );
+	flush_cache( cold );
+	free_cache( cold );
+
+	start = now_seconds();
+	store = open_cache_image( path, IMAGE_BENCHMARK_BYTES );
+	double warm_open = now_seconds() - start;
+	int warm_hits = first_pass( store );
+	int capacity = store->capacity;
+	size_t bytes = store->image_bytes;
+	free_cache( store );
+	unlink( path );
+
+	printf("restart\topen ms\thits in the first %d gets (image %lu MB)\n", capacity, (unsigned long)(bytes >> 20) );
+	printf("new\t%.1f\t%d\n", cold_open * 1000, cold_hits );
+	printf("image\t%.1f\t%d\n", warm_open * 1000, warm_hits );
+
+}
+
+// a full cache to a file and back into an empty one, about a million items
+static void run_snapshot_benchmark() {
+
+	cache* store = new_cache( IMAGE_BENCHMARK_BYTES );
+	for( int key=0; key<store->capacity; key++ ) {
+		item* i = Item( key, key, key % 4 == 0 );
+		add_item( store, i );
+		release_item( store, i );
+	}
+	FILE* file = tmpfile();
+	int fd = fileno( file );
+	double start = now_seconds();
+	assert( cache_snapshot( store, fd ) );
+	double snapshot = now_seconds() - start;
+	double bytes = (double)lseek( fd, 0, SEEK_CUR );
+
+	cache* restored = new_cache( IMAGE_BENCHMARK_BYTES );
+	lseek( fd, 0, SEEK_SET );
+	start = now_seconds();
+	assert( cache_restore( restored, fd ) );
+	double restore = now_seconds() - start;
+	assert( restored->num_stored == store->num_stored );
+
+	printf("%d items\tsnapshot ms\trestore ms\tbytes per item\n", store->num_stored );
+	printf("\t\t%.0f\t\t%.0f\t\t%.1f\n", snapshot * 1000, restore * 1000, bytes / store->num_stored );
+	fclose( file );
+	flush_cache( restored );
+	free_cache( restored );
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+/*
+Items from 64 bytes to 1MB (about log uniform) under a byte budget, with entries for many more of
+them than fit. Every add evicts until the new one fits, so how many that is depends on the size.
+*/
+static void run_byte_budget_benchmark() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	size_t budget = 256 * 1024 * 1024;
+	set_byte_budget( store, budget );
+	unsigned int seed = 42;
+	int num_adds = 2 * 1000 * 1000;
+	int* sizes = (int*) malloc( (size_t)num_adds * sizeof(int) );
+	for( int n=0; n<num_adds; n++ ) {
+		// a random power of two, and anywhere up to the next one
+		int low = 64 << (rand_r( &seed ) % 14);
+		sizes[n] = low + rand_r( &seed ) % low;
+	}
+
+	double start = now_seconds();
+	for( int n=0; n<num_adds; n++ ) {
+		item* i = Item( n, n, n % 4 == 0 );
+		i->size = sizes[n];
+		add_item( store, i );
+		release_item( store, i );
+	}
+	double seconds = now_seconds() - start;
+
+	cache_stats s = cache_stats_snapshot( store );
+	printf("byte budget %lu MB, %d entries\n", (unsigned long)(budget >> 20), store->capacity );
+	printf("ns per add\tevictions per add\tstored\tMB stored\n");
+	printf("%.0f\t\t%.2f\t\t\t%lu\t%.1f\n", seconds * 1e9 / num_adds, (double)(s.clean_evictions + s.dirty_evictions) / num_adds, s.stored, (double)s.bytes / (1 << 20) );
+	free( sizes );
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+static void run_policy_benchmark() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	int capacity = store->capacity;
+	free_cache( store );
+
+	const char* traces[] = { "hot set only\t", "hot set + scans\t", "zipf\t\t", "zipf + scans\t" };
+	int length = 60 * capacity;
+	int* trace = (int*) malloc( (size_t)length * sizeof(int) );
+	double ratios[4][2][3];
+	for( int t=0; t<4; t++ ) {
+		make_trace( trace, length, capacity, t >= 2, t % 2 );
+		for( int admission=0; admission<2; admission++ ) {
+			for( int p=POLICY_LRU; p<=POLICY_2Q; p++ ) {
+				ratios[t][admission][p] = hit_ratio( (policy)p, (bool)admission, trace, length );
+			}
+		}
+	}
+	free( trace );
+
+	printf("hit ratio (%d items)\tLRU\tCLOCK\t2Q\tTinyLFU: LRU\tCLOCK\t2Q\n", capacity );
+	for( int t=0; t<4; t++ ) {
+		printf("%s\t%.3f\t%.3f\t%.3f\t\t%.3f\t%.3f\t%.3f\n", traces[t], ratios[t][0][POLICY_LRU], ratios[t][0][POLICY_CLOCK], ratios[t][0][POLICY_2Q],
+			ratios[t][1][POLICY_LRU], ratios[t][1][POLICY_CLOCK], ratios[t][1][POLICY_2Q] );
+	}
+
+}
+
+/*
+The zipf trace with the misses filled the way a caller would (add the item), with and without a
+spill tier four times the size of the cache. The tier file is from tmpfile(), so its reads come
+from the page cache, not a disk: this shows what the tier saves in misses and what it costs in
+syscalls, not device latency.
+*/
+static void run_tier_benchmark() {
+
+	cache* store = new_cache( CACHE_MEMORY_BYTES );
+	int capacity = store->capacity;
+	free_cache( store );
+	int length = 20 * capacity;
+	int* trace = (int*) malloc( (size_t)length * sizeof(int) );
+	make_trace( trace, length, capacity, 1, 0 );
+
+	printf("spill tier (%d items in memory)\tmemory hits\ttier hits\tmisses\tns per get\n", capacity );
+	for( int with_tier=0; with_tier<2; with_tier++ ) {
+		store = new_cache( CACHE_MEMORY_BYTES );
+		FILE* f = tmpfile();
+		spill_tier* tier = new_spill_tier( fileno( f ), 4 * (size_t)capacity * sizeof(spill_record) );
+		store->tier = with_tier ? tier : NULL;
+		double start = now_seconds();
+		for( int n=0; n<length; n++ ) {
+			item* i = get_item( store, trace[n] );
+			if( i == NULL ) {
+				i = Item( trace[n], trace[n], 0 );
+				add_item( store, i );
+			}
+			release_item( store, i );
+		}
+		double seconds = now_seconds() - start;
+		cache_stats st = cache_stats_snapshot( store );
+		printf("%s\t\t\t\t%.3f\t\t%.3f\t\t%.3f\t%.0f\n", with_tier ? "with" : "without", (double)st.hits / length, (double)st.tier_hits / length,
+			(double)(st.misses - st.tier_hits) / length, seconds * 1e9 / length );
+		flush_cache( store );
+		free_cache( store );
+		free_spill_tier( tier );
+		fclose( f );
+	}
+	free( trace );
+
+}
+
+typedef struct lookup_params {
+	cache* store;
+	int* keys;
+	int num_keys;
+	int found;
+	int batch;
+} lookup_params;
+
+// get and release every key, the items are all released so every hit takes them off the available list and back
+static void lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	for( int k=0; k<p->num_keys; k++ ) {
+		item* i = get_item( p->store, p->keys[k] );
+		if( i ) {
+			p->found++;
+			release_item( p->store, i );
+		}
+	}
+
+}
+
+// the same through get_handle/release_handle
+static void handle_lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	for( int k=0; k<p->num_keys; k++ ) {
+		cache_handle h = get_handle( p->store, p->keys[k] );
+		if( h.item ) {
+			p->found++;
+			release_handle( p->store, h );
+		}
+	}
+
+}
+
+// the same through get_items/release_items, batch keys at a time
+static void batch_lookup_benchmark( void* params ) {
+
+	lookup_params* p = (lookup_params*) params;
+	item* items[p->batch];
+	for( int k=0; k<p->num_keys; k+=p->batch ) {
+		int n = p->num_keys - k < p->batch ? p->num_keys - k : p->batch;
+		get_items( p->store, p->keys + k, n, items );
+		for( int b=0; b<n; b++ ) {
+			p->found += items[b] != NULL;
+		}
+		release_items( p->store, items, n );
+	}
+
+}
+
+static void run_lookup_benchmark() {
+
+	// big enough that the entries don't fit in cache
+	cache* store = new_cache( 64 * CACHE_MEMORY_BYTES );
+
+	// random keys, so some buckets get chains
+	int* stored = (int*) malloc( (size_t)store->capacity * sizeof(int) );
+	unsigned int seed = 1234;
+	for( int n=0; n<store->capacity; n++ ) {
+		int key;
+		do {
+			key = rand_r( &seed ) & 0x7fffffff;
+		} while( get_item( store, key ) );
+		stored[n] = key;
+		item* i = Item( key, key, 0 );
+		add_item( store, i );
+		release_item( store, i );
+	}
+
+	int num_keys = 1000 * 1000;
+	int* hit_keys = (int*) malloc( (size_t)num_keys * sizeof(int) );
+	int* miss_keys = (int*) malloc( (size_t)num_keys * sizeof(int) );
+	for( int k=0; k<num_keys; k++ ) {
+		hit_keys[k] = stored[rand_r( &seed ) % store->capacity];
+		miss_keys[k] = (int)(rand_r( &seed ) & 0x7fffffff);
+	}
+
+	// best of a few runs
+	double hit_seconds = 1e9, miss_seconds = 1e9;
+	for( int run=0; run<5; run++ ) {
+		lookup_params hits = { .store = store, .keys = hit_keys, .num_keys = num_keys };
+		lookup_params misses = { .store = store, .keys = miss_keys, .num_keys = num_keys };
+		double start = now_seconds();
+		lookup_benchmark( &hits );
+		double middle = now_seconds();
+		lookup_benchmark( &misses );
+		double end = now_seconds();
+		assert( hits.found == num_keys );
+		hit_seconds = middle - start < hit_seconds ? middle - start : hit_seconds;
+		miss_seconds = end - middle < miss_seconds ? end - middle : miss_seconds;
+	}
+
+	double handle_seconds = 1e9;
+	for( int run=0; run<5; run++ ) {
+		lookup_params hits = { .store = store, .keys = hit_keys, .num_keys = num_keys };
+		double start = now_seconds();
+		handle_lookup_benchmark( &hits );
+		double seconds = now_seconds() - start;
+		assert( hits.found == num_keys );
+		handle_seconds = seconds < handle_seconds ? seconds : handle_seconds;
+	}
+
+	int batch_sizes[] = { 1, 8, 64, 256 };
+	int num_batches = sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+	double batch_seconds[num_batches];
+	for( int b=0; b<num_batches; b++ ) {
+		batch_seconds[b] = 1e9;
+		for( int run=0; run<5; run++ ) {
+			lookup_params batched = { .store = store, .keys = hit_keys, .num_keys = num_keys, .batch = batch_sizes[b] };
+			double start = now_seconds();
+			batch_lookup_benchmark( &batched );
+			double seconds = now_seconds() - start;
+			assert( batched.found == num_keys );
+			batch_seconds[b] = seconds < batch_seconds[b] ? seconds : batch_seconds[b];
+		}
+	}
+
+	printf("entry bytes\tbytes per item\titems in %d MB\thit lookups/s\tmiss lookups/s\n", 64 * CACHE_MEMORY_BYTES / (1024*1024) );
+	printf("%lu\t\t%lu\t\t%d\t\t%.0f\t%.0f\n", sizeof(entry), MEMORY_PER_ITEM + MEMORY_PER_BUCKET, store->capacity, num_keys / hit_seconds, num_keys / miss_seconds );
+	printf("batch\tns per hit\n");
+	printf("single\t%.1f\n", hit_seconds * 1e9 / num_keys );
+	printf("handle\t%.1f\n", handle_seconds * 1e9 / num_keys );
+	for( int b=0; b<num_batches; b++ ) {
+		printf("%d\t%.1f\n", batch_sizes[b], batch_seconds[b] * 1e9 / num_keys );
+	}
+
+	free( stored );
+	free( hit_keys );
+	free( miss_keys );
+	flush_cache( store );
+	free_cache( store );
+
+}
+
+#endif
+
 int main() {
+
+#ifdef BENCHMARK
+	run_lookup_benchmark();
+	run_thread_benchmark();
+	run_write_back_benchmark();
+	run_cleaner_benchmark();
+	run_load_benchmark();
+	run_image_benchmark();
+	run_snapshot_benchmark();
+	run_byte_budget_benchmark();
+	run_policy_benchmark();
+	run_tier_benchmark();
+	return 0;
+#endif
 	
 	srand( (unsigned int)time(NULL) );
 
 	test_empty();
 	test_add_release();
 	test_revive();
+	test_sizing();
+	test_write_back();
+	test_write_back_errors();
+	test_write_back_miss();
+	test_cleaner();
+	test_policies();
+
+	test_batch();
+
+	test_stats();
+
+	test_image();
+
+	test_snapshot();
+
+	test_byte_budget();
+
+	test_handles();
+
+	test_tier();
+
+	test_admission();
 	
 	test_sim();
 
+	test_threads();
+
+	test_front();
+
+	test_get_or_load();
+
+#ifdef TRACE_RING
+	test_trace_ring();
+#endif
+
 	printf("Item allocs %llu\n", item_allocs);
 	printf("Item frees  %llu\n", item_frees);
 }
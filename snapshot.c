@@ -0,0 +1,186 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h> // read, write
+
+/*
+The file format of cache_snapshot/cache_restore, for both caches. The caches pack their own
+records (fixed size, no padding, host byte order), this frames them:
+
+ header: magic, version, record size, number of records
+ blocks: bytes in the block, checksum of those bytes, then the records (at most SNAPSHOT_BLOCK bytes)
+
+Every block is checked before any of its records are handed out, so a restore never uses a
+damaged record, and it's still one pass over the file with a buffer of one block. A bad block
+ends the read, the records before it are good. The checksum is 32 bit FNV-1a, it catches
+damage, not tampering.
+*/
+
+#define SNAPSHOT_MAGIC 0x50414e53 // "SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BLOCK (64*1024)
+
+typedef struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t byte_alignment_padding;
+	uint64_t count;
+} snapshot_header;
+
+typedef struct snapshot_block {
+	uint32_t bytes;
+	uint32_t checksum;
+} snapshot_block;
+
+typedef struct snapshot_file {
+	int fd;
+	bool ok; // no I/O error, bad header or bad block so far
+	size_t record_size;
+	uint64_t count; // records in the file
+	uint64_t done; // written or handed out so far
+	size_t used; // bytes in buf
+	size_t pos; // next record in buf when reading
+	uint8_t buf[SNAPSHOT_BLOCK];
+} snapshot_file;
+
+snapshot_file* snapshot_write_begin( int fd, size_t record_size, uint64_t count );
+void snapshot_put( snapshot_file* s, const void* record );
+bool snapshot_write_end( snapshot_file* s );
+snapshot_file* snapshot_read_begin( int fd, size_t record_size );
+const uint8_t* snapshot_next( snapshot_file* s );
+bool snapshot_read_end( snapshot_file* s );
+
+static uint32_t snapshot_checksum( const uint8_t* bytes, size_t n ) {
+
+	uint32_t h = 2166136261u;
+	for( size_t i=0; i<n; i++ ) {
+		h = (h ^ bytes[i]) * 16777619u;
+	}
+	return h;
+}
+
+static bool write_all( int fd, const void* data, size_t n ) {
+
+	const uint8_t* p = (const uint8_t*) data;
+	while( n > 0 ) {
+		ssize_t written = write( fd, p, n );
+		if( written <= 0 ) {
+			return 0;
+		}
+		p += written;
+		n -= (size_t)written;
+	}
+	return 1;
+}
+
+// false at the end of the file too
+static bool read_all( int fd, void* data, size_t n ) {
+
+	uint8_t* p = (uint8_t*) data;
+	while( n > 0 ) {
+		ssize_t got = read( fd, p, n );
+		if( got <= 0 ) {
+			return 0;
+		}
+		p += got;
+		n -= (size_t)got;
+	}
+	return 1;
+}
+
+static void snapshot_flush( snapshot_file* s ) {
+
+	if( s->used == 0 ) {
+		return;
+	}
+	snapshot_block b = { .bytes = (uint32_t)s->used, .checksum = snapshot_checksum( s->buf, s->used ) };
+	s->ok = s->ok && write_all( s->fd, &b, sizeof(b) ) && write_all( s->fd, s->buf, s->used );
+	s->used = 0;
+}
+
+// count is how many records will be put, the reader needs it up front
+snapshot_file* snapshot_write_begin( int fd, size_t record_size, uint64_t count ) {
+
+	assert( record_size > 0 && record_size <= SNAPSHOT_BLOCK );
+	snapshot_file* s = (snapshot_file*) malloc( sizeof(snapshot_file) );
+	assert( s );
+	s->fd = fd;
+	s->record_size = record_size;
+	s->count = count;
+	s->done = 0;
+	s->used = 0;
+	s->pos = 0;
+	snapshot_header h = { .magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .record_size = (uint32_t)record_size, .byte_alignment_padding = 0, .count = count };
+	s->ok = write_all( fd, &h, sizeof(h) );
+	return s;
+}
+
+void snapshot_put( snapshot_file* s, const void* record ) {
+
+	if( s->used + s->record_size > SNAPSHOT_BLOCK ) {
+		snapshot_flush( s );
+	}
+	memcpy( s->buf + s->used, record, s->record_size );
+	s->used += s->record_size;
+	s->done++;
+}
+
+// true if everything was written, and it was as many records as promised
+bool snapshot_write_end( snapshot_file* s ) {
+
+	snapshot_flush( s );
+	bool ok = s->ok && s->done == s->count;
+	free( s );
+	return ok;
+}
+
+// NULL if there's no header for records of this size
+snapshot_file* snapshot_read_begin( int fd, size_t record_size ) {
+
+	snapshot_header h;
+	if( !read_all( fd, &h, sizeof(h) ) || h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || h.record_size != record_size ) {
+		return NULL;
+	}
+	snapshot_file* s = (snapshot_file*) malloc( sizeof(snapshot_file) );
+	assert( s );
+	s->fd = fd;
+	s->ok = 1;
+	s->record_size = record_size;
+	s->count = h.count;
+	s->done = 0;
+	s->used = 0;
+	s->pos = 0;
+	return s;
+}
+
+// the next record, NULL after the last one or a bad block
+const uint8_t* snapshot_next( snapshot_file* s ) {
+
+	if( !s->ok || s->done == s->count ) {
+		return NULL;
+	}
+	if( s->pos == s->used ) {
+		snapshot_block b;
+		s->ok = read_all( s->fd, &b, sizeof(b) ) && b.bytes > 0 && b.bytes <= SNAPSHOT_BLOCK && b.bytes % s->record_size == 0
+			&& read_all( s->fd, s->buf, b.bytes ) && snapshot_checksum( s->buf, b.bytes ) == b.checksum;
+		if( !s->ok ) {
+			return NULL;
+		}
+		s->used = b.bytes;
+		s->pos = 0;
+	}
+	const uint8_t* record = s->buf + s->pos;
+	s->pos += s->record_size;
+	s->done++;
+	return record;
+}
+
+// true if every record in the file was good and handed out
+bool snapshot_read_end( snapshot_file* s ) {
+
+	bool ok = s->ok && s->done == s->count && s->pos == s->used;
+	free( s );
+	return ok;
+}
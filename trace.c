@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+Tracing for the caches. Two independent parts:
+
+TRACE_EVENT/TRACE_OP/TRACE_STEP printf at increasing detail, and compile to nothing above
+TRACE_LEVEL: 0 = nothing, 1 = rare events (resizes, full cache, write back stalls),
+2 = every operation, 3 = every probe or chain step. Tests default to 3, benchmarks
+(and -DNO_TRACE) to 0, -DTRACE_LEVEL=n overrides both.
+
+TRACE_RECORD puts a binary event in a ring buffer in memory, only with -DTRACE_RING (size
+with -DTRACE_RING_SIZE, a power of two). Any number of threads can record, it's one
+fetch_add per event and the oldest events get overwritten. trace_dump prints what's left,
+after the run.
+*/
+
+#ifndef TRACE_LEVEL
+#if defined(NO_TRACE) || defined(BENCHMARK)
+#define TRACE_LEVEL 0
+#else
+#define TRACE_LEVEL 3
+#endif
+#endif
+
+#if TRACE_LEVEL >= 1
+#define TRACE_EVENT(...) printf(__VA_ARGS__)
+#else
+#define TRACE_EVENT(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 2
+#define TRACE_OP(...) printf(__VA_ARGS__)
+#else
+#define TRACE_OP(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 3
+#define TRACE_STEP(...) printf(__VA_ARGS__)
+#else
+#define TRACE_STEP(...) ((void)0)
+#endif
+
+typedef enum trace_type {
+	TRACE_ADD, // a = key, b = slot or entry
+	TRACE_HIT, // a = key, b = refcount after (0 where a lock free path doesn't know it)
+	TRACE_MISS, // a = key
+	TRACE_RELEASE, // a = key, b = refcount after (same)
+	TRACE_EVICT, // a = key, b = dirty
+	TRACE_WRITE, // a = key, dirty item written before it was evicted
+	TRACE_FULL, // a = key that didn't fit, b = its size (weighted items only)
+	TRACE_RESIZE, // a = new capacity, b = slots or buckets
+	TRACE_STALL, // write back queue was full, a = key
+	TRACE_EXPIRE, // a = key, b = dirty, it was past its ttl
+	TRACE_REJECT, // a = key, b = its estimated use count, admission kept the item it would have evicted
+	TRACE_SPILL, // a = key, b = record, evicted clean item written to the second tier
+	TRACE_FILL, // a = key, b = 1 if from the write back queue, a miss got it back from the second tier or the queue
+	NUM_TRACE_TYPES
+} trace_type;
+
+#ifdef TRACE_RING
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 4096
+#endif
+
+typedef struct trace_event {
+	uint64_t seq; // 1 + the event number once it's written, 0 while it's being written
+	uint64_t time; // trace_clock()
+	uint64_t a;
+	uint64_t b;
+	uint32_t type;
+	char byte_alignment_padding[4];
+} trace_event;
+
+static trace_event trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_next = 0;
+
+void trace_record( trace_type type, uint64_t a, uint64_t b );
+size_t trace_read( trace_event* out, size_t max );
+void trace_dump( FILE* out );
+void trace_reset( void );
+
+// the timestamp counter where there is one, clock_gettime costs more than the cache operation
+static inline uint64_t trace_clock( void ) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void trace_record( trace_type type, uint64_t a, uint64_t b ) {
+
+	uint64_t time = trace_clock();
+	uint64_t n = __atomic_fetch_add( &trace_next, 1, __ATOMIC_RELAXED );
+	trace_event* e = &trace_ring[n & (TRACE_RING_SIZE - 1)];
+	// the fields are atomic too so a concurrent trace_read sees old or new values, and the seq tells which
+	__atomic_store_n( &e->seq, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	__atomic_store_n( &e->time, time, __ATOMIC_RELAXED );
+	__atomic_store_n( &e->a, a, __ATOMIC_RELAXED );
+	__atomic_store_n( &e->b, b, __ATOMIC_RELAXED );
+	__atomic_store_n( &e->type, (uint32_t)type, __ATOMIC_RELAXED );
+	__atomic_store_n( &e->seq, n + 1, __ATOMIC_RELEASE );
+
+}
+
+// copies the events still in the ring, oldest first, skipping ones that were overwritten or half written
+size_t trace_read( trace_event* out, size_t max ) {
+
+	uint64_t end = __atomic_load_n( &trace_next, __ATOMIC_ACQUIRE );
+	uint64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+	if( end - start > max ) {
+		start = end - max;
+	}
+	size_t count = 0;
+	for( uint64_t n=start; n<end; n++ ) {
+		trace_event* e = &trace_ring[n & (TRACE_RING_SIZE - 1)];
+		trace_event copy;
+		copy.seq = __atomic_load_n( &e->seq, __ATOMIC_ACQUIRE );
+		copy.time = __atomic_load_n( &e->time, __ATOMIC_RELAXED );
+		copy.a = __atomic_load_n( &e->a, __ATOMIC_RELAXED );
+		copy.b = __atomic_load_n( &e->b, __ATOMIC_RELAXED );
+		copy.type = __atomic_load_n( &e->type, __ATOMIC_RELAXED );
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		if( copy.seq == n + 1 && __atomic_load_n( &e->seq, __ATOMIC_RELAXED ) == n + 1 ) {
+			out[count++] = copy;
+		}
+	}
+	return count;
+}
+
+void trace_dump( FILE* out ) {
+
+	static const char* names[NUM_TRACE_TYPES] = { "add", "hit", "miss", "release", "evict", "write", "full", "resize", "stall", "expire", "reject", "spill", "fill" };
+	static trace_event events[TRACE_RING_SIZE];
+	size_t count = trace_read( events, TRACE_RING_SIZE );
+	uint64_t total = __atomic_load_n( &trace_next, __ATOMIC_RELAXED );
+	fprintf( out, "%lu trace events, last %lu (times are trace_clock() ticks since the first):\n", (unsigned long)total, (unsigned long)count );
+	for( size_t n=0; n<count; n++ ) {
+		trace_event* e = &events[n];
+		fprintf( out, "%lu\t+%lu\t%s\t%lu\t%lu\n", (unsigned long)(e->seq - 1), (unsigned long)(e->time - events[0].time),
+			e->type < NUM_TRACE_TYPES ? names[e->type] : "?", (unsigned long)e->a, (unsigned long)e->b );
+	}
+
+}
+
+// only when nothing is recording
+void trace_reset( void ) {
+
+	__atomic_store_n( &trace_next, 0, __ATOMIC_RELEASE );
+	for( size_t n=0; n<TRACE_RING_SIZE; n++ ) {
+		__atomic_store_n( &trace_ring[n].seq, 0, __ATOMIC_RELAXED );
+	}
+
+}
+
+#define TRACE_RECORD(type, a, b) trace_record( type, (uint64_t)(a), (uint64_t)(b) )
+
+#else
+
+#define TRACE_RECORD(type, a, b) ((void)0)
+
+#endif